@@ -0,0 +1,88 @@
+/*
+ * BVH build benchmark: build time, SAH cost and depth against thread count,
+ * for synthetic scenes of small random triangles. Depth must stay within
+ * BVH_MAX_DEPTH for the shaders to traverse the tree.
+ *
+ * Usage: bvhbench [maxPrimitives]
+ */
+
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+
+#include "bvh.hpp"
+#include "threadpool.hpp"
+
+#define DEFAULT_MAX_PRIMITIVES 10000000
+#define SCENE_SIZE 100.0f
+#define TRIANGLE_SIZE 0.5f
+
+// Bounds of random triangles scattered through a cube, denser towards the centre
+// so that SAH splits have something to find.
+std::vector<AABB> makeScene(int numPrimitives) {
+  std::vector<AABB> bounds(numPrimitives);
+  srand(numPrimitives);
+  for (int i = 0; i < numPrimitives; i++) {
+    glm::vec3 centre;
+    for (int axis = 0; axis < 3; axis++) {
+      float u = rand() / (float)RAND_MAX;
+      centre[axis] = SCENE_SIZE * u * u * u;
+    }
+    AABB b;
+    for (int v = 0; v < 3; v++) {
+      glm::vec3 offset(rand() / (float)RAND_MAX, rand() / (float)RAND_MAX, rand() / (float)RAND_MAX);
+      b.grow(centre + TRIANGLE_SIZE * offset);
+    }
+    bounds[i] = b;
+  }
+  return bounds;
+}
+
+int main(int argc, char* argv[]) {
+  int maxPrimitives = argc > 1 ? atoi(argv[1]) : DEFAULT_MAX_PRIMITIVES;
+  int maxThreads = ThreadPool::getDefaultNumThreads();
+
+  std::cout << std::setw(12) << "primitives"
+    << std::setw(10) << "threads"
+    << std::setw(12) << "build ms"
+    << std::setw(10) << "speedup"
+    << std::setw(12) << "nodes"
+    << std::setw(12) << "SAH cost"
+    << std::setw(8) << "depth" << std::endl;
+
+  for (int numPrimitives = 1000; numPrimitives <= maxPrimitives; numPrimitives *= 10) {
+    std::vector<AABB> bounds = makeScene(numPrimitives);
+    double serialTime = 0;
+
+    for (int numThreads = 1; ; numThreads *= 2) {
+      if (numThreads > maxThreads) {
+        numThreads = maxThreads;
+      }
+
+      ThreadPool pool(numThreads);
+      BVH bvh;
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      bvh.build(bounds, numThreads > 1 ? &pool : NULL);
+      double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      if (numThreads == 1) {
+        serialTime = ms;
+      }
+
+      std::cout << std::setw(12) << numPrimitives
+        << std::setw(10) << numThreads
+        << std::setw(12) << std::fixed << std::setprecision(2) << ms
+        << std::setw(10) << serialTime / ms
+        << std::setw(12) << bvh.getNumNodes()
+        << std::setw(12) << bvh.getSAHCost()
+        << std::setw(8) << bvh.getDepth() << std::endl;
+
+      if (numThreads == maxThreads) {
+        break;
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,97 @@
+// Primary rays and reprojection into the previous frame, shared by
+// raytrace.frag and the wavefront stages. Include after scene.glsl.
+
+// A reprojected hit matches if within this fraction of its distance from the camera.
+#define TEMPORAL_POSITION_TOLERANCE 0.01
+// Pixels reusing the last frame are traced again in square tiles of this many,
+// one tile in TEMPORAL_REFRESH_PERIOD each frame, so view-dependent shading catches up.
+#define TEMPORAL_TILE_SIZE 8
+#define TEMPORAL_REFRESH_PERIOD 4
+
+uniform vec2 screenResolution;
+uniform vec3 cameraPosition;
+uniform vec3 cameraDirection;
+// Offset of this sample's ray from the pixel centre, in pixels.
+uniform vec2 pixelJitter;
+
+// The last frame's colour and primaryHit, as seen with the previous camera
+// at previousResolution, for reuse where its surfaces are still visible.
+uniform sampler2D historyColour;
+uniform sampler2D historyHits;
+uniform bool reuseHistory;
+uniform vec3 previousCameraPosition;
+uniform vec3 previousCameraDirection;
+uniform vec2 previousResolution;
+uniform int frameIndex;
+
+
+
+float luminance(vec3 c) {
+  return dot(c, vec3(0.2126, 0.7152, 0.0722));
+}
+
+// Size of the image plane, at distance 1 in front of the camera.
+vec2 viewPlaneSize(vec2 resolution) {
+  float d = 1.0;
+  float virtualH = 2.0 * d * tan(45.0/2.0);
+  float virtualW = resolution.x / resolution.y * virtualH;
+  return vec2(virtualW, virtualH);
+}
+
+// Columns are the camera's right, up and forward directions.
+mat3 cameraBasis(vec3 direction) {
+  vec3 w = normalize(direction);
+  vec3 u = normalize(cross(w, vec3(0, 1, 0)));
+  vec3 v = cross(u, w);
+  return mat3(u, v, w);
+}
+
+// The last frame's colour where it saw the surface at p, if it did.
+bool reproject(vec3 p, out vec4 previousColour) {
+  // Inverse of primaryRay(), with the previous camera.
+  vec3 local = transpose(cameraBasis(previousCameraDirection)) * (p - previousCameraPosition);
+  if (local.z <= 0) {
+    return false;
+  }
+  vec2 pixel = local.xy / local.z * previousResolution / viewPlaneSize(previousResolution) + 0.5 * previousResolution;
+  if (any(lessThan(pixel, vec2(0))) || any(greaterThanEqual(pixel, previousResolution))) {
+    return false;
+  }
+
+  // Anything else there, including whatever hid p before it was disoccluded,
+  // is too far from p.
+  ivec2 texel = ivec2(pixel);
+  vec4 previousHit = texelFetch(historyHits, texel, 0);
+  if (previousHit.w == 0 || distance(previousHit.xyz, p) > TEMPORAL_POSITION_TOLERANCE * previousHit.w) {
+    return false;
+  }
+  previousColour = texelFetch(historyColour, texel, 0);
+  return true;
+}
+
+// Ray through pixel, in window coordinates of the screenResolution image
+// with texel centres at .5, offset by pixelJitter.
+Ray primaryRay(vec2 pixelCoord) {
+  float d = 1.0;
+  vec2 virtualSize = viewPlaneSize(screenResolution);
+
+  vec3 pixel = vec3(pixelCoord + pixelJitter, d);
+  // Translate pixel to origin and scale.
+  vec3 pixel2 = (pixel - 0.5*vec3(screenResolution, 0)) * vec3(virtualSize/screenResolution, 1.0);
+
+  mat3 rotatePixelToWCS = cameraBasis(cameraDirection);
+
+  // Apply view transformation.
+  vec3 pixel3 = rotatePixelToWCS * pixel2;
+  vec3 pixel4 = pixel3 + cameraPosition;
+
+  // Construct ray.
+  return Ray(cameraPosition, normalize(pixel4 - cameraPosition));
+}
+
+// Whether pixel is due to be traced again even if it could reuse the last
+// frame. Whole tiles decide alike, to keep neighbouring pixels on the same branch.
+bool isRefreshTile(ivec2 pixel) {
+  ivec2 tile = pixel / TEMPORAL_TILE_SIZE;
+  return (tile.x + 3 * tile.y + frameIndex) % TEMPORAL_REFRESH_PERIOD == 0;
+}
@@ -0,0 +1,44 @@
+#version 330 core
+
+// Standard deviation of the Gaussian falloff in a neighbour's weight with its
+// luminance difference from the nearest texel. Edges stay sharp, gradients blend.
+#define EDGE_LUMINANCE_SIGMA 0.1
+
+uniform sampler2D image;
+// Texels of image in use, from its bottom left corner.
+uniform vec2 imageSize;
+uniform vec2 screenResolution;
+
+layout(location = 0) out vec3 colour;
+
+float luminance(vec3 c) {
+  return dot(c, vec3(0.2126, 0.7152, 0.0722));
+}
+
+vec3 fetch(ivec2 texel) {
+  return texelFetch(image, clamp(texel, ivec2(0), ivec2(imageSize) - 1), 0).rgb;
+}
+
+// Bilinear upscaling, except that each of the four texels is down-weighted by
+// how far its luminance is from the nearest one's. At full scale every pixel
+// lands on a texel centre and this is a plain copy.
+void main() {
+  vec2 t = gl_FragCoord.xy * imageSize / screenResolution - 0.5;
+  ivec2 base = ivec2(floor(t));
+  vec2 f = t - floor(t);
+
+  vec3 c00 = fetch(base);
+  vec3 c10 = fetch(base + ivec2(1, 0));
+  vec3 c01 = fetch(base + ivec2(0, 1));
+  vec3 c11 = fetch(base + ivec2(1, 1));
+  vec4 w = vec4((1 - f.x) * (1 - f.y), f.x * (1 - f.y), (1 - f.x) * f.y, f.x * f.y);
+
+  vec4 l = vec4(luminance(c00), luminance(c10), luminance(c01), luminance(c11));
+  ivec2 nearestCorner = ivec2(greaterThanEqual(f, vec2(0.5)));
+  float nearest = l[nearestCorner.x + 2 * nearestCorner.y];
+  vec4 d = (l - nearest) / EDGE_LUMINANCE_SIGMA;
+  w *= exp(-0.5 * d * d);
+
+  // The nearest texel keeps its weight, so the sum is never 0.
+  colour = (w.x * c00 + w.y * c10 + w.z * c01 + w.w * c11) / dot(w, vec4(1));
+}
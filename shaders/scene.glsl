@@ -0,0 +1,726 @@
+// Scene description and intersection, shared by raytrace.frag and the
+// wavefront stages. Included after their #version; needs 330 or later.
+
+// Traversal holds at most one entry per level plus one, so this must be at
+// least BVH_MAX_DEPTH + 1 (see bvh.hpp), which the BVH builder guarantees.
+#define BVH_STACK_SIZE 32
+
+#define SPHERE_BVH 0
+#define TRIANGLE_BVH 1
+#define INSTANCE_BVH 2
+
+// Mirror or refraction bounces followed at most, and the weight below which
+// a path is no longer worth following.
+#define MAX_DEPTH 10
+#define MIN_CONTRIBUTION 0.01
+
+// Lights picked from the light tree per hit when sampleLights is set. Must
+// match LIGHT_TREE_SAMPLES in lightgrid.hpp.
+#define LIGHT_TREE_SAMPLES 2
+// Distance below which the light tree no longer favours a node for being closer.
+#define LIGHT_TREE_MIN_DISTANCE 0.1
+
+// Features a program can be specialized without by defining them as 0, from
+// the Settings of the same names. See Viewer::shaderDefines().
+#ifndef LIGHT_DIFFUSE
+#define LIGHT_DIFFUSE 1
+#endif
+#ifndef LIGHT_SPECULAR
+#define LIGHT_SPECULAR 1
+#endif
+#ifndef SHADOWS
+#define SHADOWS 1
+#endif
+#ifndef MIRRORS
+#define MIRRORS 1
+#endif
+
+struct Ray {
+  vec3 p;
+  vec3 d;
+};
+
+struct Intersection {
+  bool hit;
+  float t; // Distance along the ray, in units of its direction.
+  vec3 p;
+  vec3 n;
+  int materialId;
+};
+
+struct Sphere {
+  vec3 center;
+  float radius;
+  int materialId;
+};
+
+struct Light {
+  vec3 position;
+  vec3 colour;
+  // Attenuation is 1 / (falloff.x + falloff.y d + falloff.z d^2), faded to 0 at
+  // radius. A negative radius never ends.
+  vec3 falloff;
+  float radius;
+};
+
+struct Material {
+  vec3 ke;
+  float refraction;
+  vec3 ka;
+  float ior;
+  vec3 kd;
+  float mirror;
+  vec3 ks;
+  float shine;
+};
+
+// Mip l is prefiltered for GGX roughness l / skyboxMaxLod.
+uniform samplerCube skyboxTexture;
+uniform float skyboxMaxLod;
+// Cosine-convolved skybox: what a white diffuse surface facing each way reflects.
+uniform samplerCube irradianceTexture;
+
+// Spheres in BVH leaf order: (center, radius) and a material index per sphere.
+uniform samplerBuffer spheres;
+uniform isamplerBuffer sphereMaterials;
+#ifdef NUM_SPHERES
+const int numSpheres = NUM_SPHERES;
+#else
+uniform int numSpheres;
+#endif
+// Flattened BVH over spheres, two texels per node: (min, leftFirst) (max, count).
+uniform samplerBuffer sphereBVH;
+
+// Object-space triangles of every unique mesh, with one BVH per mesh in the same
+// layout as sphereBVH, all sharing triangleBVH.
+uniform samplerBuffer triangleBVH;
+// Positions quantized to 16 bits over their mesh's bounds, and octahedral
+// encoded normals, as snorm16.
+uniform samplerBuffer triangleVertices;
+uniform isamplerBuffer triangleNormals;
+uniform isamplerBuffer triangles; // (vertex0, vertex1, vertex2, 0).
+// Mesh instances in instanceBVH leaf order, six texels each: the rows of the
+// world-to-object matrix, then (root node in triangleBVH, materialId) as int
+// bits, then the mesh's position offset and scale.
+#ifdef NUM_INSTANCES
+const int numInstances = NUM_INSTANCES;
+#else
+uniform int numInstances;
+#endif
+uniform samplerBuffer instanceBVH;
+uniform samplerBuffer instances;
+// Four texels per material: (ke, refraction) (ka, ior) (kd, mirror) (ks, shine).
+uniform samplerBuffer materials;
+// Three texels per light: (position, influence radius) (colour, 0) (falloff, 0).
+// Then the light tree, three texels per node from the root: (min, leftFirst)
+// (max, count) (power, 0, 0, 0), where leaves hold a light index in leftFirst.
+uniform samplerBuffer lights;
+#ifdef NUM_LIGHTS
+const int numLights = NUM_LIGHTS;
+#else
+uniform int numLights;
+#endif
+// Lights binned into a world-space grid over lightGridDims cells from
+// lightGridMin: (first, count) per cell with x fastest, then the indices of
+// the numGlobalLights lights that reach everywhere, then each cell's list.
+uniform isamplerBuffer lightGrid;
+#ifdef NUM_GLOBAL_LIGHTS
+const int numGlobalLights = NUM_GLOBAL_LIGHTS;
+#else
+uniform int numGlobalLights;
+#endif
+uniform vec3 lightGridMin;
+uniform vec3 lightGridCellSize;
+uniform ivec3 lightGridDims;
+// Shade each hit with LIGHT_TREE_SAMPLES lights picked from the light tree,
+// rather than every light near it.
+uniform bool sampleLights;
+// Samples accumulated so far in a still view, so each draws different lights.
+uniform int sampleIndex;
+
+
+Sphere fetchSphere(int i) {
+  vec4 centerRadius = texelFetch(spheres, i);
+  return Sphere(centerRadius.xyz, centerRadius.w, texelFetch(sphereMaterials, i).x);
+}
+
+Material fetchMaterial(int i) {
+  vec4 m0 = texelFetch(materials, 4*i);
+  vec4 m1 = texelFetch(materials, 4*i + 1);
+  vec4 m2 = texelFetch(materials, 4*i + 2);
+  vec4 m3 = texelFetch(materials, 4*i + 3);
+  return Material(m0.xyz, m0.w, m1.xyz, m1.w, m2.xyz, m2.w, m3.xyz, m3.w);
+}
+
+Light fetchLight(int i) {
+  vec4 positionRadius = texelFetch(lights, 3*i);
+  return Light(positionRadius.xyz, texelFetch(lights, 3*i + 1).xyz, texelFetch(lights, 3*i + 2).xyz, positionRadius.w);
+}
+
+// Lights that may reach p are the global ones, then those binned in p's cell.
+// Returns how many there are, and where the cell's list starts for lightNear().
+int numLightsNear(vec3 p, out int cellFirst) {
+  cellFirst = 0;
+  ivec3 cell = ivec3(floor((p - lightGridMin) / lightGridCellSize));
+  if (any(lessThan(cell, ivec3(0))) || any(greaterThanEqual(cell, lightGridDims))) {
+    return numGlobalLights;
+  }
+  int cellIdx = (cell.z * lightGridDims.y + cell.y) * lightGridDims.x + cell.x;
+  cellFirst = texelFetch(lightGrid, 2*cellIdx).x;
+  return numGlobalLights + texelFetch(lightGrid, 2*cellIdx + 1).x;
+}
+
+// Index of the k'th light near a point, for k below numLightsNear().
+int lightNear(int k, int cellFirst) {
+  int globalFirst = 2 * lightGridDims.x * lightGridDims.y * lightGridDims.z;
+  return texelFetch(lightGrid, k < numGlobalLights ? globalFirst + k : cellFirst + k - numGlobalLights).x;
+}
+
+// Cells list every light whose influence overlaps them, so check the point itself.
+bool lightReaches(Light light, vec3 p) {
+  return light.radius < 0 || distance(light.position, p) < light.radius;
+}
+
+// Uniform in [0, 1), hashed from seed with the PCG 3D hash.
+float random(uvec3 seed) {
+  uvec3 v = seed * 1664525u + 1013904223u;
+  v.x += v.y * v.z;
+  v.y += v.z * v.x;
+  v.z += v.x * v.y;
+  v ^= v >> 16u;
+  v.x += v.y * v.z;
+  v.y += v.z * v.x;
+  v.z += v.x * v.y;
+  return float(v.x >> 8u) / 16777216.0;
+}
+
+// Rough share of light that a light tree node sends to p: its power over the
+// squared distance to its centre. Within about the node's own size, distance
+// says little about which of its lights is closer, so it stops counting there.
+float lightTreeImportance(int node, vec3 p) {
+  int texel = 3*numLights + 3*node;
+  vec3 nodeMin = texelFetch(lights, texel).xyz;
+  vec3 nodeMax = texelFetch(lights, texel + 1).xyz;
+  float power = texelFetch(lights, texel + 2).x;
+  vec3 toCentre = 0.5 * (nodeMin + nodeMax) - p;
+  vec3 extent = nodeMax - nodeMin;
+  float minDistanceSquared = max(0.25 * dot(extent, extent), LIGHT_TREE_MIN_DISTANCE * LIGHT_TREE_MIN_DISTANCE);
+  return power / max(dot(toCentre, toCentre), minDistanceSquared);
+}
+
+// Pick a light for p by descending the light tree from the root, taking each
+// child with probability in proportion to its importance, so the cost grows
+// with the log of the number of lights. u in [0, 1) makes the choices, and
+// pdf is the probability of the light returned.
+int sampleLightTree(vec3 p, float u, out float pdf) {
+  pdf = 1;
+  int node = 0;
+  while (true) {
+    int texel = 3*numLights + 3*node;
+    int leftFirst = floatBitsToInt(texelFetch(lights, texel).w);
+    if (floatBitsToInt(texelFetch(lights, texel + 1).w) > 0) {
+      return leftFirst;
+    }
+    float left = lightTreeImportance(leftFirst, p);
+    float right = lightTreeImportance(leftFirst + 1, p);
+    float pLeft = left + right > 0 ? left / (left + right) : 0.5;
+    // Rescale u to [0, 1) within the chosen child's share, for the choices below it.
+    if (u < pLeft) {
+      u = u / pLeft;
+      pdf *= pLeft;
+      node = leftFirst;
+    } else {
+      u = (u - pLeft) / (1 - pLeft);
+      pdf *= 1 - pLeft;
+      node = leftFirst + 1;
+    }
+    u = min(u, 0.99999994);
+  }
+}
+
+// How many lights to shade a hit at p with: LIGHT_TREE_SAMPLES picks from the
+// light tree if sampleLights is set, otherwise every light near p. cellFirst
+// is for shadingLight().
+int numShadingLights(vec3 p, out int cellFirst) {
+  if (sampleLights) {
+    cellFirst = 0;
+    return numLights > 0 ? LIGHT_TREE_SAMPLES : 0;
+  }
+  return numLightsNear(p, cellFirst);
+}
+
+// The k'th light to shade a hit at p with, and the scale on its lighting that
+// keeps the sum unbiased. seed is (pixel, bounce), so a light picked for a
+// hit is the same however often it is asked for within one sample.
+int shadingLight(int k, vec3 p, int cellFirst, uvec2 seed, out float scale) {
+  if (sampleLights) {
+    float pdf;
+    int lightIdx = sampleLightTree(p, random(uvec3(seed.x, uint(sampleIndex), seed.y * uint(LIGHT_TREE_SAMPLES) + uint(k))), pdf);
+    scale = 1.0 / (pdf * LIGHT_TREE_SAMPLES);
+    return lightIdx;
+  }
+  scale = 1;
+  return lightNear(k, cellFirst);
+}
+
+Intersection intersectSphere(Ray r, Sphere s) {
+  const float EPSILON = 0.1;
+
+  vec3 sphereToRay = r.p - s.center;
+  float A = dot(r.d, r.d);
+  float B = 2 * dot(r.d, sphereToRay);
+  float C = dot(sphereToRay, sphereToRay) - s.radius * s.radius;
+
+  float t = -1;
+  float D;
+  float q;
+
+  if (A == 0) {
+    if (B == 0) {
+      t = -1;
+    } else {
+      t = -C/B;
+    }
+  } else {
+    // Compute the discriminant D=b^2 - 4ac
+    D = B*B - 4*A*C;
+    if (D < 0) {
+      t = -1;
+    } else {
+      // Two real roots.
+      q = -(B + sign(B) * sqrt(D)) / 2.0;
+      t = q/A;
+      if (q != 0) {
+        float other = C/q;
+        if (t < EPSILON || (other > EPSILON && other < t)) {
+          t = other;
+        }
+      }
+    }
+  }
+
+  if (t > EPSILON) {
+    vec3 poi = r.p + t * r.d;
+    return Intersection(
+      true,
+      t,
+      poi,
+      normalize(poi - s.center),
+      s.materialId
+    );
+  }
+  return Intersection(false, 0, vec3(0), vec3(0), 0);
+}
+
+// Dequantization for the mesh whose BVH is being traversed, set from its instance.
+vec3 meshPositionOffset;
+vec3 meshPositionScale;
+
+vec3 fetchTriangleVertex(int vertexIdx) {
+  return meshPositionOffset + texelFetch(triangleVertices, vertexIdx).xyz * meshPositionScale;
+}
+
+// Unfold the octahedron where it was folded over for the lower half.
+vec3 fetchTriangleNormal(int vertexIdx) {
+  vec2 e = clamp(vec2(texelFetch(triangleNormals, vertexIdx).xy) / 32767.0, -1.0, 1.0);
+  vec3 n = vec3(e, 1 - abs(e.x) - abs(e.y));
+  if (n.z < 0) {
+    n.xy = (1 - abs(n.yx)) * vec2(n.x >= 0 ? 1 : -1, n.y >= 0 ? 1 : -1);
+  }
+  return normalize(n);
+}
+
+Intersection intersectTriangle(Ray r, int triangleIdx) {
+  const float EPSILON = 0.001;
+
+  ivec4 tri = texelFetch(triangles, triangleIdx);
+  vec3 p0 = fetchTriangleVertex(tri.x);
+  vec3 e1 = fetchTriangleVertex(tri.y) - p0;
+  vec3 e2 = fetchTriangleVertex(tri.z) - p0;
+
+  // Moller-Trumbore.
+  vec3 pvec = cross(r.d, e2);
+  float det = dot(e1, pvec);
+  if (abs(det) < 1e-10) {
+    return Intersection(false, 0, vec3(0), vec3(0), 0);
+  }
+  float invDet = 1.0 / det;
+
+  vec3 tvec = r.p - p0;
+  float u = dot(tvec, pvec) * invDet;
+  if (u < 0 || u > 1) {
+    return Intersection(false, 0, vec3(0), vec3(0), 0);
+  }
+
+  vec3 qvec = cross(tvec, e1);
+  float v = dot(r.d, qvec) * invDet;
+  if (v < 0 || u + v > 1) {
+    return Intersection(false, 0, vec3(0), vec3(0), 0);
+  }
+
+  float t = dot(e2, qvec) * invDet;
+  if (t > EPSILON) {
+    vec3 n = (1 - u - v) * fetchTriangleNormal(tri.x)
+      + u * fetchTriangleNormal(tri.y)
+      + v * fetchTriangleNormal(tri.z);
+    return Intersection(
+      true,
+      t,
+      r.p + t * r.d,
+      normalize(n),
+      tri.w
+    );
+  }
+  return Intersection(false, 0, vec3(0), vec3(0), 0);
+}
+
+vec3 lighting(vec3 viewer, Intersection it, Material mat, Light light) {
+  // Blinn-phong.
+  vec3 E = normalize(viewer - it.p);
+  vec3 l = normalize(light.position - it.p);
+  vec3 H = normalize(E + l); // Half-angle.
+  float cosTheta = clamp(dot(l, it.n), 0, 1);
+  float cosAlpha = clamp(dot(H, it.n), 0, 1);
+  float d = distance(light.position, it.p);
+  float attenuation = 1.0 / dot(light.falloff, vec3(1, d, d*d));
+  if (light.radius >= 0) {
+    // Fade out towards the influence radius rather than cutting off there.
+    float fade = clamp(1 - pow(d / light.radius, 4), 0, 1);
+    attenuation *= fade * fade;
+  }
+  vec3 directLightToEyeIntensity = vec3(0);
+
+  vec3 reflected = directLightToEyeIntensity; // Direct light.
+#if LIGHT_DIFFUSE
+  reflected += mat.kd * cosTheta;
+#endif
+#if LIGHT_SPECULAR
+  reflected += mat.ks * pow(cosAlpha, mat.shine);
+#endif
+  return mat.ke * attenuation + light.colour * attenuation * reflected;
+}
+
+// Share of a surface's light that comes from its mirror reflection.
+float mirrorWeight(Material mat) {
+#if MIRRORS
+  return mat.mirror;
+#else
+  return 0.0;
+#endif
+}
+
+vec4 fetchNode(int bvh, int texel) {
+  if (bvh == SPHERE_BVH) {
+    return texelFetch(sphereBVH, texel);
+  }
+  return bvh == TRIANGLE_BVH ? texelFetch(triangleBVH, texel) : texelFetch(instanceBVH, texel);
+}
+
+// Distance along r to the box of a BVH node, or -1 if it is missed or further than maxT.
+float intersectNode(Ray r, vec3 invD, int bvh, int nodeIdx, float maxT) {
+  vec3 t0 = (fetchNode(bvh, 2*nodeIdx).xyz - r.p) * invD;
+  vec3 t1 = (fetchNode(bvh, 2*nodeIdx + 1).xyz - r.p) * invD;
+  vec3 tNear = min(t0, t1);
+  vec3 tFar = max(t0, t1);
+  float tEnter = max(max(tNear.x, tNear.y), max(tNear.z, 0));
+  float tExit = min(min(tFar.x, tFar.y), tFar.z);
+  if (tEnter > tExit || tEnter > maxT) {
+    return -1;
+  }
+  return tEnter;
+}
+
+// Order the children of an interior node by entry distance. Missed children get -1.
+void orderChildren(int bvh, Ray r, vec3 invD, int leftFirst, float maxT,
+    out int nearChild, out float tNear, out int farChild, out float tFar) {
+  tNear = intersectNode(r, invD, bvh, leftFirst, maxT);
+  tFar = intersectNode(r, invD, bvh, leftFirst + 1, maxT);
+  nearChild = leftFirst;
+  farChild = leftFirst + 1;
+  if (tFar >= 0 && (tNear < 0 || tFar < tNear)) {
+    nearChild = leftFirst + 1;
+    farChild = leftFirst;
+    float t = tNear;
+    tNear = tFar;
+    tFar = t;
+  }
+}
+
+// Short-stack traversal of the sphere BVH or of one mesh's BVH, starting at rootNode
+// and visiting the nearer child first. Pushes are unchecked: every BVH is built
+// shallow enough for BVH_STACK_SIZE. closestT is in units of r.d, so r.d need not
+// be normalized; instances traverse with a ray transformed into object space.
+void intersectBVH(int bvh, int rootNode, Ray r, vec3 invD, inout float closestT, inout Intersection closestIntersection) {
+  int stack[BVH_STACK_SIZE];
+  int stackSize = 0;
+  if (intersectNode(r, invD, bvh, rootNode, closestT) >= 0) {
+    stack[stackSize++] = rootNode;
+  }
+
+  while (stackSize > 0) {
+    int nodeIdx = stack[--stackSize];
+    int leftFirst = floatBitsToInt(fetchNode(bvh, 2*nodeIdx).w);
+    int count = floatBitsToInt(fetchNode(bvh, 2*nodeIdx + 1).w);
+
+    if (count > 0) {
+      for (int i = leftFirst; i < leftFirst + count; i++) {
+        Intersection inter = bvh == SPHERE_BVH ? intersectSphere(r, fetchSphere(i)) : intersectTriangle(r, i);
+        if (inter.hit && inter.t < closestT) {
+          closestT = inter.t;
+          closestIntersection = inter;
+        }
+      }
+      continue;
+    }
+
+    int nearChild, farChild;
+    float tNear, tFar;
+    orderChildren(bvh, r, invD, leftFirst, closestT, nearChild, tNear, farChild, tFar);
+    // Push far first so the near child is popped next.
+    if (tFar >= 0) {
+      stack[stackSize++] = farChild;
+    }
+    if (tNear >= 0) {
+      stack[stackSize++] = nearChild;
+    }
+  }
+}
+
+// Intersect one mesh instance by tracing its BVH with the ray in object space.
+// Without normalizing the transformed direction, t is the same in both spaces.
+void intersectInstance(Ray r, int instanceIdx, inout float closestT, inout Intersection closestIntersection) {
+  vec4 row0 = texelFetch(instances, 6*instanceIdx);
+  vec4 row1 = texelFetch(instances, 6*instanceIdx + 1);
+  vec4 row2 = texelFetch(instances, 6*instanceIdx + 2);
+  ivec2 info = floatBitsToInt(texelFetch(instances, 6*instanceIdx + 3).xy);
+  if (info.x < 0) {
+    return;
+  }
+  meshPositionOffset = texelFetch(instances, 6*instanceIdx + 4).xyz;
+  meshPositionScale = texelFetch(instances, 6*instanceIdx + 5).xyz;
+
+  Ray objectRay = Ray(
+    vec3(dot(row0, vec4(r.p, 1)), dot(row1, vec4(r.p, 1)), dot(row2, vec4(r.p, 1))),
+    vec3(dot(row0.xyz, r.d), dot(row1.xyz, r.d), dot(row2.xyz, r.d))
+  );
+  Intersection objectIntersection = Intersection(false, 0, vec3(0), vec3(0), 0);
+  intersectBVH(TRIANGLE_BVH, info.x, objectRay, 1.0 / objectRay.d, closestT, objectIntersection);
+  if (objectIntersection.hit) {
+    // Normals transform by the inverse transpose, whose rows are the columns of worldToObject.
+    vec3 n = objectIntersection.n;
+    closestIntersection = Intersection(
+      true,
+      objectIntersection.t,
+      r.p + objectIntersection.t * r.d,
+      normalize(n.x * row0.xyz + n.y * row1.xyz + n.z * row2.xyz),
+      info.y
+    );
+  }
+}
+
+// Traverse the instance BVH, descending into the BVH of each instance reached.
+void intersectInstances(Ray r, vec3 invD, inout float closestT, inout Intersection closestIntersection) {
+  int stack[BVH_STACK_SIZE];
+  int stackSize = 0;
+  if (intersectNode(r, invD, INSTANCE_BVH, 0, closestT) >= 0) {
+    stack[stackSize++] = 0;
+  }
+
+  while (stackSize > 0) {
+    int nodeIdx = stack[--stackSize];
+    int leftFirst = floatBitsToInt(fetchNode(INSTANCE_BVH, 2*nodeIdx).w);
+    int count = floatBitsToInt(fetchNode(INSTANCE_BVH, 2*nodeIdx + 1).w);
+
+    if (count > 0) {
+      for (int i = leftFirst; i < leftFirst + count; i++) {
+        intersectInstance(r, i, closestT, closestIntersection);
+      }
+      continue;
+    }
+
+    int nearChild, farChild;
+    float tNear, tFar;
+    orderChildren(INSTANCE_BVH, r, invD, leftFirst, closestT, nearChild, tNear, farChild, tFar);
+    if (tFar >= 0) {
+      stack[stackSize++] = farChild;
+    }
+    if (tNear >= 0) {
+      stack[stackSize++] = nearChild;
+    }
+  }
+}
+
+Intersection intersectScene(Ray r) {
+  Intersection closestIntersection = Intersection(false, 0, vec3(0), vec3(0), 0);
+  float closestT = 10000000;
+
+  // With r.d normalized, t is also the world-space distance.
+  r.d = normalize(r.d);
+  vec3 invD = 1.0 / r.d;
+
+  if (numSpheres > 0) {
+    intersectBVH(SPHERE_BVH, 0, r, invD, closestT, closestIntersection);
+  }
+  if (numInstances > 0) {
+    intersectInstances(r, invD, closestT, closestIntersection);
+  }
+
+  return closestIntersection;
+}
+
+// Occlusion queries. Shadow rays only ask whether anything lies before the
+// light, so these stop at the first blocker closer than maxT and never build
+// an Intersection or its normal.
+
+bool sphereOccludes(Ray r, Sphere s, float maxT) {
+  const float EPSILON = 0.1;
+
+  vec3 sphereToRay = r.p - s.center;
+  float A = dot(r.d, r.d);
+  float B = 2 * dot(r.d, sphereToRay);
+  float C = dot(sphereToRay, sphereToRay) - s.radius * s.radius;
+  float D = B*B - 4*A*C;
+  if (A == 0 || D < 0) {
+    return false;
+  }
+  float q = -(B + sign(B) * sqrt(D)) / 2.0;
+  float t0 = q/A;
+  float t1 = q != 0 ? C/q : t0;
+  return (t0 > EPSILON && t0 < maxT) || (t1 > EPSILON && t1 < maxT);
+}
+
+bool triangleOccludes(Ray r, int triangleIdx, float maxT) {
+  const float EPSILON = 0.001;
+
+  ivec4 tri = texelFetch(triangles, triangleIdx);
+  vec3 p0 = fetchTriangleVertex(tri.x);
+  vec3 e1 = fetchTriangleVertex(tri.y) - p0;
+  vec3 e2 = fetchTriangleVertex(tri.z) - p0;
+
+  vec3 pvec = cross(r.d, e2);
+  float det = dot(e1, pvec);
+  if (abs(det) < 1e-10) {
+    return false;
+  }
+  float invDet = 1.0 / det;
+
+  vec3 tvec = r.p - p0;
+  float u = dot(tvec, pvec) * invDet;
+  if (u < 0 || u > 1) {
+    return false;
+  }
+
+  vec3 qvec = cross(tvec, e1);
+  float v = dot(r.d, qvec) * invDet;
+  if (v < 0 || u + v > 1) {
+    return false;
+  }
+
+  float t = dot(e2, qvec) * invDet;
+  return t > EPSILON && t < maxT;
+}
+
+// Any-hit traversal of the sphere BVH or of one mesh's BVH. With no closest
+// hit to shrink maxT, child order does not matter, so children are pushed
+// as found.
+bool occludedBVH(int bvh, int rootNode, Ray r, vec3 invD, float maxT) {
+  int stack[BVH_STACK_SIZE];
+  int stackSize = 0;
+  if (intersectNode(r, invD, bvh, rootNode, maxT) >= 0) {
+    stack[stackSize++] = rootNode;
+  }
+
+  while (stackSize > 0) {
+    int nodeIdx = stack[--stackSize];
+    int leftFirst = floatBitsToInt(fetchNode(bvh, 2*nodeIdx).w);
+    int count = floatBitsToInt(fetchNode(bvh, 2*nodeIdx + 1).w);
+
+    if (count > 0) {
+      for (int i = leftFirst; i < leftFirst + count; i++) {
+        if (bvh == SPHERE_BVH ? sphereOccludes(r, fetchSphere(i), maxT) : triangleOccludes(r, i, maxT)) {
+          return true;
+        }
+      }
+      continue;
+    }
+
+    for (int child = leftFirst; child < leftFirst + 2; child++) {
+      if (intersectNode(r, invD, bvh, child, maxT) >= 0) {
+        stack[stackSize++] = child;
+      }
+    }
+  }
+  return false;
+}
+
+bool instanceOccludes(Ray r, int instanceIdx, float maxT) {
+  vec4 row0 = texelFetch(instances, 6*instanceIdx);
+  vec4 row1 = texelFetch(instances, 6*instanceIdx + 1);
+  vec4 row2 = texelFetch(instances, 6*instanceIdx + 2);
+  int rootNode = floatBitsToInt(texelFetch(instances, 6*instanceIdx + 3).x);
+  if (rootNode < 0) {
+    return false;
+  }
+  meshPositionOffset = texelFetch(instances, 6*instanceIdx + 4).xyz;
+  meshPositionScale = texelFetch(instances, 6*instanceIdx + 5).xyz;
+
+  Ray objectRay = Ray(
+    vec3(dot(row0, vec4(r.p, 1)), dot(row1, vec4(r.p, 1)), dot(row2, vec4(r.p, 1))),
+    vec3(dot(row0.xyz, r.d), dot(row1.xyz, r.d), dot(row2.xyz, r.d))
+  );
+  return occludedBVH(TRIANGLE_BVH, rootNode, objectRay, 1.0 / objectRay.d, maxT);
+}
+
+bool occludedInstances(Ray r, vec3 invD, float maxT) {
+  int stack[BVH_STACK_SIZE];
+  int stackSize = 0;
+  if (intersectNode(r, invD, INSTANCE_BVH, 0, maxT) >= 0) {
+    stack[stackSize++] = 0;
+  }
+
+  while (stackSize > 0) {
+    int nodeIdx = stack[--stackSize];
+    int leftFirst = floatBitsToInt(fetchNode(INSTANCE_BVH, 2*nodeIdx).w);
+    int count = floatBitsToInt(fetchNode(INSTANCE_BVH, 2*nodeIdx + 1).w);
+
+    if (count > 0) {
+      for (int i = leftFirst; i < leftFirst + count; i++) {
+        if (instanceOccludes(r, i, maxT)) {
+          return true;
+        }
+      }
+      continue;
+    }
+
+    for (int child = leftFirst; child < leftFirst + 2; child++) {
+      if (intersectNode(r, invD, INSTANCE_BVH, child, maxT) >= 0) {
+        stack[stackSize++] = child;
+      }
+    }
+  }
+  return false;
+}
+
+// Whether anything lies along r within maxDistance of its origin.
+// Nothing is, in programs specialized without shadows.
+bool occluded(Ray r, float maxDistance) {
+#if SHADOWS
+  r.d = normalize(r.d);
+  vec3 invD = 1.0 / r.d;
+  return (numSpheres > 0 && occludedBVH(SPHERE_BVH, 0, r, invD, maxDistance))
+    || (numInstances > 0 && occludedInstances(r, invD, maxDistance));
+#else
+  return false;
+#endif
+}
+
+// The skybox as a surface of the given roughness reflects it, in one lookup.
+vec3 genBackground(Ray r, float roughness) {
+  return textureLod(skyboxTexture, r.d*vec3(1, -1, 1), roughness * skyboxMaxLod).rgb;
+  //return vec3(0.0, 0.0, sin(r.d.y*20.0)/4.0 + 0.75);
+  //return r.d;
+}
+
+vec3 genIrradiance(vec3 n) {
+  return texture(irradianceTexture, n*vec3(1, -1, 1)).rgb;
+}
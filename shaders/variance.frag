@@ -0,0 +1,17 @@
+#version 330 core
+
+// Running mean of colour in rgb and of squared luminance in a.
+uniform sampler2D accumulation;
+uniform float numSamples;
+uniform float errorTarget;
+
+// 1 where the mean luminance may still be further than errorTarget from converged.
+layout(location = 0) out float unconverged;
+
+void main() {
+  vec4 mean = texelFetch(accumulation, ivec2(gl_FragCoord.xy), 0);
+  float luminance = dot(mean.rgb, vec3(0.2126, 0.7152, 0.0722));
+  // Unbiased sample variance, divided by the count for the variance of the mean.
+  float variance = max(mean.a - luminance * luminance, 0.0) * numSamples / (numSamples - 1.0);
+  unconverged = variance / numSamples > errorTarget * errorTarget ? 1.0 : 0.0;
+}
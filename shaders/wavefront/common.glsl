@@ -0,0 +1,98 @@
+// Queues and counters the wavefront stages hand each other through shader
+// storage buffers, bound by Viewer::renderWavefront().
+
+// Invocations per group of the one-dimensional stages, and the square tiles
+// of the per-pixel ones. Must match WAVEFRONT_GROUP_SIZE and
+// WAVEFRONT_TILE_SIZE in viewer.cpp.
+#define WAVEFRONT_GROUP_SIZE 64
+#define WAVEFRONT_TILE_SIZE 8
+// Paths add light to their pixel with integer atomics, in fixed point.
+#define RADIANCE_SCALE 65536.0
+// Largest single addition, keeping a pixel's total far from overflowing.
+#define RADIANCE_MAX 1024.0
+
+// One path per pixel, followed a bounce at a time as in raytrace().
+struct PathState {
+  vec4 origin;    // (position, index of refraction inside a refracting object).
+  vec4 direction; // (direction, weight of whatever the ray reaches).
+  ivec4 info;     // (pixel index, 1 when inside a refracting object, 0, 0).
+};
+
+// What extend found for the path in the same slot.
+struct PathHit {
+  vec4 position; // (point, t), t -1 for a miss.
+  vec4 normal;   // (normal, materialId as float bits).
+};
+
+struct ShadowRay {
+  vec4 origin;       // (point, distance to the light).
+  vec4 direction;    // (direction to the light, 0).
+  vec4 contribution; // (light reflected to the pixel if unoccluded, pixel index as float bits).
+};
+
+layout(std430, binding = 0) buffer Counters {
+  // Appended to by generate and shade.
+  uint pathCount;
+  uint shadowCount;
+  // Moved out of the above by dispatch, for the stages that consume the queues.
+  uint numPaths;
+  uint numShadowRays;
+  // Work groups for glDispatchComputeIndirect() over those.
+  uvec4 pathGroups;
+  uvec4 shadowGroups;
+};
+
+layout(std430, binding = 1) buffer PathsIn {
+  PathState pathsIn[];
+};
+
+layout(std430, binding = 2) buffer PathsOut {
+  PathState pathsOut[];
+};
+
+layout(std430, binding = 3) buffer Hits {
+  PathHit hits[];
+};
+
+layout(std430, binding = 4) buffer ShadowRays {
+  ShadowRay shadowRays[];
+};
+
+// Three fixed point channels per pixel.
+layout(std430, binding = 5) buffer Radiance {
+  uint radiance[];
+};
+
+void addRadiance(int pixelIdx, vec3 c) {
+  uvec3 fixedPoint = uvec3(clamp(c, 0.0, RADIANCE_MAX) * RADIANCE_SCALE + 0.5);
+  for (int i = 0; i < 3; i++) {
+    if (fixedPoint[i] != 0u) {
+      atomicAdd(radiance[3*pixelIdx + i], fixedPoint[i]);
+    }
+  }
+}
+
+shared uint groupCount;
+shared uint groupBase;
+
+// Reserve n consecutive entries at the end of the path queue, or of the
+// shadow ray queue, returning the first. Every invocation in the group must
+// call it, n being 0 for those with nothing to add. The group's entries end
+// up together, so rays from neighbouring pixels stay neighbours after
+// compaction, and only one global atomic is needed per group.
+uint reserve(bool shadowQueue, uint n) {
+  if (gl_LocalInvocationIndex == 0u) {
+    groupCount = 0u;
+  }
+  memoryBarrierShared();
+  barrier();
+  uint offset = atomicAdd(groupCount, n);
+  memoryBarrierShared();
+  barrier();
+  if (gl_LocalInvocationIndex == 0u) {
+    groupBase = shadowQueue ? atomicAdd(shadowCount, groupCount) : atomicAdd(pathCount, groupCount);
+  }
+  memoryBarrierShared();
+  barrier();
+  return groupBase + offset;
+}
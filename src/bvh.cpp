@@ -0,0 +1,657 @@
+#include <algorithm>
+#include <cfloat>
+
+#include "bvh.hpp"
+
+// Nodes with at least this many primitives are binned and partitioned in parallel.
+#define BVH_PARALLEL_NODE_SIZE 65536
+// Subtrees with at least this many primitives are built as separate tasks.
+#define BVH_PARALLEL_SUBTREE_SIZE 4096
+#define BVH_MIN_CHUNK_SIZE 16384
+// Dirty indices at most this far apart are uploaded as one range.
+#define BVH_DIRTY_RANGE_GAP 16
+
+AABB::AABB(): min(FLT_MAX, FLT_MAX, FLT_MAX), max(-FLT_MAX, -FLT_MAX, -FLT_MAX) {}
+
+AABB::AABB(const glm::vec3& min, const glm::vec3& max): min(min), max(max) {}
+
+float AABB::surfaceArea() const {
+  glm::vec3 e = max - min;
+  if (e.x < 0 || e.y < 0 || e.z < 0) {
+    return 0;
+  }
+  return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
+
+
+// Primitive bounds travel with their index while partitioning, so every pass
+// over a node reads memory sequentially.
+struct PrimitiveRef {
+  AABB bounds;
+  int index;
+};
+
+struct BVH::BuildState {
+  std::vector<PrimitiveRef> refs;
+  // Partition target for parallel splits; nodes being split concurrently use disjoint ranges.
+  std::vector<PrimitiveRef> scratch;
+  std::atomic<int> nodesUsed;
+  ThreadPool* pool;
+  int maxDepth;
+};
+
+struct Bin {
+  Bin(): count(0) {}
+
+  AABB bounds;
+  int count;
+};
+
+// Bins along all three axes for one range of primitives.
+struct BinSet {
+  void merge(const BinSet& other, int numBins) {
+    for (int axis = 0; axis < 3; axis++) {
+      for (int i = 0; i < numBins; i++) {
+        bins[axis][i].bounds.grow(other.bins[axis][i].bounds);
+        bins[axis][i].count += other.bins[axis][i].count;
+      }
+    }
+  }
+
+  Bin bins[3][BVH_NUM_BINS];
+};
+
+static int binIndex(float c, float min, float scale, int numBins) {
+  int b = (int)((c - min) * scale);
+  return std::min(std::max(b, 0), numBins - 1);
+}
+
+static void coalesceRanges(std::vector<int>& indices, std::vector<IndexRange>& ranges) {
+  std::sort(indices.begin(), indices.end());
+  for (unsigned int i = 0; i < indices.size(); i++) {
+    if (!ranges.empty() && indices[i] <= ranges.back().end + BVH_DIRTY_RANGE_GAP) {
+      ranges.back().end = std::max(ranges.back().end, indices[i] + 1);
+    } else {
+      ranges.push_back(IndexRange(indices[i], indices[i] + 1));
+    }
+  }
+}
+
+static int chunkSize(int count, ThreadPool* pool) {
+  if (pool == NULL) {
+    return count;
+  }
+  return std::max(BVH_MIN_CHUNK_SIZE, count / (4 * pool->getNumThreads()));
+}
+
+
+BVH::BVH() {}
+
+void BVH::build(const std::vector<AABB>& primitiveBounds, ThreadPool* pool, int maxDepth) {
+  int numPrimitives = primitiveBounds.size();
+
+  BuildState state;
+  state.pool = pool;
+  state.maxDepth = maxDepth;
+  state.nodesUsed = 1;
+  state.refs.resize(numPrimitives);
+  if (pool != NULL) {
+    state.scratch.resize(numPrimitives);
+  }
+
+  // A binary tree with at least one primitive per leaf has at most 2n-1 nodes.
+  // Allocating them all up front lets tasks claim children without locking.
+  nodes.resize(std::max(1, 2*numPrimitives - 1));
+
+  int grainSize = chunkSize(numPrimitives, pool);
+  int numChunks = numPrimitives > 0 ? (numPrimitives + grainSize - 1) / grainSize : 0;
+  std::vector<AABB> chunkBounds(numChunks);
+  parallelFor(pool, 0, numPrimitives, grainSize, [&](int begin, int end) {
+    AABB& bounds = chunkBounds[begin / grainSize];
+    for (int i = begin; i < end; i++) {
+      state.refs[i].bounds = primitiveBounds[i];
+      state.refs[i].index = i;
+      bounds.grow(primitiveBounds[i]);
+    }
+  });
+
+  AABB rootBounds;
+  for (int i = 0; i < numChunks; i++) {
+    rootBounds.grow(chunkBounds[i]);
+  }
+
+  // An empty root keeps inverted bounds, so no ray ever enters it.
+  BVHNode& root = nodes[0];
+  root.min = rootBounds.min;
+  root.max = rootBounds.max;
+  root.leftFirst = 0;
+  root.count = numPrimitives;
+
+  if (numPrimitives > 0) {
+    TaskGroup group(pool);
+    subdivide(0, 0, state, group);
+    group.wait();
+  }
+
+  nodes.resize(state.nodesUsed);
+
+  primitiveIndices.resize(numPrimitives);
+  parallelFor(pool, 0, numPrimitives, grainSize, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      primitiveIndices[i] = state.refs[i].index;
+    }
+  });
+
+  parents.assign(nodes.size(), -1);
+  buildOverlap.assign(nodes.size(), 0);
+  nodeDirty.assign(nodes.size(), 0);
+  primitiveLeaves.assign(numPrimitives, 0);
+  if (numPrimitives > 0) {
+    linkSubtree(0, -1);
+  }
+}
+
+bool BVH::load(const std::vector<BVHNode>& nodes, const std::vector<int>& primitiveIndices) {
+  int numNodes = nodes.size();
+  int numPrimitives = primitiveIndices.size();
+  bool valid = numNodes > 0;
+  for (int i = 0; valid && i < numNodes; i++) {
+    const BVHNode& node = nodes[i];
+    if (node.isLeaf()) {
+      valid = node.leftFirst >= 0 && (long)node.leftFirst + node.count <= numPrimitives;
+    } else if (i > 0 || numPrimitives > 0) {
+      // Children always follow their parent, which also rules out cycles.
+      valid = node.count == 0 && node.leftFirst > i && node.leftFirst + 1 < numNodes;
+    }
+  }
+  for (int i = 0; valid && i < numPrimitives; i++) {
+    valid = primitiveIndices[i] >= 0 && primitiveIndices[i] < numPrimitives;
+  }
+  if (!valid) {
+    this->nodes.clear();
+    this->primitiveIndices.clear();
+    return false;
+  }
+
+  this->nodes = nodes;
+  this->primitiveIndices = primitiveIndices;
+  // Too deep for the shaders' traversal stacks.
+  if (getDepth() > BVH_MAX_DEPTH) {
+    this->nodes.clear();
+    this->primitiveIndices.clear();
+    return false;
+  }
+  parents.assign(numNodes, -1);
+  buildOverlap.assign(numNodes, 0);
+  nodeDirty.assign(numNodes, 0);
+  primitiveLeaves.assign(numPrimitives, 0);
+  if (numPrimitives > 0) {
+    linkSubtree(0, -1);
+  }
+  return true;
+}
+
+void BVH::subdivide(int nodeIdx, int depth, BuildState& state, TaskGroup& group) {
+  std::vector<PrimitiveRef>& refs = state.refs;
+
+  // Loop on the larger child and recurse on the smaller, to bound stack depth.
+  for (; nodes[nodeIdx].count > 1; depth++) {
+    int first = nodes[nodeIdx].leftFirst;
+    int count = nodes[nodeIdx].count;
+    int levelsLeft = state.maxDepth - depth;
+    if (levelsLeft <= 0) {
+      return;
+    }
+
+    ThreadPool* pool = count >= BVH_PARALLEL_NODE_SIZE ? state.pool : NULL;
+    int grainSize = chunkSize(count, pool);
+    int numChunks = (count + grainSize - 1) / grainSize;
+
+    // Centroid bounds decide where the bins go.
+    auto growCentroidBounds = [&](int begin, int end, AABB& bounds) {
+      for (int i = begin; i < end; i++) {
+        bounds.grow(refs[i].bounds.centroid());
+      }
+    };
+    AABB centroidBounds;
+    if (pool == NULL) {
+      growCentroidBounds(first, first + count, centroidBounds);
+    } else {
+      std::vector<AABB> chunkBounds(numChunks);
+      parallelFor(pool, first, first + count, grainSize, [&](int begin, int end) {
+        growCentroidBounds(begin, end, chunkBounds[(begin - first) / grainSize]);
+      });
+      for (int i = 0; i < numChunks; i++) {
+        centroidBounds.grow(chunkBounds[i]);
+      }
+    }
+
+    // Small nodes get fewer bins; the sweep would otherwise dominate their cost.
+    int numBins = std::min(BVH_NUM_BINS, std::max(4, count));
+    glm::vec3 extent = centroidBounds.max - centroidBounds.min;
+    glm::vec3 scale(0);
+    for (int axis = 0; axis < 3; axis++) {
+      if (extent[axis] > 0) {
+        scale[axis] = numBins / extent[axis];
+      }
+    }
+
+    auto fillBins = [&](int begin, int end, BinSet& binSet) {
+      for (int i = begin; i < end; i++) {
+        glm::vec3 centroid = refs[i].bounds.centroid();
+        for (int axis = 0; axis < 3; axis++) {
+          if (scale[axis] == 0) {
+            continue;
+          }
+          Bin& bin = binSet.bins[axis][binIndex(centroid[axis], centroidBounds.min[axis], scale[axis], numBins)];
+          bin.count++;
+          bin.bounds.grow(refs[i].bounds);
+        }
+      }
+    };
+    BinSet binSet;
+    if (pool == NULL) {
+      fillBins(first, first + count, binSet);
+    } else {
+      std::vector<BinSet> chunkBins(numChunks);
+      parallelFor(pool, first, first + count, grainSize, [&](int begin, int end) {
+        fillBins(begin, end, chunkBins[(begin - first) / grainSize]);
+      });
+      for (int i = 0; i < numChunks; i++) {
+        binSet.merge(chunkBins[i], numBins);
+      }
+    }
+
+    // Sweep each axis from both ends to cost every split between adjacent bins.
+    float bestCost = FLT_MAX;
+    int bestAxis = -1;
+    int bestSplit = -1;
+    AABB leftBounds, rightBounds;
+    for (int axis = 0; axis < 3; axis++) {
+      if (scale[axis] == 0) {
+        continue;
+      }
+      const Bin* bins = binSet.bins[axis];
+
+      AABB leftAccum[BVH_NUM_BINS - 1], rightAccum[BVH_NUM_BINS - 1];
+      int leftCount[BVH_NUM_BINS - 1], rightCount[BVH_NUM_BINS - 1];
+      AABB accum;
+      int n = 0;
+      for (int i = 0; i < numBins - 1; i++) {
+        accum.grow(bins[i].bounds);
+        n += bins[i].count;
+        leftAccum[i] = accum;
+        leftCount[i] = n;
+      }
+      accum = AABB();
+      n = 0;
+      for (int i = numBins - 1; i > 0; i--) {
+        accum.grow(bins[i].bounds);
+        n += bins[i].count;
+        rightAccum[i - 1] = accum;
+        rightCount[i - 1] = n;
+      }
+
+      for (int i = 0; i < numBins - 1; i++) {
+        if (leftCount[i] == 0 || rightCount[i] == 0) {
+          continue;
+        }
+        float cost = leftCount[i] * leftAccum[i].surfaceArea() + rightCount[i] * rightAccum[i].surfaceArea();
+        if (cost < bestCost) {
+          bestCost = cost;
+          bestAxis = axis;
+          bestSplit = i;
+          leftBounds = leftAccum[i];
+          rightBounds = rightAccum[i];
+        }
+      }
+    }
+
+    float nodeArea = AABB(nodes[nodeIdx].min, nodes[nodeIdx].max).surfaceArea();
+    float leafCost = count * nodeArea;
+    float splitCost = BVH_TRAVERSAL_COST * nodeArea + bestCost;
+    if (count <= BVH_MAX_LEAF_SIZE && (bestAxis < 0 || splitCost >= leafCost)) {
+      return;
+    }
+
+    int mid = -1;
+    if (bestAxis >= 0) {
+      float binMin = centroidBounds.min[bestAxis];
+      float binScale = scale[bestAxis];
+      auto isLeft = [&](const PrimitiveRef& ref) {
+        return binIndex(ref.bounds.centroid()[bestAxis], binMin, binScale, numBins) <= bestSplit;
+      };
+
+      if (pool == NULL) {
+        mid = std::partition(refs.begin() + first, refs.begin() + first + count, isLeft) - refs.begin();
+      } else {
+        // Count each chunk's left side, scatter through scratch at prefix-summed offsets, then copy back.
+        std::vector<int> chunkLeft(numChunks);
+        parallelFor(pool, first, first + count, grainSize, [&](int begin, int end) {
+          int n = 0;
+          for (int i = begin; i < end; i++) {
+            n += isLeft(refs[i]);
+          }
+          chunkLeft[(begin - first) / grainSize] = n;
+        });
+
+        std::vector<int> leftOffset(numChunks), rightOffset(numChunks);
+        int totalLeft = 0;
+        for (int i = 0; i < numChunks; i++) {
+          leftOffset[i] = totalLeft;
+          totalLeft += chunkLeft[i];
+        }
+        int totalRight = 0;
+        for (int i = 0; i < numChunks; i++) {
+          rightOffset[i] = totalLeft + totalRight;
+          totalRight += std::min(grainSize, count - i * grainSize) - chunkLeft[i];
+        }
+
+        parallelFor(pool, first, first + count, grainSize, [&](int begin, int end) {
+          int chunk = (begin - first) / grainSize;
+          int l = first + leftOffset[chunk];
+          int r = first + rightOffset[chunk];
+          for (int i = begin; i < end; i++) {
+            if (isLeft(refs[i])) {
+              state.scratch[l++] = refs[i];
+            } else {
+              state.scratch[r++] = refs[i];
+            }
+          }
+        });
+        parallelFor(pool, first, first + count, grainSize, [&](int begin, int end) {
+          std::copy(state.scratch.begin() + begin, state.scratch.begin() + end, refs.begin() + begin);
+        });
+
+        mid = first + totalLeft;
+      }
+    }
+
+    // Halving at every level reaches leaves of BVH_MAX_LEAF_SIZE within the
+    // levels left, so split at the median where centroids all coincide or
+    // where the SAH split would leave a child more than half of that.
+    long long childLimit = (long long)BVH_MAX_LEAF_SIZE << std::min(levelsLeft - 1, 40);
+    if (mid < 0 || std::max(mid - first, first + count - mid) > childLimit) {
+      int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+      mid = first + count/2;
+      std::nth_element(refs.begin() + first, refs.begin() + mid, refs.begin() + first + count, [axis](const PrimitiveRef& a, const PrimitiveRef& b) {
+        return a.bounds.centroid()[axis] < b.bounds.centroid()[axis];
+      });
+      leftBounds = AABB();
+      rightBounds = AABB();
+      for (int i = first; i < mid; i++) {
+        leftBounds.grow(refs[i].bounds);
+      }
+      for (int i = mid; i < first + count; i++) {
+        rightBounds.grow(refs[i].bounds);
+      }
+    }
+
+    int leftIdx = state.nodesUsed.fetch_add(2);
+    BVHNode& left = nodes[leftIdx];
+    left.min = leftBounds.min;
+    left.max = leftBounds.max;
+    left.leftFirst = first;
+    left.count = mid - first;
+
+    BVHNode& right = nodes[leftIdx + 1];
+    right.min = rightBounds.min;
+    right.max = rightBounds.max;
+    right.leftFirst = mid;
+    right.count = first + count - mid;
+
+    nodes[nodeIdx].leftFirst = leftIdx;
+    nodes[nodeIdx].count = 0;
+
+    int smaller = left.count < right.count ? leftIdx : leftIdx + 1;
+    int larger = smaller == leftIdx ? leftIdx + 1 : leftIdx;
+    if (state.pool != NULL && nodes[smaller].count >= BVH_PARALLEL_SUBTREE_SIZE) {
+      group.run([this, smaller, depth, &state, &group]() {
+        subdivide(smaller, depth + 1, state, group);
+      });
+    } else {
+      subdivide(smaller, depth + 1, state, group);
+    }
+    nodeIdx = larger;
+  }
+}
+
+void BVH::linkSubtree(int nodeIdx, int parentIdx) {
+  if (parents.size() < nodes.size()) {
+    parents.resize(nodes.size(), -1);
+    buildOverlap.resize(nodes.size(), 0);
+    nodeDirty.resize(nodes.size(), 0);
+  }
+
+  parents[nodeIdx] = parentIdx;
+  std::vector<int> stack(1, nodeIdx);
+  while (!stack.empty()) {
+    int n = stack.back();
+    stack.pop_back();
+    const BVHNode& node = nodes[n];
+    if (node.isLeaf()) {
+      buildOverlap[n] = 0;
+      for (int i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+        primitiveLeaves[primitiveIndices[i]] = n;
+      }
+    } else {
+      buildOverlap[n] = childOverlap(n);
+      for (int c = 0; c < 2; c++) {
+        parents[node.leftFirst + c] = n;
+        stack.push_back(node.leftFirst + c);
+      }
+    }
+  }
+}
+
+float BVH::childOverlap(int nodeIdx) const {
+  const BVHNode& left = nodes[nodes[nodeIdx].leftFirst];
+  const BVHNode& right = nodes[nodes[nodeIdx].leftFirst + 1];
+  AABB overlap(glm::max(left.min, right.min), glm::min(left.max, right.max));
+  float area = AABB(nodes[nodeIdx].min, nodes[nodeIdx].max).surfaceArea();
+  return area > 0 ? overlap.surfaceArea() / area : 0;
+}
+
+void BVH::refit(const std::vector<AABB>& primitiveBounds, const std::vector<int>& changedPrimitives, ThreadPool* pool) {
+  dirtyNodeRanges.clear();
+  dirtyPrimitiveRanges.clear();
+  if (primitiveIndices.empty() || changedPrimitives.empty()) {
+    return;
+  }
+
+  std::vector<int> dirtyNodes, dirtySlots;
+
+  // Flag each changed leaf and its ancestors, stopping at ones already flagged.
+  for (unsigned int i = 0; i < changedPrimitives.size(); i++) {
+    int prim = changedPrimitives[i];
+    int leaf = primitiveLeaves[prim];
+    for (int slot = nodes[leaf].leftFirst; slot < nodes[leaf].leftFirst + nodes[leaf].count; slot++) {
+      if (primitiveIndices[slot] == prim) {
+        dirtySlots.push_back(slot);
+      }
+    }
+    for (int n = leaf; n >= 0 && !nodeDirty[n]; n = parents[n]) {
+      nodeDirty[n] = 1;
+    }
+  }
+
+  // Collect flagged nodes parents-first, then refit in reverse so children come before parents.
+  std::vector<int> order, stack(1, 0);
+  while (!stack.empty()) {
+    int n = stack.back();
+    stack.pop_back();
+    if (!nodeDirty[n]) {
+      continue;
+    }
+    order.push_back(n);
+    if (!nodes[n].isLeaf()) {
+      stack.push_back(nodes[n].leftFirst);
+      stack.push_back(nodes[n].leftFirst + 1);
+    }
+  }
+
+  std::vector<int> degraded;
+  for (int k = order.size() - 1; k >= 0; k--) {
+    int n = order[k];
+    BVHNode& node = nodes[n];
+    AABB bounds;
+    if (node.isLeaf()) {
+      for (int i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+        bounds.grow(primitiveBounds[primitiveIndices[i]]);
+      }
+    } else {
+      bounds.grow(AABB(nodes[node.leftFirst].min, nodes[node.leftFirst].max));
+      bounds.grow(AABB(nodes[node.leftFirst + 1].min, nodes[node.leftFirst + 1].max));
+    }
+    node.min = bounds.min;
+    node.max = bounds.max;
+    nodeDirty[n] = 0;
+    dirtyNodes.push_back(n);
+
+    if (!node.isLeaf() && childOverlap(n) - buildOverlap[n] > BVH_REFIT_OVERLAP_THRESHOLD) {
+      degraded.push_back(n);
+    }
+  }
+
+  // Rebuild the topmost degraded subtrees. degraded is children-first, so walk it backwards.
+  for (int k = degraded.size() - 1; k >= 0; k--) {
+    int n = degraded[k];
+    if (n != 0 && parents[n] < 0) {
+      // Orphaned by an earlier rebuild.
+      continue;
+    }
+    bool covered = false;
+    for (int a = parents[n]; a >= 0 && !covered; a = parents[a]) {
+      covered = nodeDirty[a] == 2;
+    }
+    if (!covered) {
+      nodeDirty[n] = 2;
+      rebuildSubtree(n, primitiveBounds, pool, dirtyNodes, dirtySlots);
+    }
+  }
+  for (unsigned int k = 0; k < degraded.size(); k++) {
+    nodeDirty[degraded[k]] = 0;
+  }
+
+  coalesceRanges(dirtyNodes, dirtyNodeRanges);
+  coalesceRanges(dirtySlots, dirtyPrimitiveRanges);
+}
+
+void BVH::rebuildSubtree(int nodeIdx, const std::vector<AABB>& primitiveBounds, ThreadPool* pool,
+    std::vector<int>& dirtyNodes, std::vector<int>& dirtySlots) {
+  // Gather the subtree's child pairs, which are free to reuse, and its primitive slots,
+  // which are contiguous.
+  std::vector<int> freePairs;
+  int first = primitiveIndices.size();
+  int count = 0;
+  std::vector<int> stack(1, nodeIdx);
+  while (!stack.empty()) {
+    int n = stack.back();
+    stack.pop_back();
+    const BVHNode& node = nodes[n];
+    if (node.isLeaf()) {
+      first = std::min(first, (int)node.leftFirst);
+      count += node.count;
+    } else {
+      freePairs.push_back(node.leftFirst);
+      parents[node.leftFirst] = -1;
+      parents[node.leftFirst + 1] = -1;
+      stack.push_back(node.leftFirst);
+      stack.push_back(node.leftFirst + 1);
+    }
+  }
+
+  std::vector<AABB> subtreeBounds(count);
+  for (int i = 0; i < count; i++) {
+    subtreeBounds[i] = primitiveBounds[primitiveIndices[first + i]];
+  }
+  // The subtree gets the levels left below nodeIdx.
+  int nodeDepth = 0;
+  for (int a = parents[nodeIdx]; a >= 0; a = parents[a]) {
+    nodeDepth++;
+  }
+  BVH subtree;
+  subtree.build(subtreeBounds, pool, BVH_MAX_DEPTH - nodeDepth);
+
+  std::vector<int> reordered(count);
+  for (int i = 0; i < count; i++) {
+    reordered[i] = primitiveIndices[first + subtree.primitiveIndices[i]];
+    dirtySlots.push_back(first + i);
+  }
+  std::copy(reordered.begin(), reordered.end(), primitiveIndices.begin() + first);
+
+  // Place the new nodes in the freed pairs, appending if there are too few.
+  // Unused pairs are left unreferenced until the next full build.
+  std::vector<int> slots(subtree.nodes.size());
+  slots[0] = nodeIdx;
+  unsigned int nextPair = 0;
+  for (unsigned int i = 0; i < subtree.nodes.size(); i++) {
+    BVHNode node = subtree.nodes[i];
+    if (node.isLeaf()) {
+      node.leftFirst += first;
+    } else {
+      int pair;
+      if (nextPair < freePairs.size()) {
+        pair = freePairs[nextPair++];
+      } else {
+        pair = nodes.size();
+        nodes.resize(pair + 2);
+      }
+      // Children always follow their parent in a fresh build, so their slots are set before they are visited.
+      slots[node.leftFirst] = pair;
+      slots[node.leftFirst + 1] = pair + 1;
+      node.leftFirst = pair;
+    }
+    nodes[slots[i]] = node;
+    dirtyNodes.push_back(slots[i]);
+  }
+
+  linkSubtree(nodeIdx, parents[nodeIdx]);
+}
+
+int BVH::getDepth() const {
+  if (nodes.empty()) {
+    return 0;
+  }
+  // Walk from the root, since refits can leave unreferenced nodes behind.
+  int depth = 0;
+  std::vector<std::pair<int, int> > stack(1, std::make_pair(0, 0));
+  while (!stack.empty()) {
+    std::pair<int, int> entry = stack.back();
+    stack.pop_back();
+    const BVHNode& node = nodes[entry.first];
+    depth = std::max(depth, entry.second);
+    if (!node.isLeaf() && !(entry.first == 0 && primitiveIndices.empty())) {
+      stack.push_back(std::make_pair(node.leftFirst, entry.second + 1));
+      stack.push_back(std::make_pair(node.leftFirst + 1, entry.second + 1));
+    }
+  }
+  return depth;
+}
+
+float BVH::getSAHCost() const {
+  if (nodes.empty() || primitiveIndices.empty()) {
+    return 0;
+  }
+  float rootArea = AABB(nodes[0].min, nodes[0].max).surfaceArea();
+  if (rootArea <= 0) {
+    return 0;
+  }
+
+  // Walk from the root, since refits can leave unreferenced nodes behind.
+  float cost = 0;
+  std::vector<int> stack(1, 0);
+  while (!stack.empty()) {
+    const BVHNode& node = nodes[stack.back()];
+    stack.pop_back();
+    float area = AABB(node.min, node.max).surfaceArea();
+    if (node.isLeaf()) {
+      cost += node.count * area;
+    } else {
+      cost += BVH_TRAVERSAL_COST * area;
+      stack.push_back(node.leftFirst);
+      stack.push_back(node.leftFirst + 1);
+    }
+  }
+  return cost / rootArea;
+}
@@ -0,0 +1,171 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+#include <stdint.h>
+#include <glm/glm.hpp>
+
+#include "threadpool.hpp"
+
+#define BVH_MAX_LEAF_SIZE 4
+// Deepest a leaf may lie below the root. The shaders' traversal stacks hold one
+// entry per level plus one, so BVH_STACK_SIZE in shaders/scene.glsl must be
+// at least BVH_MAX_DEPTH + 1.
+#define BVH_MAX_DEPTH 31
+#define BVH_NUM_BINS 16
+// Cost of visiting a node, relative to intersecting one primitive.
+#define BVH_TRAVERSAL_COST 1.0f
+// A refitted node is rebuilt once the overlap of its children, as a fraction of
+// its own surface area, has grown by this much since it was built.
+#define BVH_REFIT_OVERLAP_THRESHOLD 0.3f
+
+struct AABB {
+  AABB();
+  AABB(const glm::vec3& min, const glm::vec3& max);
+
+  void grow(const glm::vec3& p) {
+    min = glm::min(min, p);
+    max = glm::max(max, p);
+  }
+
+  void grow(const AABB& b) {
+    min = glm::min(min, b.min);
+    max = glm::max(max, b.max);
+  }
+
+  glm::vec3 centroid() const {
+    return 0.5f * (min + max);
+  }
+
+  float surfaceArea() const;
+
+  glm::vec3 min;
+  glm::vec3 max;
+};
+
+/**
+ * Flattened node, laid out so that the GPU can fetch it as two RGBA32F texels:
+ *   (min.xyz, leftFirst) (max.xyz, count)
+ * Leaves have count > 0 and reference primitives [leftFirst, leftFirst + count).
+ * Interior nodes have count == 0 and children at leftFirst and leftFirst + 1.
+ */
+struct BVHNode {
+  glm::vec3 min;
+  int32_t leftFirst;
+  glm::vec3 max;
+  int32_t count;
+
+  bool isLeaf() const {
+    return count > 0;
+  }
+};
+
+/**
+ * Half-open index range [begin, end).
+ */
+struct IndexRange {
+  IndexRange(int begin, int end): begin(begin), end(end) {}
+
+  int size() const {
+    return end - begin;
+  }
+
+  int begin;
+  int end;
+};
+
+class BVH {
+public:
+  BVH();
+
+  /**
+   * Binned SAH build over the given primitive bounds.
+   * With a pool, large nodes are binned and partitioned in parallel and
+   * subtrees are built as separate tasks.
+   * Leaves reference primitives through getPrimitiveIndices(), so callers
+   * should reorder their primitive data by it before uploading.
+   * No leaf lies deeper than maxDepth: where an SAH split would leave a child
+   * more primitives than can reach small leaves in the levels left, the node
+   * is split at its median instead.
+   */
+  void build(const std::vector<AABB>& primitiveBounds, ThreadPool* pool = NULL, int maxDepth = BVH_MAX_DEPTH);
+
+  /**
+   * Adopt a tree previously built over primitiveIndices.size() primitives, as
+   * saved from getNodes() and getPrimitiveIndices(). Returns false, leaving the
+   * BVH empty, if any node references a child or primitive out of range, or
+   * the tree is deeper than BVH_MAX_DEPTH.
+   */
+  bool load(const std::vector<BVHNode>& nodes, const std::vector<int>& primitiveIndices);
+
+  /**
+   * Update the tree after some primitives moved, touching only their leaves and
+   * ancestors. Subtrees whose children have come to overlap too much (see
+   * BVH_REFIT_OVERLAP_THRESHOLD) are rebuilt in place.
+   * primitiveBounds and changedPrimitives use the indices given to build().
+   */
+  void refit(const std::vector<AABB>& primitiveBounds, const std::vector<int>& changedPrimitives, ThreadPool* pool = NULL);
+
+  /**
+   * Nodes written by the last refit(), coalesced into ranges for partial uploads.
+   */
+  const std::vector<IndexRange>& getDirtyNodeRanges() const {
+    return dirtyNodeRanges;
+  }
+
+  /**
+   * Positions in getPrimitiveIndices() whose primitive moved or was reordered
+   * by the last refit(). Callers should re-upload their data for these slots.
+   */
+  const std::vector<IndexRange>& getDirtyPrimitiveRanges() const {
+    return dirtyPrimitiveRanges;
+  }
+
+  const std::vector<BVHNode>& getNodes() const {
+    return nodes;
+  }
+
+  const std::vector<int>& getPrimitiveIndices() const {
+    return primitiveIndices;
+  }
+
+  int getNumNodes() const {
+    return nodes.size();
+  }
+
+  /**
+   * Levels below the root of the deepest leaf.
+   */
+  int getDepth() const;
+
+  /**
+   * Expected cost of a random ray under the surface area heuristic,
+   * in units of primitive intersections.
+   */
+  float getSAHCost() const;
+
+private:
+  struct BuildState;
+
+  void subdivide(int nodeIdx, int depth, BuildState& state, TaskGroup& group);
+
+  // Fill in parents, primitiveLeaves and buildOverlap for the subtree at nodeIdx.
+  void linkSubtree(int nodeIdx, int parentIdx);
+  float childOverlap(int nodeIdx) const;
+  void rebuildSubtree(int nodeIdx, const std::vector<AABB>& primitiveBounds, ThreadPool* pool,
+      std::vector<int>& dirtyNodes, std::vector<int>& dirtySlots);
+
+  std::vector<BVHNode> nodes;
+  std::vector<int> primitiveIndices;
+
+  // Refit bookkeeping.
+  std::vector<int> parents;
+  std::vector<int> primitiveLeaves;
+  std::vector<float> buildOverlap;
+  std::vector<char> nodeDirty;
+
+  std::vector<IndexRange> dirtyNodeRanges;
+  std::vector<IndexRange> dirtyPrimitiveRanges;
+};
+
+#endif
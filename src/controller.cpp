@@ -7,7 +7,7 @@
 #include "sound.hpp"
 
 Controller::Controller(Viewer* viewer, Settings* settings)
-  : viewer(viewer), settings(settings), lastTime(0), position(0, 0, 0), velocity(0, 0, 0), horizontalAngle(0), verticalAngle(0), skipMovements(2), jumping(false) {
+  : viewer(viewer), settings(settings), lastTime(0), position(0, 0, 0), velocity(0, 0, 0), horizontalAngle(0), verticalAngle(0), skipMovements(2), jumping(false), animating(false), wavefront(true), lightSampling(false) {
 }
 
 Controller::~Controller() {
@@ -155,6 +155,19 @@ void Controller::update() {
     position -= glm::vec3(0, 1, 0) * deltaTime * SPEED;
   }
 
+  if (checkKeyJustPressed(GLFW_KEY_F)) {
+    animating = !animating;
+    std::cerr << (animating ? "Animating" : "Holding the scene still") << std::endl;
+  }
+  if (checkKeyJustPressed(GLFW_KEY_G)) {
+    wavefront = !wavefront;
+    std::cerr << (wavefront ? "Wavefront pipeline" : "Fragment shader pipeline") << std::endl;
+  }
+  if (checkKeyJustPressed(GLFW_KEY_L)) {
+    lightSampling = !lightSampling;
+    std::cerr << (lightSampling ? "Sampling lights from the light tree" : "Shading every light in range") << std::endl;
+  }
+
   // Settings toggled by key press.
   for (int i = 0; i < 10; i++) {
     if (checkKeyJustPressed(GLFW_KEY_0 + i) || checkKeyJustPressed(GLFW_KEY_KP_0 + i)) {
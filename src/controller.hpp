@@ -30,6 +30,35 @@ public:
     return jumping;
   }
 
+  /**
+   * Toggled with F, and off unless the viewer was started with --animate.
+   * Otherwise the scene holds still, so a view that isn't moving either
+   * accumulates samples.
+   */
+  bool isAnimating() {
+    return animating;
+  }
+  void setAnimating(bool a) {
+    animating = a;
+  }
+
+  /**
+   * Toggled with G, to compare the wavefront pipeline, when the driver has
+   * it, against the fragment shader.
+   */
+  bool isWavefrontEnabled() {
+    return wavefront;
+  }
+
+  /**
+   * Toggled with L. Each hit is shaded with a few lights picked at random
+   * from the light tree, which is noisy until the view accumulates samples
+   * but costs the same however many lights there are.
+   */
+  bool isLightSamplingEnabled() {
+    return lightSampling;
+  }
+
 private:
   bool checkKeyJustPressed(int k);
   bool checkMouseJustPressed(int i);
@@ -46,6 +75,9 @@ private:
   std::map<int, bool> keysPressed;
   std::map<int, bool> mousePressed;
   bool jumping;
+  bool animating;
+  bool wavefront;
+  bool lightSampling;
 };
 
 #endif
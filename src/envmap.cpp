@@ -0,0 +1,491 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "envmap.hpp"
+#include "texturecompress.hpp"
+
+static const char envmapCacheMagic[4] = {'R', 'T', '2', 'E'};
+
+struct EnvmapCacheHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t compressed;
+  int32_t size;
+  int32_t numLevels;
+  int32_t irradianceSize;
+  int64_t sourceModified[6];
+  int64_t sourceSize[6];
+};
+
+/**
+ * One level of a cube, as RGBA floats in [0, 1] so a texel fills an SSE register.
+ */
+struct CubeLevel {
+  int size;
+  std::vector<float> faces[6];
+
+  const float* getTexel(int face, int x, int y) const {
+    return &faces[face][4 * ((size_t)y * size + x)];
+  }
+};
+
+// Direction through the center of texel (x, y) of a face, as GL's cube map lookup defines faces.
+static void getTexelDirection(int face, int x, int y, int size, float d[3]) {
+  float s = (x + 0.5f) / size * 2 - 1;
+  float t = (y + 0.5f) / size * 2 - 1;
+  switch (face) {
+    case 0: d[0] = 1; d[1] = -t; d[2] = -s; break;
+    case 1: d[0] = -1; d[1] = -t; d[2] = s; break;
+    case 2: d[0] = s; d[1] = 1; d[2] = t; break;
+    case 3: d[0] = s; d[1] = -1; d[2] = -t; break;
+    case 4: d[0] = s; d[1] = -t; d[2] = 1; break;
+    default: d[0] = -s; d[1] = -t; d[2] = -1; break;
+  }
+  float length = sqrtf(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+  for (int c = 0; c < 3; c++) {
+    d[c] /= length;
+  }
+}
+
+// Add weight times the bilinearly filtered texel that direction d reaches to sum.
+// Filtering stops at face edges, which is invisible once many samples are averaged.
+static void addSample(const CubeLevel& level, const float d[3], float weight, float sum[4]) {
+  float ax = fabsf(d[0]), ay = fabsf(d[1]), az = fabsf(d[2]);
+  int face;
+  float sc, tc, ma;
+  if (ax >= ay && ax >= az) {
+    face = d[0] > 0 ? 0 : 1;
+    sc = d[0] > 0 ? -d[2] : d[2];
+    tc = -d[1];
+    ma = ax;
+  } else if (ay >= az) {
+    face = d[1] > 0 ? 2 : 3;
+    sc = d[0];
+    tc = d[1] > 0 ? d[2] : -d[2];
+    ma = ay;
+  } else {
+    face = d[2] > 0 ? 4 : 5;
+    sc = d[2] > 0 ? d[0] : -d[0];
+    tc = -d[1];
+    ma = az;
+  }
+  float u = (sc / ma + 1) * 0.5f * level.size - 0.5f;
+  float v = (tc / ma + 1) * 0.5f * level.size - 0.5f;
+  u = std::min(std::max(u, 0.0f), level.size - 1.0f);
+  v = std::min(std::max(v, 0.0f), level.size - 1.0f);
+  int x0 = (int)u, y0 = (int)v;
+  int x1 = std::min(x0 + 1, level.size - 1), y1 = std::min(y0 + 1, level.size - 1);
+  float fx = u - x0, fy = v - y0;
+  float w00 = weight * (1 - fx) * (1 - fy);
+  float w10 = weight * fx * (1 - fy);
+  float w01 = weight * (1 - fx) * fy;
+  float w11 = weight * fx * fy;
+  const float* t00 = level.getTexel(face, x0, y0);
+  const float* t10 = level.getTexel(face, x1, y0);
+  const float* t01 = level.getTexel(face, x0, y1);
+  const float* t11 = level.getTexel(face, x1, y1);
+
+#ifdef __SSE2__
+  __m128 result = _mm_add_ps(
+    _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(t00), _mm_set1_ps(w00)), _mm_mul_ps(_mm_loadu_ps(t10), _mm_set1_ps(w10))),
+    _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(t01), _mm_set1_ps(w01)), _mm_mul_ps(_mm_loadu_ps(t11), _mm_set1_ps(w11))));
+  _mm_storeu_ps(sum, _mm_add_ps(_mm_loadu_ps(sum), result));
+#else
+  for (int c = 0; c < 4; c++) {
+    sum[c] += t00[c]*w00 + t10[c]*w10 + t01[c]*w01 + t11[c]*w11;
+  }
+#endif
+}
+
+static void downsample(const CubeLevel& src, CubeLevel& dst, ThreadPool* pool) {
+  dst.size = std::max(1, src.size / 2);
+  for (int face = 0; face < 6; face++) {
+    dst.faces[face].resize(4 * (size_t)dst.size * dst.size);
+  }
+  parallelFor(pool, 0, 6 * dst.size, ENVMAP_GRAIN_SIZE, [&](int begin, int end) {
+    for (int row = begin; row < end; row++) {
+      int face = row / dst.size;
+      int y = row % dst.size;
+      int y0 = std::min(2*y, src.size - 1), y1 = std::min(2*y + 1, src.size - 1);
+      for (int x = 0; x < dst.size; x++) {
+        int x0 = std::min(2*x, src.size - 1), x1 = std::min(2*x + 1, src.size - 1);
+        const float* t00 = src.getTexel(face, x0, y0);
+        const float* t10 = src.getTexel(face, x1, y0);
+        const float* t01 = src.getTexel(face, x0, y1);
+        const float* t11 = src.getTexel(face, x1, y1);
+        float* out = &dst.faces[face][4 * ((size_t)y * dst.size + x)];
+#ifdef __SSE2__
+        __m128 sum = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(t00), _mm_loadu_ps(t10)), _mm_add_ps(_mm_loadu_ps(t01), _mm_loadu_ps(t11)));
+        _mm_storeu_ps(out, _mm_mul_ps(sum, _mm_set1_ps(0.25f)));
+#else
+        for (int c = 0; c < 4; c++) {
+          out[c] = (t00[c] + t10[c] + t01[c] + t11[c]) * 0.25f;
+        }
+#endif
+      }
+    }
+  });
+}
+
+/**
+ * A GGX sample for a given roughness, in the tangent space of the normal,
+ * with the view along the normal as in the split-sum approximation.
+ */
+struct PrefilterSample {
+  float l[3];
+  float weight;
+  // Box-filtered level whose texels cover about as much solid angle as the sample.
+  int sourceLevel;
+};
+
+static float radicalInverse(unsigned int bits) {
+  bits = (bits << 16) | (bits >> 16);
+  bits = ((bits & 0x55555555u) << 1) | ((bits & 0xAAAAAAAAu) >> 1);
+  bits = ((bits & 0x33333333u) << 2) | ((bits & 0xCCCCCCCCu) >> 2);
+  bits = ((bits & 0x0F0F0F0Fu) << 4) | ((bits & 0xF0F0F0F0u) >> 4);
+  bits = ((bits & 0x00FF00FFu) << 8) | ((bits & 0xFF00FF00u) >> 8);
+  return bits * 2.3283064365386963e-10f;
+}
+
+static std::vector<PrefilterSample> getPrefilterSamples(float roughness, int numSamples, int baseSize, int numLevels) {
+  float alpha = roughness * roughness;
+  float texelSolidAngle = 4 * (float)M_PI / (6.0f * baseSize * baseSize);
+  std::vector<PrefilterSample> samples;
+  for (int i = 0; i < numSamples; i++) {
+    // Hammersley point, importance sampled to a GGX half vector.
+    float phi = 2 * (float)M_PI * (i + 0.5f) / numSamples;
+    float xi = radicalInverse(i);
+    float cosTheta = sqrtf((1 - xi) / (1 + (alpha*alpha - 1) * xi));
+    float sinTheta = sqrtf(1 - cosTheta*cosTheta);
+    float h[3] = {sinTheta * cosf(phi), sinTheta * sinf(phi), cosTheta};
+
+    // Reflect the view, which is the normal, about h.
+    PrefilterSample sample;
+    sample.l[0] = 2 * cosTheta * h[0];
+    sample.l[1] = 2 * cosTheta * h[1];
+    sample.l[2] = 2 * cosTheta * h[2] - 1;
+    sample.weight = sample.l[2];
+    if (sample.weight <= 0) {
+      continue;
+    }
+
+    // With the view along the normal, the pdf of l is D / 4.
+    float denominator = cosTheta*cosTheta * (alpha*alpha - 1) + 1;
+    float pdf = alpha*alpha / ((float)M_PI * denominator * denominator) / 4;
+    float sampleSolidAngle = 1 / (numSamples * pdf);
+    float level = 0.5f * log2f(sampleSolidAngle / texelSolidAngle) + 1;
+    sample.sourceLevel = std::min(std::max((int)(level + 0.5f), 0), numLevels - 1);
+    samples.push_back(sample);
+  }
+  return samples;
+}
+
+static void prefilterLevel(const std::vector<CubeLevel>& pyramid, int levelIndex, float roughness, CubeLevel& out, ThreadPool* pool) {
+  int numSamples = std::min(ENVMAP_PREFILTER_SAMPLES, 8 << levelIndex);
+  std::vector<PrefilterSample> samples = getPrefilterSamples(roughness, numSamples, pyramid[0].size, pyramid.size());
+  out.size = pyramid[levelIndex].size;
+  for (int face = 0; face < 6; face++) {
+    out.faces[face].resize(4 * (size_t)out.size * out.size);
+  }
+  parallelFor(pool, 0, 6 * out.size, ENVMAP_GRAIN_SIZE, [&](int begin, int end) {
+    for (int row = begin; row < end; row++) {
+      int face = row / out.size;
+      int y = row % out.size;
+      for (int x = 0; x < out.size; x++) {
+        float n[3];
+        getTexelDirection(face, x, y, out.size, n);
+        float up[3] = {0, 0, 0};
+        up[fabsf(n[2]) < 0.999f ? 2 : 0] = 1;
+        // Tangent frame: t = normalize(up x n), b = n x t.
+        float t[3] = {up[1]*n[2] - up[2]*n[1], up[2]*n[0] - up[0]*n[2], up[0]*n[1] - up[1]*n[0]};
+        float length = sqrtf(t[0]*t[0] + t[1]*t[1] + t[2]*t[2]);
+        for (int c = 0; c < 3; c++) {
+          t[c] /= length;
+        }
+        float b[3] = {n[1]*t[2] - n[2]*t[1], n[2]*t[0] - n[0]*t[2], n[0]*t[1] - n[1]*t[0]};
+
+        float sum[4] = {0, 0, 0, 0};
+        float totalWeight = 0;
+        for (unsigned int i = 0; i < samples.size(); i++) {
+          const PrefilterSample& sample = samples[i];
+          float l[3];
+          for (int c = 0; c < 3; c++) {
+            l[c] = t[c]*sample.l[0] + b[c]*sample.l[1] + n[c]*sample.l[2];
+          }
+          addSample(pyramid[sample.sourceLevel], l, sample.weight, sum);
+          totalWeight += sample.weight;
+        }
+        float* texel = &out.faces[face][4 * ((size_t)y * out.size + x)];
+        for (int c = 0; c < 4; c++) {
+          texel[c] = totalWeight > 0 ? sum[c] / totalWeight : 0;
+        }
+      }
+    }
+  });
+}
+
+static void computeIrradiance(const CubeLevel& source, CubeLevel& out, ThreadPool* pool) {
+  // Every source texel as a direction and its radiance times solid angle,
+  // one array per component and padded to a multiple of four with zeros.
+  int numTexels = 6 * source.size * source.size;
+  int padded = (numTexels + 3) / 4 * 4;
+  std::vector<float> dx(padded, 0), dy(padded, 0), dz(padded, 0), r(padded, 0), g(padded, 0), b(padded, 0);
+  int i = 0;
+  for (int face = 0; face < 6; face++) {
+    for (int y = 0; y < source.size; y++) {
+      for (int x = 0; x < source.size; x++, i++) {
+        float d[3];
+        getTexelDirection(face, x, y, source.size, d);
+        float s = (x + 0.5f) / source.size * 2 - 1;
+        float t = (y + 0.5f) / source.size * 2 - 1;
+        float solidAngle = 4.0f / (source.size * source.size) / powf(1 + s*s + t*t, 1.5f);
+        const float* texel = source.getTexel(face, x, y);
+        dx[i] = d[0];
+        dy[i] = d[1];
+        dz[i] = d[2];
+        r[i] = texel[0] * solidAngle;
+        g[i] = texel[1] * solidAngle;
+        b[i] = texel[2] * solidAngle;
+      }
+    }
+  }
+
+  for (int face = 0; face < 6; face++) {
+    out.faces[face].resize(4 * (size_t)out.size * out.size);
+  }
+  parallelFor(pool, 0, 6 * out.size, ENVMAP_GRAIN_SIZE, [&](int begin, int end) {
+    for (int row = begin; row < end; row++) {
+      int face = row / out.size;
+      int y = row % out.size;
+      for (int x = 0; x < out.size; x++) {
+        float n[3];
+        getTexelDirection(face, x, y, out.size, n);
+        float sum[3] = {0, 0, 0};
+        int k = 0;
+#ifdef __SSE2__
+        __m128 nx = _mm_set1_ps(n[0]), ny = _mm_set1_ps(n[1]), nz = _mm_set1_ps(n[2]);
+        __m128 sumR = _mm_setzero_ps(), sumG = _mm_setzero_ps(), sumB = _mm_setzero_ps();
+        for (; k < padded; k += 4) {
+          __m128 cosine = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, _mm_loadu_ps(&dx[k])), _mm_mul_ps(ny, _mm_loadu_ps(&dy[k]))),
+            _mm_mul_ps(nz, _mm_loadu_ps(&dz[k])));
+          cosine = _mm_max_ps(cosine, _mm_setzero_ps());
+          sumR = _mm_add_ps(sumR, _mm_mul_ps(cosine, _mm_loadu_ps(&r[k])));
+          sumG = _mm_add_ps(sumG, _mm_mul_ps(cosine, _mm_loadu_ps(&g[k])));
+          sumB = _mm_add_ps(sumB, _mm_mul_ps(cosine, _mm_loadu_ps(&b[k])));
+        }
+        float lanes[3][4];
+        _mm_storeu_ps(lanes[0], sumR);
+        _mm_storeu_ps(lanes[1], sumG);
+        _mm_storeu_ps(lanes[2], sumB);
+        for (int c = 0; c < 3; c++) {
+          sum[c] = lanes[c][0] + lanes[c][1] + lanes[c][2] + lanes[c][3];
+        }
+#endif
+        for (; k < padded; k++) {
+          float cosine = std::max(n[0]*dx[k] + n[1]*dy[k] + n[2]*dz[k], 0.0f);
+          sum[0] += cosine * r[k];
+          sum[1] += cosine * g[k];
+          sum[2] += cosine * b[k];
+        }
+        float* texel = &out.faces[face][4 * ((size_t)y * out.size + x)];
+        for (int c = 0; c < 3; c++) {
+          texel[c] = sum[c] / (float)M_PI;
+        }
+        texel[3] = 1;
+      }
+    }
+  });
+}
+
+// Tightly packed BGR, as GL takes it with an unpack alignment of 1.
+static void toBGR(const CubeLevel& level, int face, std::vector<unsigned char>& out) {
+  size_t numTexels = (size_t)level.size * level.size;
+  out.resize(3 * numTexels);
+  for (size_t i = 0; i < numTexels; i++) {
+    for (int c = 0; c < 3; c++) {
+      float value = level.faces[face][4*i + c];
+      out[3*i + 2 - c] = (unsigned char)std::min(std::max(value * 255 + 0.5f, 0.0f), 255.0f);
+    }
+  }
+}
+
+void prefilterEnvironment(
+    const unsigned char* faces[6],
+    int pitch,
+    int size,
+    bool compress,
+    EnvironmentMap& out,
+    ThreadPool* pool) {
+  std::vector<CubeLevel> pyramid(1);
+  pyramid[0].size = size;
+  for (int face = 0; face < 6; face++) {
+    std::vector<float>& texels = pyramid[0].faces[face];
+    texels.resize(4 * (size_t)size * size);
+    for (int y = 0; y < size; y++) {
+      const unsigned char* row = faces[face] + (size_t)y * pitch;
+      for (int x = 0; x < size; x++) {
+        float* texel = &texels[4 * ((size_t)y * size + x)];
+        texel[0] = row[3*x + 2] / 255.0f;
+        texel[1] = row[3*x + 1] / 255.0f;
+        texel[2] = row[3*x] / 255.0f;
+        texel[3] = 1;
+      }
+    }
+  }
+  while (pyramid.back().size > 1) {
+    pyramid.push_back(CubeLevel());
+    downsample(pyramid[pyramid.size() - 2], pyramid.back(), pool);
+  }
+
+  int numLevels = pyramid.size();
+  out.compressed = compress;
+  out.size = size;
+  for (int face = 0; face < 6; face++) {
+    out.radiance[face].assign(numLevels, std::vector<unsigned char>());
+  }
+  std::vector<unsigned char> bgr;
+  for (int level = 0; level < numLevels; level++) {
+    CubeLevel filtered;
+    if (level > 0) {
+      prefilterLevel(pyramid, level, level / (numLevels - 1.0f), filtered, pool);
+    }
+    const CubeLevel& result = level > 0 ? filtered : pyramid[0];
+    for (int face = 0; face < 6; face++) {
+      toBGR(result, face, bgr);
+      if (compress) {
+        CompressedTexture encoded;
+        compressTexture(&bgr[0], 3 * result.size, result.size, result.size, COMPRESS_BC1, false, encoded, pool);
+        out.radiance[face][level].swap(encoded.levels[0]);
+      } else {
+        out.radiance[face][level].swap(bgr);
+      }
+    }
+  }
+
+  int sourceLevel = 0;
+  while (pyramid[sourceLevel].size > ENVMAP_IRRADIANCE_SOURCE_SIZE) {
+    sourceLevel++;
+  }
+  CubeLevel irradiance;
+  irradiance.size = ENVMAP_IRRADIANCE_SIZE;
+  computeIrradiance(pyramid[sourceLevel], irradiance, pool);
+  out.irradianceSize = irradiance.size;
+  for (int face = 0; face < 6; face++) {
+    toBGR(irradiance, face, out.irradiance[face]);
+  }
+}
+
+static size_t getRadianceSize(bool compressed, int size) {
+  return compressed ? (size_t)((size + 3) / 4) * ((size + 3) / 4) * 8 : 3 * (size_t)size * size;
+}
+
+static bool getSourceStamps(std::string fnames[6], int64_t modified[6], int64_t size[6]) {
+  for (int face = 0; face < 6; face++) {
+    if (!getSourceStamp(fnames[face], modified[face], size[face])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool readBlock(std::ifstream& in, size_t expectedSize, std::vector<unsigned char>& out) {
+  uint64_t size = 0;
+  if (!in.read((char*)&size, sizeof(size)) || size != expectedSize) {
+    return false;
+  }
+  out.resize(size);
+  return (bool)in.read((char*)&out[0], size);
+}
+
+static void writeBlock(std::ofstream& out, const std::vector<unsigned char>& data) {
+  uint64_t size = data.size();
+  out.write((const char*)&size, sizeof(size));
+  out.write((const char*)&data[0], size);
+}
+
+bool readEnvironmentMap(std::string fnames[6], bool compress, EnvironmentMap& out) {
+  int64_t sourceModified[6], sourceSize[6];
+  if (!getSourceStamps(fnames, sourceModified, sourceSize)) {
+    return false;
+  }
+  std::ifstream in((fnames[0] + ENVMAP_CACHE_EXTENSION).c_str(), std::ios::binary);
+  if (!in) {
+    return false;
+  }
+
+  EnvmapCacheHeader header;
+  if (!in.read((char*)&header, sizeof(header)) ||
+      memcmp(header.magic, envmapCacheMagic, sizeof(envmapCacheMagic)) != 0 ||
+      header.version != ENVMAP_CACHE_VERSION ||
+      header.compressed != (compress ? 1u : 0u) ||
+      memcmp(header.sourceModified, sourceModified, sizeof(sourceModified)) != 0 ||
+      memcmp(header.sourceSize, sourceSize, sizeof(sourceSize)) != 0 ||
+      header.size <= 0 || header.numLevels <= 0 || header.numLevels > 32 || header.irradianceSize <= 0) {
+    return false;
+  }
+
+  out.compressed = compress;
+  out.size = header.size;
+  out.irradianceSize = header.irradianceSize;
+  bool valid = true;
+  for (int face = 0; valid && face < 6; face++) {
+    out.radiance[face].resize(header.numLevels);
+    for (int level = 0; valid && level < header.numLevels; level++) {
+      valid = readBlock(in, getRadianceSize(compress, out.getLevelSize(level)), out.radiance[face][level]);
+    }
+  }
+  for (int face = 0; valid && face < 6; face++) {
+    valid = readBlock(in, getRadianceSize(false, out.irradianceSize), out.irradiance[face]);
+  }
+  if (!valid) {
+    std::cerr << "Ignoring damaged environment cache for " << fnames[0] << std::endl;
+    out = EnvironmentMap();
+  }
+  return valid;
+}
+
+bool writeEnvironmentMap(std::string fnames[6], const EnvironmentMap& map) {
+  EnvmapCacheHeader header;
+  memcpy(header.magic, envmapCacheMagic, sizeof(envmapCacheMagic));
+  header.version = ENVMAP_CACHE_VERSION;
+  header.compressed = map.compressed ? 1 : 0;
+  header.size = map.size;
+  header.numLevels = map.getNumLevels();
+  header.irradianceSize = map.irradianceSize;
+  if (!getSourceStamps(fnames, header.sourceModified, header.sourceSize)) {
+    return false;
+  }
+
+  // Write beside the cache and rename over it, so a concurrent reader never sees a partial file.
+  std::string cacheFile = fnames[0] + ENVMAP_CACHE_EXTENSION;
+  std::string tempFile = cacheFile + ".tmp";
+  std::ofstream out(tempFile.c_str(), std::ios::binary | std::ios::trunc);
+  if (!out) {
+    std::cerr << "Could not write " << tempFile << std::endl;
+    return false;
+  }
+  out.write((const char*)&header, sizeof(header));
+  for (int face = 0; face < 6; face++) {
+    for (int level = 0; level < map.getNumLevels(); level++) {
+      writeBlock(out, map.radiance[face][level]);
+    }
+  }
+  for (int face = 0; face < 6; face++) {
+    writeBlock(out, map.irradiance[face]);
+  }
+  out.close();
+  if (!out || std::rename(tempFile.c_str(), cacheFile.c_str()) != 0) {
+    std::cerr << "Could not write " << cacheFile << std::endl;
+    std::remove(tempFile.c_str());
+    return false;
+  }
+  return true;
+}
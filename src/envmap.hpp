@@ -0,0 +1,75 @@
+#ifndef ENVMAP_H
+#define ENVMAP_H
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "threadpool.hpp"
+
+// Bump whenever the filtering or the file layout changes.
+#define ENVMAP_CACHE_VERSION 1
+// Appended to the first face's file name.
+#define ENVMAP_CACHE_EXTENSION ".rt2env"
+// Edge of each irradiance face.
+#define ENVMAP_IRRADIANCE_SIZE 32
+// Irradiance is integrated over the largest mip no bigger than this, which is plenty for a cosine lobe.
+#define ENVMAP_IRRADIANCE_SOURCE_SIZE 16
+// GGX samples per prefiltered texel at the roughest levels. Smoother levels,
+// with narrower lobes and more texels, take fewer.
+#define ENVMAP_PREFILTER_SAMPLES 64
+// Texel rows per parallelFor chunk.
+#define ENVMAP_GRAIN_SIZE 8
+
+/**
+ * Skybox prefiltered for image-based lighting. Faces are in
+ * GL_TEXTURE_CUBE_MAP_POSITIVE_X order, each size x size at level 0.
+ *
+ * Radiance level l is the environment convolved with GGX for roughness
+ * l / (levels - 1), level 0 being the source itself, so a single textureLod()
+ * gives a glossy reflection. Irradiance is the cosine convolution divided by
+ * pi, the light a white diffuse surface facing that way reflects.
+ */
+struct EnvironmentMap {
+  EnvironmentMap(): compressed(false), size(0), irradianceSize(0) {}
+
+  int getNumLevels() const {
+    return radiance[0].size();
+  }
+
+  int getLevelSize(int level) const {
+    return std::max(1, size >> level);
+  }
+
+  // Radiance levels are BC1 when set, otherwise tightly packed BGR.
+  bool compressed;
+  int size;
+  std::vector<std::vector<unsigned char> > radiance[6];
+  int irradianceSize;
+  // Tightly packed BGR.
+  std::vector<unsigned char> irradiance[6];
+};
+
+/**
+ * Build out from six decoded square faces, 24-bit BGR rows pitch bytes apart
+ * as FreeImage stores them. Work is split across texel rows on pool.
+ */
+void prefilterEnvironment(
+  const unsigned char* faces[6],
+  int pitch,
+  int size,
+  bool compress,
+  EnvironmentMap& out,
+  ThreadPool* pool = NULL
+);
+
+/**
+ * Read the cache next to fnames[0]. Fails if it is missing, damaged, from
+ * another ENVMAP_CACHE_VERSION, compressed differently, or if any face has
+ * changed since.
+ */
+bool readEnvironmentMap(std::string fnames[6], bool compress, EnvironmentMap& out);
+
+bool writeEnvironmentMap(std::string fnames[6], const EnvironmentMap& map);
+
+#endif
@@ -1,4 +1,7 @@
 
+#include <algorithm>
+#include <cmath>
+
 #include "light.hpp"
 
 Light::Light(LightType type, const glm::vec3& colour, const glm::vec3& position, const glm::vec3& direction, float spread)
@@ -16,3 +19,22 @@ Light* Light::pointLight(const glm::vec3& colour, const glm::vec3& position) {
   return new Light(POINT, colour, position, glm::vec3(0, 0, 0), 0);
 }
 
+
+float Light::getInfluenceRadius() {
+  float intensity = std::max(colour.x, std::max(colour.y, colour.z));
+  if (type == DIRECTIONAL || intensity <= 0) {
+    return type == DIRECTIONAL ? -1 : 0;
+  }
+  // Solve falloff.z d^2 + falloff.y d + falloff.x = intensity / cutoff for d.
+  float c = falloff.x - intensity / LIGHT_INFLUENCE_CUTOFF;
+  if (c >= 0) {
+    return 0;
+  }
+  if (falloff.z > 0) {
+    return (-falloff.y + std::sqrt(falloff.y * falloff.y - 4 * falloff.z * c)) / (2 * falloff.z);
+  }
+  if (falloff.y > 0) {
+    return -c / falloff.y;
+  }
+  return -1;
+}
@@ -3,6 +3,9 @@
 
 #include <glm/glm.hpp>
 
+// Light below which a light's contribution is treated as none, setting its influence radius.
+#define LIGHT_INFLUENCE_CUTOFF (1.0f / 256)
+
 class Light {
 public:
   enum LightType {
@@ -37,6 +40,13 @@ public:
   float& getSpread() {
     return spread;
   }
+  /**
+   * Distance past which the brightest channel of colour, attenuated by
+   * 1 / (falloff.x + falloff.y d + falloff.z d^2), falls below
+   * LIGHT_INFLUENCE_CUTOFF. Negative when the light never falls off that far,
+   * as for directional lights or a constant falloff.
+   */
+  float getInfluenceRadius();
   bool isEnabled() {
     return enabled;
   }
@@ -0,0 +1,171 @@
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+
+#include "lightgrid.hpp"
+
+/**
+ * Fill in nodes[nodeIdx] over the lights order[begin, end), splitting them at
+ * the median along the longest axis of their positions until each leaf holds
+ * one. A node's children are appended together, so they sit side by side.
+ */
+static void subdivideLightTree(int nodeIdx, int begin, int end, std::vector<int>& order, const std::vector<glm::vec3>& positions,
+    const std::vector<float>& powers, std::vector<BVHNode>& nodes, std::vector<float>& nodePowers) {
+  AABB bounds;
+  float power = 0;
+  for (int i = begin; i < end; i++) {
+    bounds.grow(positions[order[i]]);
+    power += powers[order[i]];
+  }
+  nodes[nodeIdx].min = bounds.min;
+  nodes[nodeIdx].max = bounds.max;
+  nodePowers[nodeIdx] = power;
+  if (end - begin == 1) {
+    nodes[nodeIdx].leftFirst = order[begin];
+    nodes[nodeIdx].count = 1;
+    return;
+  }
+
+  glm::vec3 extent = bounds.max - bounds.min;
+  int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+  int mid = (begin + end) / 2;
+  std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](int a, int b) {
+    return positions[a][axis] < positions[b][axis];
+  });
+
+  int left = nodes.size();
+  nodes.resize(left + 2);
+  nodePowers.resize(left + 2);
+  nodes[nodeIdx].leftFirst = left;
+  nodes[nodeIdx].count = 0;
+  subdivideLightTree(left, begin, mid, order, positions, powers, nodes, nodePowers);
+  subdivideLightTree(left + 1, mid, end, order, positions, powers, nodes, nodePowers);
+}
+
+LightGrid::LightGrid(): numLights(0), numGlobalLights(0), maxLightsNear(0), cellSize(1), dims(0) {
+  lightBuffer = new TextureBuffer(GL_RGBA32F);
+  gridBuffer = new TextureBuffer(GL_R32I);
+}
+
+LightGrid::~LightGrid() {
+  delete lightBuffer;
+  delete gridBuffer;
+}
+
+void LightGrid::build(const std::vector<Light*>& lights) {
+  std::vector<GLfloat> lightData;
+  std::vector<int> globalLights;
+  std::vector<int> localLights;
+  std::vector<float> radii;
+  std::vector<glm::vec3> positions;
+  std::vector<float> powers;
+  bounds = AABB();
+  for (unsigned int i = 0; i < lights.size(); i++) {
+    Light* light = lights[i];
+    if (!light->isEnabled()) {
+      continue;
+    }
+    float radius = light->getInfluenceRadius();
+    if (radius == 0) {
+      // Too dim to light anything.
+      continue;
+    }
+    int lightIdx = lightData.size() / (4 * LIGHT_TEXELS);
+    const glm::vec3& p = light->getPosition();
+    const glm::vec3& c = light->getColour();
+    const glm::vec3& f = light->getFalloff();
+    GLfloat l[4 * LIGHT_TEXELS] = {
+      p.x, p.y, p.z, radius,
+      c.x, c.y, c.z, 0,
+      f.x, f.y, f.z, 0
+    };
+    lightData.insert(lightData.end(), l, l + 4 * LIGHT_TEXELS);
+    radii.push_back(radius);
+    positions.push_back(p);
+    powers.push_back(c.x + c.y + c.z);
+    if (radius < 0) {
+      globalLights.push_back(lightIdx);
+    } else {
+      localLights.push_back(lightIdx);
+      bounds.grow(AABB(p - glm::vec3(radius), p + glm::vec3(radius)));
+    }
+  }
+  numLights = radii.size();
+  numGlobalLights = globalLights.size();
+
+  // Roughly cubic cells, about LIGHT_GRID_TARGET_CELLS of them.
+  dims = glm::ivec3(0);
+  int numCells = 0;
+  if (!localLights.empty()) {
+    glm::vec3 extent = glm::max(bounds.max - bounds.min, glm::vec3(1e-3f));
+    float cellEdge = std::cbrt(extent.x * extent.y * extent.z / LIGHT_GRID_TARGET_CELLS);
+    for (int axis = 0; axis < 3; axis++) {
+      dims[axis] = std::min(std::max((int)std::ceil(extent[axis] / cellEdge), 1), LIGHT_GRID_MAX_AXIS_CELLS);
+    }
+    cellSize = extent / glm::vec3(dims);
+    numCells = dims.x * dims.y * dims.z;
+  }
+
+  // Bin each light into the cells its sphere of influence touches.
+  std::vector<std::vector<int> > cells(numCells);
+  for (unsigned int i = 0; i < localLights.size(); i++) {
+    int lightIdx = localLights[i];
+    glm::vec3 center(lightData[4 * LIGHT_TEXELS * lightIdx], lightData[4 * LIGHT_TEXELS * lightIdx + 1], lightData[4 * LIGHT_TEXELS * lightIdx + 2]);
+    float radius = radii[lightIdx];
+    glm::ivec3 first = glm::clamp(glm::ivec3(glm::floor((center - glm::vec3(radius) - bounds.min) / cellSize)), glm::ivec3(0), dims - glm::ivec3(1));
+    glm::ivec3 last = glm::clamp(glm::ivec3(glm::floor((center + glm::vec3(radius) - bounds.min) / cellSize)), glm::ivec3(0), dims - glm::ivec3(1));
+    for (int z = first.z; z <= last.z; z++) {
+      for (int y = first.y; y <= last.y; y++) {
+        for (int x = first.x; x <= last.x; x++) {
+          glm::vec3 cellMin = bounds.min + glm::vec3(x, y, z) * cellSize;
+          glm::vec3 nearest = glm::clamp(center, cellMin, cellMin + cellSize);
+          glm::vec3 offset = nearest - center;
+          if (glm::dot(offset, offset) <= radius * radius) {
+            cells[(z * dims.y + y) * dims.x + x].push_back(lightIdx);
+          }
+        }
+      }
+    }
+  }
+
+  std::vector<GLint> grid(2 * numCells);
+  grid.insert(grid.end(), globalLights.begin(), globalLights.end());
+  maxLightsNear = numGlobalLights;
+  for (int i = 0; i < numCells; i++) {
+    grid[2*i] = grid.size();
+    grid[2*i + 1] = cells[i].size();
+    grid.insert(grid.end(), cells[i].begin(), cells[i].end());
+    maxLightsNear = std::max(maxLightsNear, numGlobalLights + (int)cells[i].size());
+  }
+
+  // The tree follows the lights in the same buffer.
+  if (numLights > 0) {
+    std::vector<int> order(numLights);
+    for (int i = 0; i < numLights; i++) {
+      order[i] = i;
+    }
+    std::vector<BVHNode> nodes(1);
+    std::vector<float> nodePowers(1);
+    subdivideLightTree(0, 0, numLights, order, positions, powers, nodes, nodePowers);
+    for (unsigned int i = 0; i < nodes.size(); i++) {
+      GLfloat node[4 * LIGHT_TREE_NODE_TEXELS] = {
+        nodes[i].min.x, nodes[i].min.y, nodes[i].min.z, 0,
+        nodes[i].max.x, nodes[i].max.y, nodes[i].max.z, 0,
+        nodePowers[i], 0, 0, 0
+      };
+      memcpy(&node[3], &nodes[i].leftFirst, sizeof(GLfloat));
+      memcpy(&node[7], &nodes[i].count, sizeof(GLfloat));
+      lightData.insert(lightData.end(), node, node + 4 * LIGHT_TREE_NODE_TEXELS);
+    }
+  }
+
+  // Texture buffers can't be empty.
+  if (lightData.empty()) {
+    lightData.resize(4 * LIGHT_TEXELS, 0);
+  }
+  if (grid.empty()) {
+    grid.push_back(0);
+  }
+  lightBuffer->setData(&lightData[0], lightData.size() * sizeof(GLfloat));
+  gridBuffer->setData(&grid[0], grid.size() * sizeof(GLint));
+}
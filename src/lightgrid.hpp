@@ -0,0 +1,93 @@
+#ifndef LIGHT_GRID_H
+#define LIGHT_GRID_H
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "bvh.hpp"
+#include "light.hpp"
+#include "texture.hpp"
+
+// Cells LightGrid aims for over the bounds of its lights, and the most along any axis.
+#define LIGHT_GRID_TARGET_CELLS 4096
+#define LIGHT_GRID_MAX_AXIS_CELLS 32
+// Texels per light, and per light tree node, in the light buffer.
+#define LIGHT_TEXELS 3
+#define LIGHT_TREE_NODE_TEXELS 3
+// Lights the shaders pick from the tree per hit when sampling. Must match shaders/scene.glsl.
+#define LIGHT_TREE_SAMPLES 2
+
+/**
+ * Lights binned into a uniform world-space grid by influence radius, so a
+ * hit only considers the lights that can reach it, and a tree over them for
+ * picking a few lights at random when even that is too many.
+ *
+ * The grid spans the bounds of every light with a finite radius, and each
+ * cell lists the lights whose sphere of influence overlaps it. Lights with
+ * no radius are global and considered everywhere.
+ *
+ * The tree splits the lights at the median of their positions along the
+ * longest axis, down to one light per leaf, and each node keeps the bounds
+ * and total power of the lights under it. Packed into texture buffers for
+ * the ray tracing shaders:
+ *   lights    - RGBA32F, LIGHT_TEXELS per light: (position, influence radius)
+ *               (colour, 0) (falloff, 0). A negative radius never ends.
+ *               Then LIGHT_TREE_NODE_TEXELS per tree node, root first: a
+ *               BVHNode whose leaves hold the light index in leftFirst,
+ *               then (power, 0, 0, 0).
+ *   lightGrid - R32I, (first, count) per cell with x fastest, then the
+ *               global lights' indices, then each cell's list, where first
+ *               is where a cell's list starts in lightGrid.
+ */
+class LightGrid {
+public:
+  LightGrid();
+  ~LightGrid();
+
+  /**
+   * Pack the enabled lights and rebuild the grid and tree around them.
+   */
+  void build(const std::vector<Light*>& lights);
+
+  int getNumLights() {
+    return numLights;
+  }
+  int getNumGlobalLights() {
+    return numGlobalLights;
+  }
+  // Lights listed in the fullest cell, plus the global ones: the most any hit may shade.
+  int getMaxLightsNear() {
+    return maxLightsNear;
+  }
+
+  const AABB& getBounds() {
+    return bounds;
+  }
+  glm::vec3 getCellSize() {
+    return cellSize;
+  }
+  // Zero along every axis when no light has a finite radius.
+  glm::ivec3 getDims() {
+    return dims;
+  }
+
+  TextureBuffer* getLightBuffer() {
+    return lightBuffer;
+  }
+  TextureBuffer* getGridBuffer() {
+    return gridBuffer;
+  }
+
+private:
+  int numLights;
+  int numGlobalLights;
+  int maxLightsNear;
+  AABB bounds;
+  glm::vec3 cellSize;
+  glm::ivec3 dims;
+
+  TextureBuffer* lightBuffer;
+  TextureBuffer* gridBuffer;
+};
+
+#endif
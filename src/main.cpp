@@ -6,6 +6,7 @@
 */
 
 #include <iostream>
+#include <string>
 #include "viewer.hpp"
 
 int main(int argc, char* argv[]) {
@@ -15,8 +16,18 @@ int main(int argc, char* argv[]) {
     return -1;
   }
 
+  std::string modelFile;
+  bool animate = false;
+  for (int i = 1; i < argc; i++) {
+    if (std::string(argv[i]) == "--animate") {
+      animate = true;
+    } else {
+      modelFile = argv[i];
+    }
+  }
+
   Viewer viewer;
-  bool result = viewer.initialize();
+  bool result = viewer.initialize(modelFile, animate);
   if (!result) {
     exit(1);
   }
@@ -10,14 +10,32 @@ public:
   Material(const glm::vec3& ka, const glm::vec3& kd, const glm::vec3& ks, const glm::vec3& ke, float shininess)
     : ka(ka), kd(kd), ks(ks), ke(ke), shininess(shininess), diffuseTexture(0), normalTexture(0) {}
 
-  ~Material() {}
+  virtual ~Material() {
+    setTexture(diffuseTexture, NULL);
+    setTexture(normalTexture, NULL);
+  }
 
+  /**
+   * Textures are referenced for as long as the material holds them.
+   */
   void setDiffuseTexture(Texture* texture) {
-    diffuseTexture = texture;
+    setTexture(diffuseTexture, texture);
   }
 
   void setNormalTexture(Texture* texture) {
-    normalTexture = texture;
+    setTexture(normalTexture, texture);
+  }
+
+  /**
+   * Mark both textures as used this frame, needing mips from level down.
+   */
+  void touch(int level) {
+    if (diffuseTexture != NULL) {
+      diffuseTexture->touch(level);
+    }
+    if (normalTexture != NULL) {
+      normalTexture->touch(level);
+    }
   }
 
   glm::vec3& getAmbience() {
@@ -61,6 +79,16 @@ public:
   virtual bool isMirror() { return false; }
 
 protected:
+  static void setTexture(Texture*& slot, Texture* texture) {
+    if (texture != NULL) {
+      texture->acquire();
+    }
+    if (slot != NULL) {
+      slot->release();
+    }
+    slot = texture;
+  }
+
   glm::vec3 ka, kd, ks, ke;
   float shininess;
   Texture* diffuseTexture;
@@ -1,240 +1,343 @@
 
 #include "mesh.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
 #include <glm/glm.hpp>
 #include <iostream>
 #include <list>
+#include <set>
 
+#include "meshopt.hpp"
+#include "scenecache.hpp"
+#include "tangents.hpp"
 #include "texture.hpp"
 
 uint32_t Mesh::meshIdCounter = 1;
 
-Mesh::Mesh(
-    std::vector<glm::vec3>& vertices,
-    std::vector<glm::vec2>& uvs,
-    std::vector<glm::vec3>& normals,
-    std::vector<unsigned short>& indices,
-    Material* material): name(""), material(material) {
-
-  meshId = meshIdCounter++;
+static uint16_t floatToHalf(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  uint16_t sign = (bits >> 16) & 0x8000;
+  int exponent = (int)((bits >> 23) & 0xFF) - 127 + 15;
+  uint32_t mantissa = bits & 0x7FFFFF;
+
+  if (exponent >= 31) {
+    // Overflow, infinity and NaN.
+    bool isNaN = ((bits >> 23) & 0xFF) == 0xFF && mantissa != 0;
+    return sign | 0x7C00 | (isNaN ? 0x200 : 0);
+  }
+  if (exponent <= 0) {
+    // Denormal, or too small.
+    if (exponent < -10) {
+      return sign;
+    }
+    mantissa |= 0x800000;
+    int shift = 14 - exponent;
+    uint16_t half = mantissa >> shift;
+    // Round to nearest.
+    if ((mantissa >> (shift - 1)) & 1) {
+      half++;
+    }
+    return sign | half;
+  }
+  uint16_t half = sign | (exponent << 10) | (mantissa >> 13);
+  // Round to nearest; a carry correctly bumps the exponent.
+  if (mantissa & 0x1000) {
+    half++;
+  }
+  return half;
+}
 
-  modelMatrix = glm::mat4(1.0);
+static int16_t toSnorm16(float v) {
+  return (int16_t)floorf(glm::clamp(v, -1.0f, 1.0f) * 32767.0f + 0.5f);
+}
 
-  for (int i = 0; i < NUM_BUFS; i++) {
-    buffers[i] = 0;
+void octEncode(const glm::vec3& v, int16_t out[2]) {
+  float l1 = fabsf(v.x) + fabsf(v.y) + fabsf(v.z);
+  if (l1 == 0) {
+    out[0] = out[1] = 0;
+    return;
   }
+  float x = v.x / l1;
+  float y = v.y / l1;
+  if (v.z < 0) {
+    float foldedX = (1 - fabsf(y)) * (x >= 0 ? 1 : -1);
+    float foldedY = (1 - fabsf(x)) * (y >= 0 ? 1 : -1);
+    x = foldedX;
+    y = foldedY;
+  }
+  out[0] = toSnorm16(x);
+  out[1] = toSnorm16(y);
+}
 
-  // Load scene data into VBOs.
-  glGenBuffers(NUM_BUFS, buffers);
-
-  glBindBuffer(GL_ARRAY_BUFFER, buffers[VERTEX_BUF]);
-  glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(glm::vec3), &vertices[0], GL_STATIC_DRAW);
+void quantizePosition(const glm::vec3& position, const glm::vec3& offset, const glm::vec3& scale, uint16_t out[3]) {
+  for (int axis = 0; axis < 3; axis++) {
+    float q = scale[axis] > 0 ? (position[axis] - offset[axis]) * (65535 / scale[axis]) : 0;
+    out[axis] = (uint16_t)glm::clamp(floorf(q + 0.5f), 0.0f, 65535.0f);
+  }
+}
 
-  glBindBuffer(GL_ARRAY_BUFFER, buffers[UV_BUF]);
-  glBufferData(GL_ARRAY_BUFFER, uvs.size() * sizeof(glm::vec2), &uvs[0], GL_STATIC_DRAW);
+static void packCompactVertex(const MeshVertex& v, const glm::vec3& positionOffset, const glm::vec3& positionScale, CompactMeshVertex& c) {
+  quantizePosition(v.position, positionOffset, positionScale, c.position);
+  octEncode(v.normal, c.normal);
+  octEncode(v.tangent, c.tangent);
+  c.bitangentSign = glm::dot(glm::cross(v.normal, v.tangent), v.bitangent) < 0 ? 0 : 65535;
+  c.uv[0] = floatToHalf(v.uv.x);
+  c.uv[1] = floatToHalf(v.uv.y);
+}
 
-  glBindBuffer(GL_ARRAY_BUFFER, buffers[NORMAL_BUF]);
-  glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(glm::vec3), &normals[0], GL_STATIC_DRAW);
+void MeshData::prepare(ThreadPool* pool) {
+  std::vector<MeshVertex> fullVertices(vertices.size());
+  for (unsigned int i = 0; i < vertices.size(); i++) {
+    MeshVertex& v = fullVertices[i];
+    v.position = vertices[i];
+    v.uv = i < uvs.size() ? uvs[i] : glm::vec2(0);
+    v.normal = i < normals.size() ? normals[i] : glm::vec3(0);
+    v.tangent = glm::vec3(0);
+    v.bitangent = glm::vec3(0);
+  }
 
   // Construct tangents.
-  std::vector<glm::vec3> tangents(vertices.size(), glm::vec3(0, 0, 0));
-  std::vector<glm::vec3> bitangents(vertices.size(), glm::vec3(0, 0, 0));
   // Only do tangents if there are enough UVs.
   //std::cerr << "#UVs: " << uvs.size() << ", #Vertices: " << vertices.size() << std::endl;
   if (uvs.size() >= vertices.size()) {
-    // Go through each triangular face and add tangents.
-    for (unsigned int face = 0; face*3 + 2 < indices.size(); face++) {
-      int p[] = {
-        indices[face*3],
-        indices[face*3+1],
-        indices[face*3+2]
-      };
-
-      // Edges of the triangle - position delta.
-      glm::vec3 deltaPos1 = vertices[p[1]] - vertices[p[0]];
-      glm::vec3 deltaPos2 = vertices[p[2]] - vertices[p[0]];
-
-      // UV delta
-      glm::vec2 deltaUV1 = uvs[p[1]] - uvs[p[0]];
-      glm::vec2 deltaUV2 = uvs[p[2]] - uvs[p[0]];
-
-      /*
-      std::cerr << "indices " << p[0] << ", " << p[1] << ", " << p[2] << std::endl;
-      std::cerr << "position "
-        << "(" << vertices[p[0]][0] << ", " << vertices[p[0]][1] << ", " << vertices[p[0]][2] << "), "
-        << "(" << vertices[p[1]][0] << ", " << vertices[p[1]][1] << ", " << vertices[p[1]][2] << "), "
-        << "(" << vertices[p[2]][0] << ", " << vertices[p[2]][1] << ", " << vertices[p[2]][2] << ")"
-        << std::endl;
-      std::cerr << "deltaPos1 "
-        << "(" << deltaPos1[0] << ", " << deltaPos1[1] << ", " << deltaPos1[2] << ")"
-        << std::endl;
-      std::cerr << "deltaPos2 "
-        << "(" << deltaPos2[0] << ", " << deltaPos2[1] << ", " << deltaPos2[2] << ")"
-        << std::endl;
-      std::cerr << "uvs "
-        << "(" << uvs[p[0]][0] << ", " << uvs[p[0]][1] << "), "
-        << "(" << uvs[p[1]][0] << ", " << uvs[p[1]][1] << "), "
-        << "(" << uvs[p[2]][0] << ", " << uvs[p[2]][1] << ")"
-        << std::endl;
-      std::cerr << "deltaUV1 " << deltaUV1[0] << ", " << deltaUV1[1] << std::endl;
-      std::cerr << "deltaUV2 " << deltaUV2[0] << ", " << deltaUV2[1] << std::endl;
-      */
-
-      float oneOverR = deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x;
-      if (oneOverR == 0) {
-        static bool nanErrorOutput = false;
-        if (!nanErrorOutput) {
-          nanErrorOutput = true;
-          std::cerr << "Error: NaN tangents computed!" << std::endl;
-        }
-        continue;
-      }
-      float r = 1.0f / oneOverR;
-      glm::vec3 tangent = (deltaPos1 * deltaUV2.y - deltaPos2 * deltaUV1.y) * r;
-      glm::vec3 bitangent = (deltaPos2 * deltaUV1.x - deltaPos1 * deltaUV2.x) * r;
-      //std::cerr << "tangent " << tangent[0] << ", " << tangent[1] << ", " << tangent[2] << std::endl;
-
-      for (unsigned int v = 0; v < 3; v++) {
-        tangents[p[v]] += tangent;
-        bitangents[p[v]] += bitangent;
+    TangentFrames frames;
+    frames.compute(vertices, uvs, indices, pool);
+    if (frames.getNumDegenerateFaces() > 0) {
+      // Meshes may be prepared on several threads at once.
+      static std::atomic<bool> nanErrorOutput(false);
+      if (!nanErrorOutput.exchange(true)) {
+        std::cerr << "Error: NaN tangents computed!" << std::endl;
       }
     }
+    for (unsigned int i = 0; i < vertices.size(); i++) {
+      fullVertices[i].tangent = frames.getTangents()[i];
+      fullVertices[i].bitangent = frames.getBitangents()[i];
+    }
+  }
 
-    glBindBuffer(GL_ARRAY_BUFFER, buffers[TANGENT_BUF]);
-    glBufferData(GL_ARRAY_BUFFER, tangents.size() * sizeof(glm::vec3), &tangents[0], GL_STATIC_DRAW);
+  if (!compactVertices) {
+    positionOffset = glm::vec3(0);
+    positionScale = glm::vec3(1);
+    const unsigned char* bytes = (const unsigned char*)(fullVertices.empty() ? NULL : &fullVertices[0]);
+    vertexData.assign(bytes, bytes + fullVertices.size() * sizeof(MeshVertex));
+    return;
+  }
 
-    glBindBuffer(GL_ARRAY_BUFFER, buffers[BITANGENT_BUF]);
-    glBufferData(GL_ARRAY_BUFFER, bitangents.size() * sizeof(glm::vec3), &bitangents[0], GL_STATIC_DRAW);
+  glm::vec3 boundsMin(0), boundsMax(0);
+  for (unsigned int i = 0; i < vertices.size(); i++) {
+    boundsMin = i == 0 ? vertices[i] : glm::min(boundsMin, vertices[i]);
+    boundsMax = i == 0 ? vertices[i] : glm::max(boundsMax, vertices[i]);
+  }
+  positionOffset = boundsMin;
+  positionScale = boundsMax - boundsMin;
+
+  vertexData.resize(fullVertices.size() * sizeof(CompactMeshVertex));
+  CompactMeshVertex* packed = (CompactMeshVertex*)(vertexData.empty() ? NULL : &vertexData[0]);
+  for (unsigned int i = 0; i < fullVertices.size(); i++) {
+    packCompactVertex(fullVertices[i], positionOffset, positionScale, packed[i]);
+  }
+}
+
+void MeshData::buildBVH(ThreadPool* pool) {
+  std::vector<AABB> triangleBounds(indices.size() / 3);
+  for (unsigned int i = 0; i < triangleBounds.size(); i++) {
+    for (int c = 0; c < 3; c++) {
+      triangleBounds[i].grow(vertices[indices[3*i + c]]);
+    }
+  }
+  bvh.build(triangleBounds, pool);
+}
+
+Mesh::Mesh(MeshData& data): name(data.name), compactVertices(data.compactVertices), tangentFrames(NULL), material(data.material) {
+
+  meshId = meshIdCounter++;
+
+  modelMatrix = glm::mat4(1.0);
+
+  for (int i = 0; i < NUM_BUFS; i++) {
+    buffers[i] = 0;
   }
 
+  // Load scene data into VBOs.
+  glGenBuffers(NUM_BUFS, buffers);
+  uploadVertices(data);
+
+  // Keep the geometry for the ray tracer.
+  vertices.swap(data.vertices);
+  normals.swap(data.normals);
+  indices.swap(data.indices);
+  std::swap(bvh, data.bvh);
 
   numIndices = indices.size();
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers[ELEMENT_BUF]);
-  glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned short), &indices[0], GL_STATIC_DRAW);
+  if (vertices.size() <= 65536) {
+    indexType = GL_UNSIGNED_SHORT;
+    std::vector<unsigned short> shortIndices(indices.begin(), indices.end());
+    indexBufferSize = shortIndices.size() * sizeof(unsigned short);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBufferSize, shortIndices.empty() ? NULL : &shortIndices[0], GL_STATIC_DRAW);
+  } else {
+    indexType = GL_UNSIGNED_INT;
+    indexBufferSize = indices.size() * sizeof(unsigned int);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBufferSize, &indices[0], GL_STATIC_DRAW);
+  }
+
+  // Record the vertex layout once, so drawing is a single VAO bind.
+  glGenVertexArrays(1, &vertexArrayId);
+  glBindVertexArray(vertexArrayId);
+  glBindBuffer(GL_ARRAY_BUFFER, buffers[VERTEX_BUF]);
+  for (int attrib = POSITION_ATTRIB; attrib <= BITANGENT_ATTRIB; attrib++) {
+    glEnableVertexAttribArray(attrib);
+  }
+  if (compactVertices) {
+    GLsizei stride = sizeof(CompactMeshVertex);
+    glVertexAttribPointer(POSITION_ATTRIB, 3, GL_UNSIGNED_SHORT, GL_TRUE, stride, (void*)offsetof(CompactMeshVertex, position));
+    glVertexAttribPointer(UV_ATTRIB, 2, GL_HALF_FLOAT, GL_FALSE, stride, (void*)offsetof(CompactMeshVertex, uv));
+    glVertexAttribPointer(NORMAL_ATTRIB, 2, GL_SHORT, GL_TRUE, stride, (void*)offsetof(CompactMeshVertex, normal));
+    glVertexAttribPointer(TANGENT_ATTRIB, 2, GL_SHORT, GL_TRUE, stride, (void*)offsetof(CompactMeshVertex, tangent));
+    glVertexAttribPointer(BITANGENT_ATTRIB, 1, GL_UNSIGNED_SHORT, GL_TRUE, stride, (void*)offsetof(CompactMeshVertex, bitangentSign));
+  } else {
+    GLsizei stride = sizeof(MeshVertex);
+    glVertexAttribPointer(POSITION_ATTRIB, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(MeshVertex, position));
+    glVertexAttribPointer(UV_ATTRIB, 2, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(MeshVertex, uv));
+    glVertexAttribPointer(NORMAL_ATTRIB, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(MeshVertex, normal));
+    glVertexAttribPointer(TANGENT_ATTRIB, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(MeshVertex, tangent));
+    glVertexAttribPointer(BITANGENT_ATTRIB, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(MeshVertex, bitangent));
+  }
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers[ELEMENT_BUF]);
 
+  glGenVertexArrays(1, &vertsOnlyVertexArrayId);
+  glBindVertexArray(vertsOnlyVertexArrayId);
+  glBindBuffer(GL_ARRAY_BUFFER, buffers[VERTEX_BUF]);
+  glEnableVertexAttribArray(POSITION_ATTRIB);
+  if (compactVertices) {
+    glVertexAttribPointer(POSITION_ATTRIB, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(CompactMeshVertex), (void*)offsetof(CompactMeshVertex, position));
+  } else {
+    glVertexAttribPointer(POSITION_ATTRIB, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void*)offsetof(MeshVertex, position));
+  }
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers[ELEMENT_BUF]);
+
+  glBindVertexArray(0);
 }
 
 Mesh::~Mesh() {
+  delete tangentFrames;
+  glDeleteVertexArrays(1, &vertexArrayId);
+  glDeleteVertexArrays(1, &vertsOnlyVertexArrayId);
   glDeleteBuffers(NUM_BUFS, buffers);
 }
 
-void Mesh::setUVs(std::vector<glm::vec2>& uvs) {
-  // TODO: Update Tangents and Bitangents!
-  glBindBuffer(GL_ARRAY_BUFFER, buffers[UV_BUF]);
-  glBufferData(GL_ARRAY_BUFFER, uvs.size() * sizeof(glm::vec2), &uvs[0], GL_STATIC_DRAW);
+void Mesh::uploadVertices(const MeshData& data) {
+  positionOffset = data.positionOffset;
+  positionScale = data.positionScale;
+  vertexBufferSize = data.vertexData.size();
+  glBindBuffer(GL_ARRAY_BUFFER, buffers[VERTEX_BUF]);
+  glBufferData(GL_ARRAY_BUFFER, vertexBufferSize, data.vertexData.empty() ? NULL : &data.vertexData[0], GL_STATIC_DRAW);
 }
 
+void Mesh::uploadVertices(const std::vector<int>& changedVertices) {
+  const std::vector<glm::vec2>& uvs = tangentFrames->getUVs();
+  const std::vector<glm::vec3>& tangents = tangentFrames->getTangents();
+  const std::vector<glm::vec3>& bitangents = tangentFrames->getBitangents();
+  size_t stride = compactVertices ? sizeof(CompactMeshVertex) : sizeof(MeshVertex);
 
-// Bind only vertices and index buffer.
-void Mesh::renderGLVertsOnly() {
-  glEnableVertexAttribArray(0);
+  // Repack runs of changed vertices, bridging short gaps to save calls.
   glBindBuffer(GL_ARRAY_BUFFER, buffers[VERTEX_BUF]);
+  std::vector<unsigned char> staging;
+  unsigned int i = 0;
+  while (i < changedVertices.size()) {
+    int begin = changedVertices[i];
+    int end = begin + 1;
+    for (i++; i < changedVertices.size() && changedVertices[i] <= end + MESH_UPLOAD_RANGE_GAP; i++) {
+      end = changedVertices[i] + 1;
+    }
 
-  glVertexAttribPointer(
-    0,  // The attribute we want to configure
-    3,                  // size
-    GL_FLOAT,           // type
-    GL_FALSE,           // normalized?
-    0,                  // stride
-    (void*)0            // array buffer offset
-  );
+    staging.resize((end - begin) * stride);
+    for (int v = begin; v < end; v++) {
+      MeshVertex vertex;
+      vertex.position = vertices[v];
+      vertex.uv = uvs[v];
+      vertex.normal = v < (int)normals.size() ? normals[v] : glm::vec3(0);
+      vertex.tangent = tangents[v];
+      vertex.bitangent = bitangents[v];
+      unsigned char* out = &staging[(v - begin) * stride];
+      if (compactVertices) {
+        packCompactVertex(vertex, positionOffset, positionScale, *(CompactMeshVertex*)out);
+      } else {
+        memcpy(out, &vertex, sizeof(MeshVertex));
+      }
+    }
+    glBufferSubData(GL_ARRAY_BUFFER, begin * stride, staging.size(), &staging[0]);
+  }
+}
 
-  // Index buffer
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers[ELEMENT_BUF]);
+void Mesh::setUVs(std::vector<glm::vec2>& uvs, ThreadPool* pool) {
+  if (uvs.size() < vertices.size()) {
+    // No tangents without a UV per vertex, so nothing to track either.
+    delete tangentFrames;
+    tangentFrames = NULL;
+    MeshData data;
+    data.vertices = vertices;
+    data.uvs = uvs;
+    data.normals = normals;
+    data.indices = indices;
+    data.compactVertices = compactVertices;
+    data.prepare(pool);
+    uploadVertices(data);
+    return;
+  }
+
+  // UVs are interleaved with everything else, and tangents depend on them.
+  // Tangent state is kept from the first call on, so later calls only redo
+  // the faces around UVs that changed.
+  std::vector<int> changedVertices;
+  if (tangentFrames == NULL) {
+    tangentFrames = new TangentFrames();
+    tangentFrames->compute(vertices, uvs, indices, pool);
+    changedVertices.resize(vertices.size());
+    for (unsigned int v = 0; v < vertices.size(); v++) {
+      changedVertices[v] = v;
+    }
+  } else {
+    tangentFrames->update(vertices, uvs, indices, changedVertices, pool);
+  }
+  uploadVertices(changedVertices);
+}
 
+
+// Bind only vertices and index buffer.
+void Mesh::renderGLVertsOnly() {
+  glBindVertexArray(vertsOnlyVertexArrayId);
   glDrawElements(
     GL_TRIANGLES,      // mode
     numIndices,        // count
-    GL_UNSIGNED_SHORT, // type
+    indexType,         // type
     (void*)0           // element array buffer offset
   );
-
-  glDisableVertexAttribArray(0);
+  glBindVertexArray(0);
 }
 
 void Mesh::renderGL() {
-  // 1st attribute buffer - vertices.
-  glEnableVertexAttribArray(0);
-  glBindBuffer(GL_ARRAY_BUFFER, buffers[VERTEX_BUF]);
-  glVertexAttribPointer(
-    0,                  // attribute
-    3,                  // size
-    GL_FLOAT,           // type
-    GL_FALSE,           // normalized?
-    0,                  // stride
-    (void*)0            // array buffer offset
-  );
-
-  // 2nd attribute buffer - UVs.
-  glEnableVertexAttribArray(1);
-  glBindBuffer(GL_ARRAY_BUFFER, buffers[UV_BUF]);
-  glVertexAttribPointer(
-    1,                                // attribute
-    2,                                // size
-    GL_FLOAT,                         // type
-    GL_FALSE,                         // normalized?
-    0,                                // stride
-    (void*)0                          // array buffer offset
-  );
-
-  // 3rd attribute buffer - normals.
-  glEnableVertexAttribArray(2);
-  glBindBuffer(GL_ARRAY_BUFFER, buffers[NORMAL_BUF]);
-  glVertexAttribPointer(
-    2,                                // attribute
-    3,                                // size
-    GL_FLOAT,                         // type
-    GL_FALSE,                         // normalized?
-    0,                                // stride
-    (void*)0                          // array buffer offset
-  );
-
-  // 4rd attribute buffer - tangents.
-  glEnableVertexAttribArray(3);
-  glBindBuffer(GL_ARRAY_BUFFER, buffers[TANGENT_BUF]);
-  glVertexAttribPointer(
-    3,                                // attribute
-    3,                                // size
-    GL_FLOAT,                         // type
-    GL_FALSE,                         // normalized?
-    0,                                // stride
-    (void*)0                          // array buffer offset
-  );
-
-  // 5th attribute buffer - bitangents.
-  glEnableVertexAttribArray(4);
-  glBindBuffer(GL_ARRAY_BUFFER, buffers[BITANGENT_BUF]);
-  glVertexAttribPointer(
-    4,                                // attribute
-    3,                                // size
-    GL_FLOAT,                         // type
-    GL_FALSE,                         // normalized?
-    0,                                // stride
-    (void*)0                          // array buffer offset
-  );
-
-  // Index buffer
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers[ELEMENT_BUF]);
-
+  glBindVertexArray(vertexArrayId);
   // Draw the triangles for render pass.
   glDrawElements(
     GL_TRIANGLES,      // mode
     numIndices,        // count
-    GL_UNSIGNED_SHORT, // type
+    indexType,         // type
     (void*)0           // element array buffer offset
   );
-
-  glDisableVertexAttribArray(0);
-  glDisableVertexAttribArray(1);
-  glDisableVertexAttribArray(2);
-  glDisableVertexAttribArray(3);
-  glDisableVertexAttribArray(4);
+  glBindVertexArray(0);
 }
 
 
-bool loadTexture(aiTextureType aiType, const aiMaterial* m, Material *material) {
+// Texture file for aiType, falling back to name_normal.png next to the diffuse texture for normal maps.
+static bool getTextureFileName(aiTextureType aiType, const aiMaterial* m, std::string& prefixedTexFileName) {
   aiString texFileName;
   aiReturn result = m->GetTexture(aiType, 0, &texFileName);
-  std::string prefixedTexFileName;
 
   if (result == AI_SUCCESS) {
     prefixedTexFileName = "models/" + std::string(texFileName.C_Str());
@@ -248,30 +351,92 @@ bool loadTexture(aiTextureType aiType, const aiMaterial* m, Material *material)
   } else {
     return false;
   }
+  return true;
+}
 
-  Texture* texture = Texture::loadOrGet(prefixedTexFileName, aiType == aiTextureType_DIFFUSE);
+// Copy one aiMesh into data, reordered according to flags. Safe to run on any thread.
+static void convertMesh(
+    const aiMesh* mesh,
+    bool invertNormals,
+    unsigned int flags,
+    ThreadPool* pool,
+    MeshData& data,
+    VertexCacheStats& statsBefore,
+    VertexCacheStats& statsAfter) {
+  std::vector<unsigned int>& indices = data.indices;
+  std::vector<glm::vec3>& vertices = data.vertices;
+  std::vector<glm::vec2>& uvs = data.uvs;
+  std::vector<glm::vec3>& normals = data.normals;
+
+  // Vertex positions.
+  vertices.reserve(mesh->mNumVertices);
+  for(unsigned int i=0; i<mesh->mNumVertices; i++){
+    aiVector3D pos = mesh->mVertices[i];
+    vertices.push_back(glm::vec3(pos.x, pos.y, pos.z));
+  }
 
-  if (aiType == aiTextureType_DIFFUSE) {
-    material->setDiffuseTexture(texture);
-  } else if (aiType == aiTextureType_HEIGHT) {
-    material->setNormalTexture(texture);
+  // Vertex texture coordinates.
+  if (mesh->HasTextureCoords(0)) {
+    uvs.reserve(mesh->mNumVertices);
+    for(unsigned int i=0; i<mesh->mNumVertices; i++){
+      aiVector3D UVW = mesh->mTextureCoords[0][i]; // Assume only 1 set of UV coords; AssImp supports 8 UV sets.
+      uvs.push_back(glm::vec2(UVW.x, UVW.y));
+    }
   }
 
-  return true;
-}
+  // Vertex normals.
+  if (mesh->HasNormals()) {
+    normals.reserve(mesh->mNumVertices);
+    for(unsigned int i=0; i<mesh->mNumVertices; i++){
+      aiVector3D n = mesh->mNormals[i];
+      if (invertNormals) {
+        normals.push_back(-glm::vec3(n.x, n.y, n.z));
+      } else {
+        normals.push_back(glm::vec3(n.x, n.y, n.z));
+      }
+    }
+  }
 
-std::vector<Mesh*> loadScene(std::string fileName, bool invertNormals) {
+  // Face indices.
+  indices.reserve(3*mesh->mNumFaces);
+  for (unsigned int i=0; i<mesh->mNumFaces; i++){
+    if (mesh->mFaces[i].mNumIndices != 3) {
+      std::cerr << "Warning! Face found with " << mesh->mFaces[i].mNumIndices << " indices!" << std::endl;
+    }
+    // Only supporting triangles here.
+    indices.push_back(mesh->mFaces[i].mIndices[0]);
+    indices.push_back(mesh->mFaces[i].mIndices[1]);
+    indices.push_back(mesh->mFaces[i].mIndices[2]);
+  }
 
-  std::vector<Mesh*> meshes;
-  Assimp::Importer importer;
-  const aiScene* scene = importer.ReadFile(fileName.c_str(), aiProcess_JoinIdenticalVertices | aiProcess_Triangulate);
-  if (!scene) {
-    std::cerr << importer.GetErrorString() << std::endl;
-    return meshes;
+  if (flags & (LOAD_OPTIMIZE_VERTEX_CACHE | LOAD_MORTON_ORDER)) {
+    int vertexSize = flags & LOAD_COMPACT_VERTICES ? sizeof(CompactMeshVertex) : sizeof(MeshVertex);
+    statsBefore = analyzeMesh(indices, vertices.size(), vertexSize);
+    if (flags & LOAD_MORTON_ORDER) {
+      sortTrianglesMorton(indices, vertices);
+    }
+    if (flags & LOAD_OPTIMIZE_VERTEX_CACHE) {
+      optimizeVertexCache(indices, vertices.size());
+    }
+    // Then lay vertices out in the order the triangles use them.
+    std::vector<unsigned int> remap = optimizeVertexFetch(indices, vertices.size());
+    remapVertices(vertices, remap);
+    remapVertices(uvs, remap);
+    remapVertices(normals, remap);
+    statsAfter = analyzeMesh(indices, vertices.size(), vertexSize);
   }
 
-  // Load materials.
-  Material* materials[scene->mNumMaterials];
+  data.compactVertices = flags & LOAD_COMPACT_VERTICES;
+  data.prepare(pool);
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Fill sceneData's materials from an imported scene. Textures are only named here.
+static void readMaterials(const aiScene* scene, SceneData& sceneData) {
+  sceneData.materials.resize(scene->mNumMaterials);
   for (unsigned int matId = 0; matId < scene->mNumMaterials; matId++) {
     const aiMaterial* m = scene->mMaterials[matId];
     aiColor3D ka(0, 0, 0);
@@ -292,78 +457,21 @@ std::vector<Mesh*> loadScene(std::string fileName, bool invertNormals) {
     std::string materialNameString(materialName.C_Str());
     //std::cerr << "Loading material " << materialNameString << std::endl;
 
-    materials[matId] = new Material(
-      glm::vec3(ka.r, ka.g, ka.b),
-      glm::vec3(kd.r, kd.g, kd.b),
-      glm::vec3(ks.r, ks.g, ks.b),
-      glm::vec3(ke.r, ke.g, ke.b),
-      shininess
-    );
+    MaterialData& material = sceneData.materials[matId];
+    material.ka = glm::vec3(ka.r, ka.g, ka.b);
+    material.kd = glm::vec3(kd.r, kd.g, kd.b);
+    material.ks = glm::vec3(ks.r, ks.g, ks.b);
+    material.ke = glm::vec3(ke.r, ke.g, ke.b);
+    material.shininess = shininess;
 
-    loadTexture(aiTextureType_DIFFUSE, m, materials[matId]);
-    loadTexture(aiTextureType_HEIGHT, m, materials[matId]); // Normal Map.
+    getTextureFileName(aiTextureType_DIFFUSE, m, material.diffuseFile);
+    getTextureFileName(aiTextureType_HEIGHT, m, material.normalFile); // Normal Map.
     // NOTE: Must use "bump" in .mtl file, or have name.png and name_normal.png in same directory.
   }
+}
 
-  // Load meshes.
-  for (unsigned int meshId = 0; meshId < scene->mNumMeshes; meshId++) {
-    std::vector<unsigned short> indices;
-    std::vector<glm::vec3> vertices;
-    std::vector<glm::vec2> uvs;
-    std::vector<glm::vec3> normals;
-
-    const aiMesh* mesh = scene->mMeshes[meshId];
-    Material* material = NULL;
-
-    unsigned int materialIndex = mesh->mMaterialIndex;
-    if (materialIndex < scene->mNumMaterials) {
-      material = materials[materialIndex];
-    }
-
-    // Vertex positions.
-    vertices.reserve(mesh->mNumVertices);
-    for(unsigned int i=0; i<mesh->mNumVertices; i++){
-      aiVector3D pos = mesh->mVertices[i];
-      vertices.push_back(glm::vec3(pos.x, pos.y, pos.z));
-    }
-
-    // Vertex texture coordinates.
-    if (mesh->HasTextureCoords(0)) {
-      uvs.reserve(mesh->mNumVertices);
-      for(unsigned int i=0; i<mesh->mNumVertices; i++){
-        aiVector3D UVW = mesh->mTextureCoords[0][i]; // Assume only 1 set of UV coords; AssImp supports 8 UV sets.
-        uvs.push_back(glm::vec2(UVW.x, UVW.y));
-      }
-    }
-
-    // Vertex normals.
-    if (mesh->HasNormals()) {
-      normals.reserve(mesh->mNumVertices);
-      for(unsigned int i=0; i<mesh->mNumVertices; i++){
-        aiVector3D n = mesh->mNormals[i];
-        if (invertNormals) {
-          normals.push_back(-glm::vec3(n.x, n.y, n.z));
-        } else {
-          normals.push_back(glm::vec3(n.x, n.y, n.z));
-        }
-      }
-    }
-
-    // Face indices.
-    indices.reserve(3*mesh->mNumFaces);
-    for (unsigned int i=0; i<mesh->mNumFaces; i++){
-      if (mesh->mFaces[i].mNumIndices != 3) {
-        std::cerr << "Warning! Face found with " << mesh->mFaces[i].mNumIndices << " indices!" << std::endl;
-      }
-      // Only supporting triangles here.
-      indices.push_back(mesh->mFaces[i].mIndices[0]);
-      indices.push_back(mesh->mFaces[i].mIndices[1]);
-      indices.push_back(mesh->mFaces[i].mIndices[2]);
-    }
-
-    meshes.push_back(new Mesh(vertices, uvs, normals, indices, material));
-  }
-
+// Name meshes after the nodes that reference them, and drop "hidden" ones.
+static void nameMeshes(const aiScene* scene, SceneData& sceneData) {
   // Name meshes by going down hierarchy.
   std::list<aiNode*> nodeQueue;
   nodeQueue.push_front(scene->mRootNode);
@@ -375,29 +483,171 @@ std::vector<Mesh*> loadScene(std::string fileName, bool invertNormals) {
     }
     for (unsigned int meshIndex = 0; meshIndex < node->mNumMeshes; meshIndex++) {
       unsigned int meshId = node->mMeshes[meshIndex];
-      meshes[meshId]->setName(std::string(node->mName.C_Str()));
+      sceneData.meshes[meshId].name = std::string(node->mName.C_Str());
     }
   }
 
-
   // Prune "hidden" meshes.
-  for (std::vector<Mesh*>::iterator it = meshes.begin(); it != meshes.end(); it++) {
-    Mesh* mesh = *it;
-    if (mesh->getName().substr(0, 6) == "Hidden") {
-      it = meshes.erase(it);
-      delete mesh;
+  unsigned int kept = 0;
+  for (unsigned int meshId = 0; meshId < sceneData.meshes.size(); meshId++) {
+    if (sceneData.meshes[meshId].name.substr(0, 6) == "Hidden") {
+      continue;
+    }
+    if (kept != meshId) {
+      std::swap(sceneData.meshes[kept], sceneData.meshes[meshId]);
+      sceneData.meshMaterials[kept] = sceneData.meshMaterials[meshId];
+    }
+    kept++;
+  }
+  sceneData.meshes.resize(kept);
+  sceneData.meshMaterials.resize(kept);
+}
+
+std::vector<Mesh*> loadScene(std::string fileName, bool invertNormals, unsigned int flags, ThreadPool* pool) {
+
+  std::vector<Mesh*> meshes;
+  SceneData sceneData;
+
+  // A current cache replaces parsing and mesh conversion entirely.
+  std::chrono::steady_clock::time_point stageStart = std::chrono::steady_clock::now();
+  bool cached = readSceneCache(fileName, invertNormals, flags, sceneData);
+  Assimp::Importer importer;
+  const aiScene* scene = NULL;
+  if (!cached) {
+    scene = importer.ReadFile(fileName.c_str(), aiProcess_JoinIdenticalVertices | aiProcess_Triangulate);
+    if (!scene) {
+      std::cerr << importer.GetErrorString() << std::endl;
+      return meshes;
+    }
+    readMaterials(scene, sceneData);
+    sceneData.meshes.resize(scene->mNumMeshes);
+    sceneData.meshMaterials.resize(scene->mNumMeshes);
+    for (unsigned int meshId = 0; meshId < scene->mNumMeshes; meshId++) {
+      unsigned int materialIndex = scene->mMeshes[meshId]->mMaterialIndex;
+      sceneData.meshMaterials[meshId] = materialIndex < scene->mNumMaterials ? (int)materialIndex : -1;
+    }
+  }
+  double parseTime = secondsSince(stageStart);
+
+  // Convert meshes on the pool.
+  stageStart = std::chrono::steady_clock::now();
+  unsigned int numConverted = cached ? 0 : sceneData.meshes.size();
+  std::vector<VertexCacheStats> meshStatsBefore(numConverted);
+  std::vector<VertexCacheStats> meshStatsAfter(numConverted);
+  std::vector<double> meshTimes(numConverted, 0);
+  {
+    TaskGroup tasks(pool);
+    for (unsigned int meshId = 0; meshId < numConverted; meshId++) {
+      tasks.run([&, meshId]() {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        MeshData& data = sceneData.meshes[meshId];
+        convertMesh(scene->mMeshes[meshId], invertNormals, flags, pool, data, meshStatsBefore[meshId], meshStatsAfter[meshId]);
+        data.buildBVH(pool);
+        meshTimes[meshId] = secondsSince(start);
+      });
+    }
+    tasks.wait();
+  }
+  double workTime = secondsSince(stageStart);
+
+  double cacheTime = 0;
+  if (!cached) {
+    nameMeshes(scene, sceneData);
+    stageStart = std::chrono::steady_clock::now();
+    writeSceneCache(fileName, invertNormals, flags, sceneData);
+    cacheTime = secondsSince(stageStart);
+  }
+
+  // Everything touching GL happens here, on the calling thread. Textures
+  // start out as placeholders and stream in through Texture::streamTextures().
+  stageStart = std::chrono::steady_clock::now();
+  std::vector<Material*> materials(sceneData.materials.size());
+  for (unsigned int matId = 0; matId < sceneData.materials.size(); matId++) {
+    const MaterialData& m = sceneData.materials[matId];
+    materials[matId] = new Material(m.ka, m.kd, m.ks, m.ke, m.shininess);
+    if (m.diffuseFile != "") {
+      materials[matId]->setDiffuseTexture(Texture::loadAsync(m.diffuseFile, true, Texture::USAGE_COLOUR));
+    }
+    if (m.normalFile != "") {
+      materials[matId]->setNormalTexture(Texture::loadAsync(m.normalFile, false, Texture::USAGE_NORMAL));
     }
   }
 
+  for (unsigned int meshId = 0; meshId < sceneData.meshes.size(); meshId++) {
+    int materialIndex = sceneData.meshMaterials[meshId];
+    sceneData.meshes[meshId].material = materialIndex >= 0 ? materials[materialIndex] : NULL;
+    meshes.push_back(new Mesh(sceneData.meshes[meshId]));
+    // Release the packed vertices now rather than after every mesh is uploaded.
+    sceneData.meshes[meshId] = MeshData();
+  }
+  // Materials no mesh uses would otherwise hold their textures forever.
+  std::vector<bool> materialUsed(materials.size(), false);
+  for (unsigned int meshId = 0; meshId < sceneData.meshMaterials.size(); meshId++) {
+    if (sceneData.meshMaterials[meshId] >= 0) {
+      materialUsed[sceneData.meshMaterials[meshId]] = true;
+    }
+  }
+  for (unsigned int matId = 0; matId < materials.size(); matId++) {
+    if (!materialUsed[matId]) {
+      delete materials[matId];
+    }
+  }
+  double uploadTime = secondsSince(stageStart);
+
   std::cout << "Loaded " << meshes.size() << " meshes." << std::endl;
+  size_t vertexMemory = 0;
+  size_t indexMemory = 0;
+  size_t fullVertexMemory = 0;
   for (unsigned int i = 0; i < meshes.size(); i++) {
     std::cout << meshes[i]->getName() << ": " << meshes[i]->getNumIndices() << " indices" << std::endl;
+    vertexMemory += meshes[i]->getVertexMemory();
+    indexMemory += meshes[i]->getIndexMemory();
+    fullVertexMemory += meshes[i]->getVertices().size() * sizeof(MeshVertex);
+  }
+  std::cout << "Mesh GPU memory: " << (vertexMemory + indexMemory) / 1024 << " KB";
+  if (flags & LOAD_COMPACT_VERTICES) {
+    std::cout << ", down from " << (fullVertexMemory + indexMemory) / 1024 << " KB with full-precision vertices";
+  }
+  std::cout << std::endl;
+  if (!cached && (flags & (LOAD_OPTIMIZE_VERTEX_CACHE | LOAD_MORTON_ORDER))) {
+    VertexCacheStats statsBefore, statsAfter;
+    for (unsigned int meshId = 0; meshId < meshStatsBefore.size(); meshId++) {
+      statsBefore.add(meshStatsBefore[meshId]);
+      statsAfter.add(meshStatsAfter[meshId]);
+    }
+    std::cout << "Vertex reordering: ACMR " << statsBefore.getACMR() << " -> " << statsAfter.getACMR()
+      << ", ATVR " << statsBefore.getATVR() << " -> " << statsAfter.getATVR()
+      << ", overfetch " << statsBefore.getOverfetch() << " -> " << statsAfter.getOverfetch() << std::endl;
   }
 
+  double meshTime = 0;
+  for (unsigned int meshId = 0; meshId < meshTimes.size(); meshId++) {
+    meshTime += meshTimes[meshId];
+  }
+  std::cout << "Import: " << (cached ? "cache read " : "parse ") << parseTime << " s, meshes " << meshTime
+    << " s of work in " << workTime << " s on " << (pool ? pool->getNumThreads() : 1) << " threads, ";
+  if (!cached) {
+    std::cout << "cache write " << cacheTime << " s, ";
+  }
+  std::cout << "upload " << uploadTime << " s" << std::endl;
+
   //std::cout << scene->mNumAnimations << " animations" << std::endl;
 
-  // TODO: Don't leak materials.
   return meshes;
 }
 
+void freeScene(std::vector<Mesh*>& meshes) {
+  std::set<Material*> materials;
+  for (unsigned int i = 0; i < meshes.size(); i++) {
+    if (meshes[i]->getMaterial() != NULL) {
+      materials.insert(meshes[i]->getMaterial());
+    }
+    delete meshes[i];
+  }
+  for (std::set<Material*>::iterator it = materials.begin(); it != materials.end(); it++) {
+    delete *it;
+  }
+  meshes.clear();
+}
+
 
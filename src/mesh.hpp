@@ -4,6 +4,7 @@
 #include <vector>
 #include <string>
 #include <iostream>
+#include <stdint.h>
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
@@ -13,27 +14,125 @@
 #include <assimp/scene.h>           // Output data structure
 #include <assimp/postprocess.h>     // Post processing flags
 
+#include "bvh.hpp"
 #include "material.hpp"
+#include "tangents.hpp"
+#include "threadpool.hpp"
+
+// Unchanged vertices between two changed ones that setUVs() re-uploads rather than split the upload.
+#define MESH_UPLOAD_RANGE_GAP 16
+
+/**
+ * One interleaved vertex, as stored in a Mesh's vertex buffer.
+ */
+struct MeshVertex {
+  glm::vec3 position;
+  glm::vec2 uv;
+  glm::vec3 normal;
+  glm::vec3 tangent;
+  glm::vec3 bitangent;
+};
+
+/**
+ * Compact alternative to MeshVertex, 20 bytes instead of 56. The VAO binds the
+ * encoded values, which a vertex shader drawing the mesh must decode:
+ *   position - xyz quantized to 16 bits across the mesh bounds; decode as
+ *              getPositionOffset() + attribute * getPositionScale().
+ *   w        - bitangent sign, 0 for -1 and 65535 for +1. Bound to BITANGENT_ATTRIB,
+ *              so bitangent = cross(normal, tangent) * (attribute * 2 - 1).
+ *   normal, tangent - octahedral encoded, snorm16.
+ *   uv       - half floats.
+ */
+struct CompactMeshVertex {
+  uint16_t position[3];
+  uint16_t bitangentSign;
+  int16_t normal[2];
+  int16_t tangent[2];
+  uint16_t uv[2];
+};
+
+/**
+ * Quantize position to 16 bits per axis within the box at offset spanning
+ * scale. Decodes as offset + q / 65535 * scale; flat axes quantize to 0.
+ */
+void quantizePosition(const glm::vec3& position, const glm::vec3& offset, const glm::vec3& scale, uint16_t out[3]);
+
+/**
+ * Octahedral encoding of a unit vector as two snorm16 values. Project onto
+ * the octahedron and fold the lower half over.
+ */
+void octEncode(const glm::vec3& v, int16_t out[2]);
+
+/**
+ * Everything needed to create a Mesh. Building it touches no GL state, so
+ * meshes can be converted on worker threads and only uploaded on the GL thread.
+ */
+struct MeshData {
+  MeshData(): material(NULL), compactVertices(false) {}
+
+  /**
+   * Compute tangents and pack vertexData from the geometry.
+   */
+  void prepare(ThreadPool* pool = NULL);
+
+  /**
+   * Build the object-space triangle BVH used by the ray tracer.
+   */
+  void buildBVH(ThreadPool* pool = NULL);
+
+  std::string name;
+  // uvs and normals may be empty.
+  std::vector<glm::vec3> vertices;
+  std::vector<glm::vec2> uvs;
+  std::vector<glm::vec3> normals;
+  std::vector<unsigned int> indices;
+  Material* material;
+  bool compactVertices;
+
+  // Set by prepare(): MeshVertex or CompactMeshVertex bytes, and the position dequantization.
+  std::vector<unsigned char> vertexData;
+  glm::vec3 positionOffset;
+  glm::vec3 positionScale;
+
+  // Set by buildBVH(), or left empty.
+  BVH bvh;
+};
+
+/**
+ * Options for loadScene().
+ */
+enum LoadFlags {
+  // Store vertices as CompactMeshVertex.
+  LOAD_COMPACT_VERTICES = 1 << 0,
+  // Reorder triangles for the post-transform vertex cache.
+  LOAD_OPTIMIZE_VERTEX_CACHE = 1 << 1,
+  // Sort triangles along a Morton curve, for spatial locality. Applied before LOAD_OPTIMIZE_VERTEX_CACHE.
+  LOAD_MORTON_ORDER = 1 << 2
+};
 
 class Mesh {
 public:
   enum BufferIndex {
     VERTEX_BUF = 0,
-    UV_BUF = 1,
-    NORMAL_BUF = 2,
-    TANGENT_BUF = 3,
-    BITANGENT_BUF = 3,
-    ELEMENT_BUF = 4,
-    NUM_BUFS = 5
+    ELEMENT_BUF = 1,
+    NUM_BUFS = 2
   };
 
-  Mesh(
-    std::vector<glm::vec3>& vertices,
-    std::vector<glm::vec2>& uvs,
-    std::vector<glm::vec3>& normals,
-    std::vector<unsigned short>& triangles,
-    Material* material
-  );
+  enum AttributeIndex {
+    POSITION_ATTRIB = 0,
+    UV_ATTRIB = 1,
+    NORMAL_ATTRIB = 2,
+    TANGENT_ATTRIB = 3,
+    BITANGENT_ATTRIB = 4
+  };
+
+  /**
+   * Upload data, which must have been prepared. Takes over its geometry and BVH.
+   * Indices are uploaded as 16-bit when every vertex fits, and as 32-bit
+   * otherwise. With compactVertices the vertex buffer holds CompactMeshVertex
+   * instead of MeshVertex.
+   */
+  Mesh(MeshData& data);
   ~Mesh();
 
   uint32_t getId() {
@@ -51,6 +150,9 @@ public:
   Material* getMaterial() {
     return material;
   }
+  /**
+   * Draw with this mesh's VAO. Both leave no VAO bound.
+   */
   void renderGLVertsOnly();
   void renderGL();
 
@@ -58,23 +160,98 @@ public:
     return numIndices;
   }
 
+  /**
+   * Dequantization for compact vertex positions. Identity otherwise.
+   */
+  const glm::vec3& getPositionOffset() {
+    return positionOffset;
+  }
+  const glm::vec3& getPositionScale() {
+    return positionScale;
+  }
+
+  /**
+   * Bytes of GPU memory used by the vertex and index buffers.
+   */
+  size_t getVertexMemory() {
+    return vertexBufferSize;
+  }
+  size_t getIndexMemory() {
+    return indexBufferSize;
+  }
+
   glm::mat4& getModelMatrix() {
     return modelMatrix;
   }
 
-  void setUVs(std::vector<glm::vec2>& uvs);
+  /**
+   * Replace the UVs and the tangents that depend on them. After the first
+   * call, only vertices near changed UVs are recomputed and uploaded.
+   */
+  void setUVs(std::vector<glm::vec2>& uvs, ThreadPool* pool = NULL);
+
+  // CPU copies of the geometry, kept for the ray tracer.
+  const std::vector<glm::vec3>& getVertices() {
+    return vertices;
+  }
+
+  const std::vector<glm::vec3>& getNormals() {
+    return normals;
+  }
+
+  const std::vector<unsigned int>& getIndices() {
+    return indices;
+  }
+
+  /**
+   * Object-space BVH over getIndices() triangles, if one was built on import.
+   */
+  const BVH& getBVH() {
+    return bvh;
+  }
 
 private:
   static uint32_t meshIdCounter;
 
+  void uploadVertices(const MeshData& data);
+  // Repack and upload only these vertices, sorted, from tangentFrames.
+  void uploadVertices(const std::vector<int>& changedVertices);
+
   uint32_t meshId;
   std::string name;
   GLuint buffers[NUM_BUFS];
+  // Full set of attributes, and positions only.
+  GLuint vertexArrayId;
+  GLuint vertsOnlyVertexArrayId;
   int numIndices;
+  GLenum indexType;
+  bool compactVertices;
+  glm::vec3 positionOffset;
+  glm::vec3 positionScale;
+  // Kept from the first setUVs() on.
+  TangentFrames* tangentFrames;
+  size_t vertexBufferSize;
+  size_t indexBufferSize;
   Material* material;
   glm::mat4 modelMatrix;
+
+  std::vector<glm::vec3> vertices;
+  std::vector<glm::vec3> normals;
+  std::vector<unsigned int> indices;
+  BVH bvh;
 };
 
-std::vector<Mesh*> loadScene(std::string fileName, bool invertNormals = false);
+/**
+ * Import every mesh in fileName. flags is a combination of LoadFlags.
+ * Meshes are converted on pool when given, and GL uploads stay on the calling
+ * thread. Textures stream in afterwards through Texture::loadAsync().
+ */
+std::vector<Mesh*> loadScene(std::string fileName, bool invertNormals = false, unsigned int flags = 0, ThreadPool* pool = NULL);
+
+/**
+ * Delete meshes from loadScene() along with the materials they share, which
+ * releases their textures.
+ */
+void freeScene(std::vector<Mesh*>& meshes);
 
 #endif
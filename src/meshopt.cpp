@@ -0,0 +1,255 @@
+#include <algorithm>
+#include <cmath>
+
+#include "meshopt.hpp"
+
+// Forsyth's scoring parameters.
+#define FORSYTH_CACHE_SIZE 32
+#define FORSYTH_CACHE_DECAY_POWER 1.5f
+#define FORSYTH_LAST_TRIANGLE_SCORE 0.75f
+#define FORSYTH_VALENCE_BOOST_SCALE 2.0f
+#define FORSYTH_VALENCE_BOOST_POWER 0.5f
+
+void VertexCacheStats::add(const VertexCacheStats& other) {
+  triangles += other.triangles;
+  vertices += other.vertices;
+  transforms += other.transforms;
+  bytesFetched += other.bytesFetched;
+  vertexBufferSize += other.vertexBufferSize;
+}
+
+float VertexCacheStats::getACMR() const {
+  return triangles > 0 ? (float)transforms / triangles : 0;
+}
+
+float VertexCacheStats::getATVR() const {
+  return vertices > 0 ? (float)transforms / vertices : 0;
+}
+
+float VertexCacheStats::getOverfetch() const {
+  return vertexBufferSize > 0 ? (float)bytesFetched / vertexBufferSize : 0;
+}
+
+VertexCacheStats analyzeMesh(const std::vector<unsigned int>& indices, int numVertices, int vertexSize) {
+  VertexCacheStats stats;
+  stats.triangles = indices.size() / 3;
+  stats.vertexBufferSize = (long)numVertices * vertexSize;
+
+  // Vertices referenced at least once, for ATVR.
+  std::vector<char> used(numVertices, 0);
+  for (unsigned int i = 0; i < indices.size(); i++) {
+    if (!used[indices[i]]) {
+      used[indices[i]] = 1;
+      stats.vertices++;
+    }
+  }
+
+  // FIFO post-transform cache: a vertex is a hit if it was inserted within the last N misses.
+  std::vector<long> insertedAt(numVertices, -MESHOPT_STATS_CACHE_SIZE - 1);
+  // Each transformed vertex is fetched through a small direct-mapped cache of lines.
+  const int lineCacheSize = 256;
+  std::vector<long> lineCache(lineCacheSize, -1);
+  for (unsigned int i = 0; i < indices.size(); i++) {
+    unsigned int v = indices[i];
+    if (stats.transforms - insertedAt[v] <= MESHOPT_STATS_CACHE_SIZE) {
+      continue;
+    }
+    insertedAt[v] = stats.transforms;
+    stats.transforms++;
+
+    long firstLine = (long)v * vertexSize / MESHOPT_CACHE_LINE_SIZE;
+    long lastLine = ((long)v * vertexSize + vertexSize - 1) / MESHOPT_CACHE_LINE_SIZE;
+    for (long line = firstLine; line <= lastLine; line++) {
+      long& slot = lineCache[line % lineCacheSize];
+      if (slot != line) {
+        slot = line;
+        stats.bytesFetched += MESHOPT_CACHE_LINE_SIZE;
+      }
+    }
+  }
+  return stats;
+}
+
+static float forsythVertexScore(int cachePosition, int remainingTriangles) {
+  if (remainingTriangles == 0) {
+    return -1;
+  }
+  float score = 0;
+  if (cachePosition >= 0) {
+    if (cachePosition < 3) {
+      // Vertices of the last triangle get a fixed score, so it isn't simply repeated.
+      score = FORSYTH_LAST_TRIANGLE_SCORE;
+    } else {
+      float scale = 1.0f / (FORSYTH_CACHE_SIZE - 3);
+      score = powf(1.0f - (cachePosition - 3) * scale, FORSYTH_CACHE_DECAY_POWER);
+    }
+  }
+  // Favour vertices with few triangles left, so they are finished and leave the cache.
+  return score + FORSYTH_VALENCE_BOOST_SCALE * powf((float)remainingTriangles, -FORSYTH_VALENCE_BOOST_POWER);
+}
+
+void optimizeVertexCache(std::vector<unsigned int>& indices, int numVertices) {
+  int numTriangles = indices.size() / 3;
+  if (numTriangles == 0) {
+    return;
+  }
+
+  // Triangles using each vertex, as offsets into vertexTriangles.
+  std::vector<int> triangleStart(numVertices + 1, 0);
+  for (unsigned int i = 0; i < 3u*numTriangles; i++) {
+    triangleStart[indices[i] + 1]++;
+  }
+  for (int v = 0; v < numVertices; v++) {
+    triangleStart[v + 1] += triangleStart[v];
+  }
+  std::vector<int> vertexTriangles(3*numTriangles);
+  std::vector<int> remaining(numVertices, 0);
+  for (int t = 0; t < numTriangles; t++) {
+    for (int c = 0; c < 3; c++) {
+      unsigned int v = indices[3*t + c];
+      vertexTriangles[triangleStart[v] + remaining[v]++] = t;
+    }
+  }
+
+  std::vector<float> vertexScore(numVertices);
+  for (int v = 0; v < numVertices; v++) {
+    vertexScore[v] = forsythVertexScore(-1, remaining[v]);
+  }
+  std::vector<char> emitted(numTriangles, 0);
+
+  std::vector<unsigned int> result;
+  result.reserve(indices.size());
+  std::vector<int> cache;
+  std::vector<int> newCache;
+  int bestTriangle = -1;
+  int scanCursor = 0;
+
+  for (int emittedCount = 0; emittedCount < numTriangles; emittedCount++) {
+    if (bestTriangle < 0) {
+      // Nothing useful in the cache; take the next triangle in input order.
+      while (emitted[scanCursor]) {
+        scanCursor++;
+      }
+      bestTriangle = scanCursor;
+    }
+
+    int t = bestTriangle;
+    emitted[t] = 1;
+    for (int c = 0; c < 3; c++) {
+      unsigned int v = indices[3*t + c];
+      result.push_back(v);
+
+      // Drop t from v's remaining triangles.
+      int* begin = &vertexTriangles[triangleStart[v]];
+      int* end = begin + remaining[v];
+      *std::find(begin, end, t) = *(end - 1);
+      remaining[v]--;
+    }
+
+    // Move the triangle's vertices to the front of the cache.
+    newCache.clear();
+    for (int c = 0; c < 3; c++) {
+      newCache.push_back(indices[3*t + c]);
+    }
+    for (unsigned int i = 0; i < cache.size(); i++) {
+      int v = cache[i];
+      if (v != (int)indices[3*t] && v != (int)indices[3*t+1] && v != (int)indices[3*t+2]) {
+        newCache.push_back(v);
+      }
+    }
+    for (unsigned int i = FORSYTH_CACHE_SIZE; i < newCache.size(); i++) {
+      vertexScore[newCache[i]] = forsythVertexScore(-1, remaining[newCache[i]]);
+    }
+    if (newCache.size() > FORSYTH_CACHE_SIZE) {
+      newCache.resize(FORSYTH_CACHE_SIZE);
+    }
+    cache.swap(newCache);
+
+    // Rescore cached vertices and their triangles, and pick the best of those.
+    for (unsigned int i = 0; i < cache.size(); i++) {
+      vertexScore[cache[i]] = forsythVertexScore(i, remaining[cache[i]]);
+    }
+    bestTriangle = -1;
+    float bestScore = -1;
+    for (unsigned int i = 0; i < cache.size(); i++) {
+      int v = cache[i];
+      for (int k = 0; k < remaining[v]; k++) {
+        int candidate = vertexTriangles[triangleStart[v] + k];
+        float score = vertexScore[indices[3*candidate]] + vertexScore[indices[3*candidate+1]] + vertexScore[indices[3*candidate+2]];
+        if (score > bestScore) {
+          bestScore = score;
+          bestTriangle = candidate;
+        }
+      }
+    }
+  }
+
+  indices.swap(result);
+}
+
+// Spread the low 10 bits of v so there are two zero bits between each.
+static unsigned int expandBits(unsigned int v) {
+  v = (v * 0x00010001u) & 0xFF0000FFu;
+  v = (v * 0x00000101u) & 0x0F00F00Fu;
+  v = (v * 0x00000011u) & 0xC30C30C3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
+}
+
+void sortTrianglesMorton(std::vector<unsigned int>& indices, const std::vector<glm::vec3>& vertices) {
+  int numTriangles = indices.size() / 3;
+  if (numTriangles == 0) {
+    return;
+  }
+
+  glm::vec3 boundsMin = vertices[indices[0]];
+  glm::vec3 boundsMax = boundsMin;
+  for (unsigned int i = 0; i < indices.size(); i++) {
+    boundsMin = glm::min(boundsMin, vertices[indices[i]]);
+    boundsMax = glm::max(boundsMax, vertices[indices[i]]);
+  }
+  glm::vec3 extent = boundsMax - boundsMin;
+  glm::vec3 scale(
+    extent.x > 0 ? 1023 / extent.x : 0,
+    extent.y > 0 ? 1023 / extent.y : 0,
+    extent.z > 0 ? 1023 / extent.z : 0
+  );
+
+  std::vector<std::pair<unsigned int, int> > codes(numTriangles);
+  for (int t = 0; t < numTriangles; t++) {
+    glm::vec3 centroid = (vertices[indices[3*t]] + vertices[indices[3*t+1]] + vertices[indices[3*t+2]]) * (1.0f / 3);
+    glm::vec3 q = (centroid - boundsMin) * scale;
+    codes[t] = std::make_pair(
+      (expandBits((unsigned int)q.x) << 2) | (expandBits((unsigned int)q.y) << 1) | expandBits((unsigned int)q.z),
+      t
+    );
+  }
+  std::sort(codes.begin(), codes.end());
+
+  std::vector<unsigned int> sorted(indices.size());
+  for (int t = 0; t < numTriangles; t++) {
+    for (int c = 0; c < 3; c++) {
+      sorted[3*t + c] = indices[3*codes[t].second + c];
+    }
+  }
+  indices.swap(sorted);
+}
+
+std::vector<unsigned int> optimizeVertexFetch(std::vector<unsigned int>& indices, int numVertices) {
+  const unsigned int unassigned = ~0u;
+  std::vector<unsigned int> remap(numVertices, unassigned);
+  unsigned int next = 0;
+  for (unsigned int i = 0; i < indices.size(); i++) {
+    if (remap[indices[i]] == unassigned) {
+      remap[indices[i]] = next++;
+    }
+    indices[i] = remap[indices[i]];
+  }
+  // Unreferenced vertices go last.
+  for (int v = 0; v < numVertices; v++) {
+    if (remap[v] == unassigned) {
+      remap[v] = next++;
+    }
+  }
+  return remap;
+}
@@ -0,0 +1,66 @@
+#ifndef MESHOPT_H
+#define MESHOPT_H
+
+#include <vector>
+#include <glm/glm.hpp>
+
+// FIFO size used when measuring post-transform vertex cache efficiency.
+#define MESHOPT_STATS_CACHE_SIZE 16
+// Cache line size used when measuring vertex fetch efficiency.
+#define MESHOPT_CACHE_LINE_SIZE 64
+
+struct VertexCacheStats {
+  VertexCacheStats(): triangles(0), vertices(0), transforms(0), bytesFetched(0), vertexBufferSize(0) {}
+
+  void add(const VertexCacheStats& other);
+
+  // Average cache miss ratio: vertex shader invocations per triangle. 0.5 is ideal.
+  float getACMR() const;
+  // Average transform to vertex ratio: invocations per vertex. 1.0 is ideal.
+  float getATVR() const;
+  // Bytes read from the vertex buffer through whole cache lines, relative to its size. 1.0 is ideal.
+  float getOverfetch() const;
+
+  long triangles;
+  long vertices;
+  long transforms;
+  long bytesFetched;
+  long vertexBufferSize;
+};
+
+/**
+ * Simulate a FIFO post-transform cache and a cache-line vertex fetch over indices.
+ */
+VertexCacheStats analyzeMesh(const std::vector<unsigned int>& indices, int numVertices, int vertexSize);
+
+/**
+ * Reorder triangles for post-transform cache hits, using Forsyth's greedy
+ * scoring ("Linear-Speed Vertex Cache Optimisation").
+ */
+void optimizeVertexCache(std::vector<unsigned int>& indices, int numVertices);
+
+/**
+ * Sort triangles along a Morton curve through their centroids, so that
+ * triangles close in space are close in memory.
+ */
+void sortTrianglesMorton(std::vector<unsigned int>& indices, const std::vector<glm::vec3>& vertices);
+
+/**
+ * Renumber vertices in the order indices first use them, rewriting indices.
+ * Returns the new index of each old vertex; apply it to every attribute with remapVertices().
+ */
+std::vector<unsigned int> optimizeVertexFetch(std::vector<unsigned int>& indices, int numVertices);
+
+template <typename T>
+void remapVertices(std::vector<T>& attribute, const std::vector<unsigned int>& remap) {
+  if (attribute.size() < remap.size()) {
+    return;
+  }
+  std::vector<T> remapped(attribute.size());
+  for (unsigned int i = 0; i < remap.size(); i++) {
+    remapped[remap[i]] = attribute[i];
+  }
+  attribute.swap(remapped);
+}
+
+#endif
@@ -0,0 +1,155 @@
+#include <algorithm>
+#include <cstring>
+
+#include "scenebuffer.hpp"
+#include "texture.hpp"
+
+// Smallest allocation, since immutable storage can't be empty.
+#define SCENE_BUFFER_MIN_CAPACITY 256
+
+SceneBuffer::SceneBuffer(GLenum internalFormat): internalFormat(internalFormat), current(0), capacity(0) {
+  persistent = GLEW_ARB_buffer_storage;
+  numSlots = persistent ? SCENE_BUFFER_SLOTS : 1;
+  allocate(SCENE_BUFFER_MIN_CAPACITY);
+}
+
+SceneBuffer::~SceneBuffer() {
+  release();
+}
+
+void SceneBuffer::allocate(GLsizeiptr newCapacity) {
+  capacity = newCapacity;
+  GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  for (int i = 0; i < numSlots; i++) {
+    Slot& slot = slots[i];
+    glGenBuffers(1, &slot.bufferId);
+    glBindBuffer(GL_TEXTURE_BUFFER, slot.bufferId);
+    if (persistent) {
+      glBufferStorage(GL_TEXTURE_BUFFER, capacity, NULL, flags);
+      slot.mapped = glMapBufferRange(GL_TEXTURE_BUFFER, 0, capacity, flags);
+    } else {
+      glBufferData(GL_TEXTURE_BUFFER, capacity, NULL, GL_DYNAMIC_DRAW);
+      slot.mapped = NULL;
+    }
+    slot.fence = 0;
+
+    glGenTextures(1, &slot.texId);
+    glBindTexture(GL_TEXTURE_BUFFER, slot.texId);
+    glTexBuffer(GL_TEXTURE_BUFFER, internalFormat, slot.bufferId);
+
+    slot.dirtyRanges.clear();
+    if (!data.empty()) {
+      slot.dirtyRanges.push_back(DirtyRange(0, data.size()));
+    }
+  }
+  current = 0;
+}
+
+void SceneBuffer::release() {
+  for (int i = 0; i < numSlots; i++) {
+    Slot& slot = slots[i];
+    if (slot.fence != 0) {
+      glDeleteSync(slot.fence);
+    }
+    // Deleting a mapped buffer unmaps it, and GL keeps it alive until pending draws finish.
+    glDeleteBuffers(1, &slot.bufferId);
+    glDeleteTextures(1, &slot.texId);
+  }
+}
+
+void SceneBuffer::setData(const void* newData, GLsizeiptr size) {
+  data.assign((const unsigned char*)newData, (const unsigned char*)newData + size);
+  if (size > capacity) {
+    TextureBuffer::checkSize(internalFormat, size);
+    release();
+    allocate(std::max(size, 2*capacity));
+  } else if (size > 0) {
+    markDirty(0, size);
+  }
+}
+
+void SceneBuffer::update(GLintptr offset, GLsizeiptr size, const void* newData) {
+  if (size <= 0) {
+    return;
+  }
+  memcpy(&data[offset], newData, size);
+  markDirty(offset, offset + size);
+}
+
+void SceneBuffer::markDirty(GLintptr begin, GLintptr end) {
+  for (int i = 0; i < numSlots; i++) {
+    std::vector<DirtyRange>& ranges = slots[i].dirtyRanges;
+    if (!ranges.empty() && begin <= ranges.back().end && end >= ranges.back().begin) {
+      ranges.back().begin = std::min(ranges.back().begin, begin);
+      ranges.back().end = std::max(ranges.back().end, end);
+    } else {
+      ranges.push_back(DirtyRange(begin, end));
+    }
+  }
+}
+
+bool SceneBuffer::isSlotFree(int slot) {
+  if (slots[slot].fence == 0) {
+    return true;
+  }
+  GLenum status = glClientWaitSync(slots[slot].fence, 0, 0);
+  if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+    return false;
+  }
+  glDeleteSync(slots[slot].fence);
+  slots[slot].fence = 0;
+  return true;
+}
+
+void SceneBuffer::writeSlot(int slotIdx) {
+  Slot& slot = slots[slotIdx];
+  std::sort(slot.dirtyRanges.begin(), slot.dirtyRanges.end(), [](const DirtyRange& a, const DirtyRange& b) {
+    return a.begin < b.begin;
+  });
+
+  glBindBuffer(GL_TEXTURE_BUFFER, slot.bufferId);
+  unsigned int i = 0;
+  while (i < slot.dirtyRanges.size()) {
+    GLintptr begin = slot.dirtyRanges[i].begin;
+    GLintptr end = slot.dirtyRanges[i].end;
+    for (i++; i < slot.dirtyRanges.size() && slot.dirtyRanges[i].begin <= end; i++) {
+      end = std::max(end, slot.dirtyRanges[i].end);
+    }
+    // Data may have shrunk since the range was recorded.
+    end = std::min(end, (GLintptr)data.size());
+    if (begin >= end) {
+      continue;
+    }
+    if (persistent) {
+      memcpy((unsigned char*)slot.mapped + begin, &data[begin], end - begin);
+    } else {
+      glBufferSubData(GL_TEXTURE_BUFFER, begin, end - begin, &data[begin]);
+    }
+  }
+  slot.dirtyRanges.clear();
+}
+
+void SceneBuffer::flush() {
+  if (slots[current].dirtyRanges.empty()) {
+    return;
+  }
+  // Take the next slot the GPU has finished with, never waiting on one.
+  for (int i = 1; i <= numSlots; i++) {
+    int slot = (current + i) % numSlots;
+    if (isSlotFree(slot)) {
+      writeSlot(slot);
+      current = slot;
+      return;
+    }
+  }
+}
+
+void SceneBuffer::fence() {
+  if (!persistent) {
+    return;
+  }
+  if (slots[current].fence != 0) {
+    glDeleteSync(slots[current].fence);
+  }
+  slots[current].fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
@@ -0,0 +1,87 @@
+#ifndef SCENE_BUFFER_H
+#define SCENE_BUFFER_H
+
+#include <GL/glew.h>
+#include <vector>
+
+// Number of copies in the ring, so the CPU can write one while the GPU reads the others.
+#define SCENE_BUFFER_SLOTS 3
+
+/**
+ * Texture buffer for scene data that changes a little every frame.
+ *
+ * Writes go to a CPU copy and are tracked as dirty byte ranges. flush() copies
+ * only those ranges into a ring of SCENE_BUFFER_SLOTS persistently mapped
+ * buffers, taking a slot whose fence has already signaled, and fence() marks
+ * the slot as in use by the frame just submitted. If every slot is still in
+ * use, flush() keeps the previous slot for another frame rather than wait.
+ *
+ * Without ARB_buffer_storage there is a single buffer, updated with
+ * glBufferSubData.
+ */
+class SceneBuffer {
+public:
+  SceneBuffer(GLenum internalFormat);
+  ~SceneBuffer();
+
+  /**
+   * Replace the contents, growing the buffers if needed.
+   */
+  void setData(const void* data, GLsizeiptr size);
+
+  /**
+   * Overwrite part of the contents. The range must lie within them.
+   */
+  void update(GLintptr offset, GLsizeiptr size, const void* data);
+
+  /**
+   * Upload pending changes. Call once per frame, before drawing.
+   */
+  void flush();
+
+  /**
+   * Fence the slot used by the current frame. Call once per frame, after drawing.
+   */
+  void fence();
+
+  GLuint getTextureId() {
+    return slots[current].texId;
+  }
+
+  GLsizeiptr getSize() {
+    return data.size();
+  }
+
+private:
+  struct DirtyRange {
+    DirtyRange(GLintptr begin, GLintptr end): begin(begin), end(end) {}
+
+    GLintptr begin;
+    GLintptr end;
+  };
+
+  struct Slot {
+    GLuint bufferId;
+    GLuint texId;
+    void* mapped;
+    GLsync fence;
+    // Changes this slot has not seen yet.
+    std::vector<DirtyRange> dirtyRanges;
+  };
+
+  void allocate(GLsizeiptr capacity);
+  void release();
+  void markDirty(GLintptr begin, GLintptr end);
+  bool isSlotFree(int slot);
+  void writeSlot(int slot);
+
+  GLenum internalFormat;
+  bool persistent;
+  int numSlots;
+  int current;
+  GLsizeiptr capacity;
+  std::vector<unsigned char> data;
+  Slot slots[SCENE_BUFFER_SLOTS];
+};
+
+#endif
@@ -0,0 +1,301 @@
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "scenecache.hpp"
+#include "texturecompress.hpp"
+
+// Arrays start on this alignment, relative to the start of the file.
+#define SCENE_CACHE_ALIGNMENT 8
+
+static const char sceneCacheMagic[4] = {'R', 'T', '2', 'C'};
+
+struct SceneCacheHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t flags;
+  uint32_t invertNormals;
+  int64_t sourceModified;
+  int64_t sourceSize;
+  uint32_t numMaterials;
+  uint32_t numMeshes;
+};
+
+struct MaterialRecord {
+  float ka[3];
+  float kd[3];
+  float ks[3];
+  float ke[3];
+  float shininess;
+};
+
+struct MeshRecord {
+  int32_t materialIndex;
+  uint32_t compactVertices;
+  float positionOffset[3];
+  float positionScale[3];
+};
+
+/**
+ * Bounds-checked cursor over a mapped cache. Every read fails once one has.
+ */
+class SceneCacheReader {
+public:
+  SceneCacheReader(const unsigned char* data, size_t size): data(data), size(size), offset(0), ok(true) {}
+
+  template <typename T>
+  bool read(T& value) {
+    return readBytes(&value, sizeof(T));
+  }
+
+  template <typename T>
+  bool readArray(std::vector<T>& values) {
+    uint64_t count = 0;
+    if (!read(count) || !align() || count > (size - offset) / sizeof(T)) {
+      return ok = false;
+    }
+    values.resize(count);
+    return readBytes(values.empty() ? NULL : &values[0], count * sizeof(T)) && align();
+  }
+
+  bool readString(std::string& value) {
+    std::vector<char> chars;
+    if (!readArray(chars)) {
+      return false;
+    }
+    value.assign(chars.begin(), chars.end());
+    return true;
+  }
+
+private:
+  bool readBytes(void* out, size_t count) {
+    if (!ok || count > size - offset) {
+      return ok = false;
+    }
+    if (count > 0) {
+      memcpy(out, data + offset, count);
+    }
+    offset += count;
+    return true;
+  }
+
+  bool align() {
+    size_t aligned = (offset + SCENE_CACHE_ALIGNMENT - 1) / SCENE_CACHE_ALIGNMENT * SCENE_CACHE_ALIGNMENT;
+    if (!ok || aligned > size) {
+      return ok = false;
+    }
+    offset = aligned;
+    return true;
+  }
+
+  const unsigned char* data;
+  size_t size;
+  size_t offset;
+  bool ok;
+};
+
+class SceneCacheWriter {
+public:
+  SceneCacheWriter(std::ofstream& out): out(out), offset(0) {}
+
+  template <typename T>
+  void write(const T& value) {
+    writeBytes(&value, sizeof(T));
+  }
+
+  template <typename T>
+  void writeArray(const std::vector<T>& values) {
+    write((uint64_t)values.size());
+    align();
+    writeBytes(values.empty() ? NULL : &values[0], values.size() * sizeof(T));
+    align();
+  }
+
+  void writeString(const std::string& value) {
+    writeArray(std::vector<char>(value.begin(), value.end()));
+  }
+
+private:
+  void writeBytes(const void* data, size_t count) {
+    if (count > 0) {
+      out.write((const char*)data, count);
+    }
+    offset += count;
+  }
+
+  void align() {
+    static const char padding[SCENE_CACHE_ALIGNMENT] = {0};
+    size_t aligned = (offset + SCENE_CACHE_ALIGNMENT - 1) / SCENE_CACHE_ALIGNMENT * SCENE_CACHE_ALIGNMENT;
+    writeBytes(padding, aligned - offset);
+  }
+
+  std::ofstream& out;
+  size_t offset;
+};
+
+static bool readMesh(SceneCacheReader& reader, int numMaterials, MeshData& mesh, int& materialIndex) {
+  MeshRecord record;
+  std::vector<BVHNode> bvhNodes;
+  std::vector<int32_t> bvhPrimitives;
+  if (!reader.readString(mesh.name) || !reader.read(record) ||
+      !reader.readArray(mesh.vertices) || !reader.readArray(mesh.normals) || !reader.readArray(mesh.indices) ||
+      !reader.readArray(mesh.vertexData) || !reader.readArray(bvhNodes) || !reader.readArray(bvhPrimitives)) {
+    return false;
+  }
+
+  materialIndex = record.materialIndex;
+  mesh.compactVertices = record.compactVertices != 0;
+  mesh.positionOffset = glm::vec3(record.positionOffset[0], record.positionOffset[1], record.positionOffset[2]);
+  mesh.positionScale = glm::vec3(record.positionScale[0], record.positionScale[1], record.positionScale[2]);
+
+  // Anything GL or the ray tracer would read out of bounds means the cache is damaged.
+  size_t vertexSize = mesh.compactVertices ? sizeof(CompactMeshVertex) : sizeof(MeshVertex);
+  if (materialIndex < -1 || materialIndex >= numMaterials ||
+      mesh.vertexData.size() != mesh.vertices.size() * vertexSize ||
+      (!mesh.normals.empty() && mesh.normals.size() != mesh.vertices.size()) ||
+      mesh.indices.size() % 3 != 0 || bvhPrimitives.size() != mesh.indices.size() / 3) {
+    return false;
+  }
+  for (unsigned int i = 0; i < mesh.indices.size(); i++) {
+    if (mesh.indices[i] >= mesh.vertices.size()) {
+      return false;
+    }
+  }
+  return mesh.bvh.load(bvhNodes, std::vector<int>(bvhPrimitives.begin(), bvhPrimitives.end()));
+}
+
+bool readSceneCache(std::string sourceFile, bool invertNormals, unsigned int flags, SceneData& scene) {
+  int64_t sourceModified, sourceSize;
+  if (!getSourceStamp(sourceFile, sourceModified, sourceSize)) {
+    return false;
+  }
+
+  std::string cacheFile = sourceFile + SCENE_CACHE_EXTENSION;
+  int fd = open(cacheFile.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(SceneCacheHeader)) {
+    close(fd);
+    return false;
+  }
+  size_t size = info.st_size;
+  void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    std::cerr << "Could not map " << cacheFile << std::endl;
+    return false;
+  }
+
+  SceneCacheReader reader((const unsigned char*)mapped, size);
+  SceneCacheHeader header;
+  reader.read(header);
+  bool valid = memcmp(header.magic, sceneCacheMagic, sizeof(sceneCacheMagic)) == 0 &&
+    header.version == SCENE_CACHE_VERSION &&
+    header.flags == flags &&
+    header.invertNormals == (invertNormals ? 1u : 0u) &&
+    header.sourceModified == sourceModified &&
+    header.sourceSize == sourceSize;
+
+  if (valid) {
+    scene.materials.resize(header.numMaterials);
+    for (unsigned int i = 0; valid && i < header.numMaterials; i++) {
+      MaterialData& material = scene.materials[i];
+      MaterialRecord record;
+      valid = reader.read(record) && reader.readString(material.diffuseFile) && reader.readString(material.normalFile);
+      material.ka = glm::vec3(record.ka[0], record.ka[1], record.ka[2]);
+      material.kd = glm::vec3(record.kd[0], record.kd[1], record.kd[2]);
+      material.ks = glm::vec3(record.ks[0], record.ks[1], record.ks[2]);
+      material.ke = glm::vec3(record.ke[0], record.ke[1], record.ke[2]);
+      material.shininess = record.shininess;
+    }
+  }
+  if (valid) {
+    scene.meshes.resize(header.numMeshes);
+    scene.meshMaterials.resize(header.numMeshes);
+    for (unsigned int i = 0; valid && i < header.numMeshes; i++) {
+      valid = readMesh(reader, header.numMaterials, scene.meshes[i], scene.meshMaterials[i]);
+    }
+  }
+
+  munmap(mapped, size);
+  if (!valid) {
+    std::cerr << "Ignoring stale or damaged scene cache " << cacheFile << std::endl;
+    scene = SceneData();
+  }
+  return valid;
+}
+
+bool writeSceneCache(std::string sourceFile, bool invertNormals, unsigned int flags, const SceneData& scene) {
+  SceneCacheHeader header;
+  memcpy(header.magic, sceneCacheMagic, sizeof(sceneCacheMagic));
+  header.version = SCENE_CACHE_VERSION;
+  header.flags = flags;
+  header.invertNormals = invertNormals ? 1 : 0;
+  if (!getSourceStamp(sourceFile, header.sourceModified, header.sourceSize)) {
+    return false;
+  }
+  header.numMaterials = scene.materials.size();
+  header.numMeshes = scene.meshes.size();
+
+  // Write beside the cache and rename over it, so a concurrent launch never maps a partial file.
+  std::string cacheFile = sourceFile + SCENE_CACHE_EXTENSION;
+  std::string tempFile = cacheFile + ".tmp";
+  std::ofstream out(tempFile.c_str(), std::ios::binary | std::ios::trunc);
+  if (!out) {
+    std::cerr << "Could not write " << tempFile << std::endl;
+    return false;
+  }
+  SceneCacheWriter writer(out);
+  writer.write(header);
+
+  for (unsigned int i = 0; i < scene.materials.size(); i++) {
+    const MaterialData& material = scene.materials[i];
+    MaterialRecord record;
+    for (int c = 0; c < 3; c++) {
+      record.ka[c] = material.ka[c];
+      record.kd[c] = material.kd[c];
+      record.ks[c] = material.ks[c];
+      record.ke[c] = material.ke[c];
+    }
+    record.shininess = material.shininess;
+    writer.write(record);
+    writer.writeString(material.diffuseFile);
+    writer.writeString(material.normalFile);
+  }
+
+  for (unsigned int i = 0; i < scene.meshes.size(); i++) {
+    const MeshData& mesh = scene.meshes[i];
+    MeshRecord record;
+    record.materialIndex = scene.meshMaterials[i];
+    record.compactVertices = mesh.compactVertices ? 1 : 0;
+    for (int c = 0; c < 3; c++) {
+      record.positionOffset[c] = mesh.positionOffset[c];
+      record.positionScale[c] = mesh.positionScale[c];
+    }
+    const std::vector<int>& bvhPrimitives = mesh.bvh.getPrimitiveIndices();
+    writer.writeString(mesh.name);
+    writer.write(record);
+    writer.writeArray(mesh.vertices);
+    writer.writeArray(mesh.normals);
+    writer.writeArray(mesh.indices);
+    writer.writeArray(mesh.vertexData);
+    writer.writeArray(mesh.bvh.getNodes());
+    writer.writeArray(std::vector<int32_t>(bvhPrimitives.begin(), bvhPrimitives.end()));
+  }
+
+  out.close();
+  if (!out || std::rename(tempFile.c_str(), cacheFile.c_str()) != 0) {
+    std::cerr << "Could not write " << cacheFile << std::endl;
+    std::remove(tempFile.c_str());
+    return false;
+  }
+  return true;
+}
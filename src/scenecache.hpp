@@ -0,0 +1,54 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "mesh.hpp"
+
+// Bump whenever the file layout, MeshVertex, CompactMeshVertex or BVHNode changes.
+#define SCENE_CACHE_VERSION 1
+// Appended to the model's file name.
+#define SCENE_CACHE_EXTENSION ".rt2cache"
+
+/**
+ * Material parameters and texture file names, before any textures are loaded.
+ */
+struct MaterialData {
+  glm::vec3 ka;
+  glm::vec3 kd;
+  glm::vec3 ks;
+  glm::vec3 ke;
+  float shininess;
+  // Empty when the material has no such texture.
+  std::string diffuseFile;
+  std::string normalFile;
+};
+
+/**
+ * Everything loadScene() produces before touching GL.
+ */
+struct SceneData {
+  std::vector<MaterialData> materials;
+  // Prepared, with names and BVHs.
+  std::vector<MeshData> meshes;
+  // Index into materials for each mesh, or -1.
+  std::vector<int> meshMaterials;
+};
+
+/**
+ * Map the cache written next to sourceFile and copy it into scene. Fails,
+ * leaving scene empty, if the cache is missing, damaged, from another
+ * SCENE_CACHE_VERSION, written with other load options, or if sourceFile's
+ * modification time or size has changed since.
+ */
+bool readSceneCache(std::string sourceFile, bool invertNormals, unsigned int flags, SceneData& scene);
+
+/**
+ * Write scene next to sourceFile, stamped with sourceFile's current
+ * modification time and size.
+ */
+bool writeSceneCache(std::string sourceFile, bool invertNormals, unsigned int flags, const SceneData& scene);
+
+#endif
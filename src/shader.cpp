@@ -3,6 +3,7 @@
 #include <vector>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <algorithm>
 
 #include <stdlib.h>
@@ -10,88 +11,176 @@
 
 #include "shader.hpp"
 
-GLuint loadShaders(const char* vertex_file_path, const char* fragment_file_path) {
-
-  // Create the shaders
-  GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-  GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
-
-  // Read the Vertex Shader code from the file
-  std::string VertexShaderCode;
-  std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-  if(VertexShaderStream.is_open()){
-    std::string Line = "";
-    while(getline(VertexShaderStream, Line))
-      VertexShaderCode += "\n" + Line;
-    VertexShaderStream.close();
-  }else{
-    std::cerr << "Could not open " << vertex_file_path << std::endl;
-    return 0;
+/**
+ * Append the file at path to source, replacing each #include "name" line with
+ * the named file, relative to the including one. A file already included is
+ * skipped. defines go after the first file's #version. #line directives
+ * number each file's lines as source string files.size() at the time it was
+ * opened, so compile errors can be traced back through files.
+ */
+static bool readShaderFile(const std::string& path, const std::string& defines, std::string& source, std::vector<std::string>& files) {
+  std::ifstream stream(path.c_str(), std::ios::in);
+  if (!stream.is_open()) {
+    std::cerr << "Could not open " << path << std::endl;
+    return false;
   }
-
-  // Read the Fragment Shader code from the file
-  std::string FragmentShaderCode;
-  std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-  if(FragmentShaderStream.is_open()){
-    std::string Line = "";
-    while(getline(FragmentShaderStream, Line))
-      FragmentShaderCode += "\n" + Line;
-    FragmentShaderStream.close();
+  int fileIdx = files.size();
+  files.push_back(path);
+  std::string directory = path.substr(0, path.find_last_of('/') + 1);
+
+  std::string line;
+  int lineNumber = 0;
+  while (getline(stream, line)) {
+    lineNumber++;
+    size_t start = line.find_first_not_of(" \t");
+    if (start == std::string::npos || line.compare(start, 8, "#include") != 0) {
+      source += line + "\n";
+      // #line may not come before #version.
+      if (line.compare(0, 8, "#version") == 0) {
+        if (fileIdx == 0) {
+          source += defines;
+        }
+        std::ostringstream lineDirective;
+        lineDirective << "#line " << lineNumber + 1 << " " << fileIdx << "\n";
+        source += lineDirective.str();
+      }
+      continue;
+    }
+
+    size_t open = line.find('"');
+    size_t close = line.find('"', open + 1);
+    if (open == std::string::npos || close == std::string::npos) {
+      std::cerr << path << ":" << lineNumber << ": malformed #include" << std::endl;
+      return false;
+    }
+    std::string includePath = directory + line.substr(open + 1, close - open - 1);
+    if (std::find(files.begin(), files.end(), includePath) == files.end()) {
+      std::ostringstream lineDirective;
+      lineDirective << "#line 1 " << files.size() << "\n";
+      source += lineDirective.str();
+      if (!readShaderFile(includePath, defines, source, files)) {
+        return false;
+      }
+    }
+    std::ostringstream lineDirective;
+    lineDirective << "#line " << lineNumber + 1 << " " << fileIdx << "\n";
+    source += lineDirective.str();
   }
+  return true;
+}
 
-  GLint Result = GL_FALSE;
+/**
+ * Print the info log of a shader that was compiled from files, if it has one.
+ * Returns whether it compiled.
+ */
+static bool checkShader(GLuint shaderId, const std::vector<std::string>& files) {
+  GLint result = GL_FALSE;
   int infoLogLength;
-
-  // Compile Vertex Shader.
-  std::cout << "Compiling shader: " << vertex_file_path << std::endl;
-  char const * VertexSourcePointer = VertexShaderCode.c_str();
-  glShaderSource(VertexShaderID, 1, &VertexSourcePointer , NULL);
-  glCompileShader(VertexShaderID);
-
-  // Check Vertex Shader
-  glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
-  glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &infoLogLength);
-  if ( infoLogLength > 0 ){
-    std::vector<char> VertexShaderErrorMessage(infoLogLength+1);
-    glGetShaderInfoLog(VertexShaderID, infoLogLength, NULL, &VertexShaderErrorMessage[0]);
-    std::cerr << &VertexShaderErrorMessage[0] << std::endl;
+  glGetShaderiv(shaderId, GL_COMPILE_STATUS, &result);
+  glGetShaderiv(shaderId, GL_INFO_LOG_LENGTH, &infoLogLength);
+  if (infoLogLength > 0) {
+    std::vector<char> errorMessage(infoLogLength+1);
+    glGetShaderInfoLog(shaderId, infoLogLength, NULL, &errorMessage[0]);
+    std::cerr << files[0] << ":" << std::endl << &errorMessage[0] << std::endl;
+    if (files.size() > 1) {
+      for (unsigned int i = 0; i < files.size(); i++) {
+        std::cerr << "  Source string " << i << " is " << files[i] << std::endl;
+      }
+    }
   }
+  return result == GL_TRUE;
+}
 
-  // Compile Fragment Shader
-  std::cout << "Compiling shader: " << fragment_file_path << std::endl;
-  char const* FragmentSourcePointer = FragmentShaderCode.c_str();
-  glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer , NULL);
-  glCompileShader(FragmentShaderID);
-
-  // Check Fragment Shader
-  glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-  glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &infoLogLength);
-  if ( infoLogLength > 0 ){
-    std::vector<char> FragmentShaderErrorMessage(infoLogLength+1);
-    glGetShaderInfoLog(FragmentShaderID, infoLogLength, NULL, &FragmentShaderErrorMessage[0]);
-    std::cerr << &FragmentShaderErrorMessage[0] << std::endl;
+bool beginShaderBuild(const std::vector<GLenum>& types, const std::vector<std::string>& paths, const std::string& defines, ShaderBuild& build) {
+  build = ShaderBuild();
+  for (unsigned int i = 0; i < paths.size(); i++) {
+    std::string code;
+    std::vector<std::string> files;
+    if (!readShaderFile(paths[i], defines, code, files)) {
+      for (unsigned int j = 0; j < build.shaderIds.size(); j++) {
+        glDeleteShader(build.shaderIds[j]);
+      }
+      build = ShaderBuild();
+      return false;
+    }
+
+    std::cout << "Compiling shader: " << paths[i] << std::endl;
+    GLuint shaderId = glCreateShader(types[i]);
+    char const* sourcePointer = code.c_str();
+    glShaderSource(shaderId, 1, &sourcePointer, NULL);
+    glCompileShader(shaderId);
+    build.shaderIds.push_back(shaderId);
+    build.files.push_back(files);
   }
 
-  // Link the program
+  // Linking right away lets a driver with ARB_parallel_shader_compile carry
+  // on from compiling to linking without coming back to this thread.
   std::cout << "Linking program" << std::endl;
-  GLuint programId = glCreateProgram();
-  glAttachShader(programId, VertexShaderID);
-  glAttachShader(programId, FragmentShaderID);
-  glLinkProgram(programId);
-
-  // Check the program
-  glGetProgramiv(programId, GL_LINK_STATUS, &Result);
-  glGetProgramiv(programId, GL_INFO_LOG_LENGTH, &infoLogLength);
-  if (infoLogLength > 0){
+  build.programId = glCreateProgram();
+  for (unsigned int i = 0; i < build.shaderIds.size(); i++) {
+    glAttachShader(build.programId, build.shaderIds[i]);
+  }
+  glLinkProgram(build.programId);
+  return true;
+}
+
+bool isShaderBuildDone(const ShaderBuild& build) {
+  if (!GLEW_ARB_parallel_shader_compile) {
+    return true;
+  }
+  GLint done = GL_FALSE;
+  glGetProgramiv(build.programId, GL_COMPLETION_STATUS_ARB, &done);
+  return done == GL_TRUE;
+}
+
+GLuint finishShaderBuild(ShaderBuild& build) {
+  bool compiled = true;
+  for (unsigned int i = 0; i < build.shaderIds.size(); i++) {
+    compiled = checkShader(build.shaderIds[i], build.files[i]) && compiled;
+  }
+
+  GLint result = GL_FALSE;
+  int infoLogLength;
+  glGetProgramiv(build.programId, GL_LINK_STATUS, &result);
+  glGetProgramiv(build.programId, GL_INFO_LOG_LENGTH, &infoLogLength);
+  // A failed compile already said why the link failed.
+  if (compiled && infoLogLength > 0){
     std::vector<char> ProgramErrorMessage(infoLogLength+1);
-    glGetProgramInfoLog(programId, infoLogLength, NULL, &ProgramErrorMessage[0]);
+    glGetProgramInfoLog(build.programId, infoLogLength, NULL, &ProgramErrorMessage[0]);
     std::cerr << &ProgramErrorMessage[0] << std::endl;
   }
 
-  glDeleteShader(VertexShaderID);
-  glDeleteShader(FragmentShaderID);
-
+  for (unsigned int i = 0; i < build.shaderIds.size(); i++) {
+    glDeleteShader(build.shaderIds[i]);
+  }
+  GLuint programId = build.programId;
+  if (!compiled || result != GL_TRUE) {
+    glDeleteProgram(programId);
+    programId = 0;
+  }
+  build = ShaderBuild();
   return programId;
 }
 
+GLuint loadShaders(const char* vertex_file_path, const char* fragment_file_path, const std::string& defines) {
+  std::vector<GLenum> types;
+  types.push_back(GL_VERTEX_SHADER);
+  types.push_back(GL_FRAGMENT_SHADER);
+  std::vector<std::string> paths;
+  paths.push_back(vertex_file_path);
+  paths.push_back(fragment_file_path);
+
+  ShaderBuild build;
+  if (!beginShaderBuild(types, paths, defines, build)) {
+    return 0;
+  }
+  return finishShaderBuild(build);
+}
 
+GLuint loadComputeShader(const char* compute_file_path, const std::string& defines) {
+  ShaderBuild build;
+  if (!beginShaderBuild(std::vector<GLenum>(1, GL_COMPUTE_SHADER), std::vector<std::string>(1, compute_file_path), defines, build)) {
+    return 0;
+  }
+  return finishShaderBuild(build);
+}
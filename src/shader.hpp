@@ -3,7 +3,51 @@
 
 #include <GL/glew.h>
 #include <GL/gl.h>
+#include <string>
+#include <vector>
 
-GLuint loadShaders(const char * vertex_file_path,const char * fragment_file_path);
+/**
+ * A program handed to the driver to compile and link. With
+ * ARB_parallel_shader_compile it may still be building on the driver's own
+ * threads.
+ */
+struct ShaderBuild {
+  ShaderBuild(): programId(0) {}
+
+  GLuint programId;
+  std::vector<GLuint> shaderIds;
+  // For each shader, the files its source strings came from.
+  std::vector<std::vector<std::string> > files;
+};
+
+/**
+ * Start building a program from one shader of each of types, read from
+ * paths, with defines ("#define NAME value" lines) after each #version.
+ * Returns false if a file can't be read.
+ */
+bool beginShaderBuild(const std::vector<GLenum>& types, const std::vector<std::string>& paths, const std::string& defines, ShaderBuild& build);
+
+/**
+ * Whether finishShaderBuild() would return without waiting on the driver.
+ * Always true without ARB_parallel_shader_compile.
+ */
+bool isShaderBuildDone(const ShaderBuild& build);
+
+/**
+ * Print any info logs, free the shaders and return the program, or 0 if it
+ * failed to compile or link.
+ */
+GLuint finishShaderBuild(ShaderBuild& build);
+
+/**
+ * Compile and link a program, or return 0. Shader files may #include "name",
+ * relative to themselves, after their #version.
+ */
+GLuint loadShaders(const char * vertex_file_path,const char * fragment_file_path, const std::string& defines = "");
+
+/**
+ * As loadShaders(), for a compute shader. Needs GL 4.3.
+ */
+GLuint loadComputeShader(const char* compute_file_path, const std::string& defines = "");
 
 #endif
@@ -0,0 +1,133 @@
+#include <iostream>
+
+#include "shadercache.hpp"
+
+ShaderCache::ShaderCache(GLFWwindow* shareWith): parallel(GLEW_ARB_parallel_shader_compile), workerWindow(NULL), stopping(false) {
+  if (parallel) {
+    // As many threads as the driver likes.
+    glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+    return;
+  }
+
+  // Same context hints as shareWith, which are still set.
+  glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+  workerWindow = glfwCreateWindow(1, 1, "Shader compiler", NULL, shareWith);
+  glfwWindowHint(GLFW_VISIBLE, GL_TRUE);
+  if (workerWindow == NULL) {
+    std::cerr << "Could not create a context to compile shaders in; toggling settings will stall" << std::endl;
+    return;
+  }
+  worker = std::thread(&ShaderCache::workerLoop, this);
+}
+
+ShaderCache::~ShaderCache() {
+  if (workerWindow != NULL) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    condition.notify_all();
+    worker.join();
+    glfwDestroyWindow(workerWindow);
+  }
+  for (std::map<std::string, Entry>::iterator it = entries.begin(); it != entries.end(); ++it) {
+    if (it->second.state == BUILDING) {
+      it->second.programId = finishShaderBuild(it->second.build);
+    }
+    glDeleteProgram(it->second.programId);
+  }
+}
+
+GLuint ShaderCache::getProgram(const std::string& vertexPath, const std::string& fragmentPath, const std::string& defines) {
+  std::vector<GLenum> types;
+  types.push_back(GL_VERTEX_SHADER);
+  types.push_back(GL_FRAGMENT_SHADER);
+  std::vector<std::string> paths;
+  paths.push_back(vertexPath);
+  paths.push_back(fragmentPath);
+  return get(types, paths, defines);
+}
+
+GLuint ShaderCache::getComputeProgram(const std::string& path, const std::string& defines) {
+  return get(std::vector<GLenum>(1, GL_COMPUTE_SHADER), std::vector<std::string>(1, path), defines);
+}
+
+GLuint ShaderCache::get(const std::vector<GLenum>& types, const std::vector<std::string>& paths, const std::string& defines) {
+  std::string key;
+  for (unsigned int i = 0; i < paths.size(); i++) {
+    key += paths[i] + "\n";
+  }
+  key += defines;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  std::map<std::string, Entry>::iterator it = entries.find(key);
+  if (it == entries.end()) {
+    Entry& entry = entries[key];
+    entry.types = types;
+    entry.paths = paths;
+    entry.defines = defines;
+    condition.notify_one();
+    return 0;
+  }
+  return it->second.programId;
+}
+
+void ShaderCache::update() {
+  if (workerWindow != NULL) {
+    return;
+  }
+  bool started = false;
+  for (std::map<std::string, Entry>::iterator it = entries.begin(); it != entries.end(); ++it) {
+    Entry& entry = it->second;
+    if (entry.state == QUEUED && (parallel || !started)) {
+      started = true;
+      if (!beginShaderBuild(entry.types, entry.paths, entry.defines, entry.build)) {
+        entry.state = DONE;
+        continue;
+      }
+      entry.state = BUILDING;
+    }
+    if (entry.state == BUILDING && isShaderBuildDone(entry.build)) {
+      entry.programId = finishShaderBuild(entry.build);
+      entry.state = DONE;
+      if (entry.programId == 0) {
+        std::cerr << "Specialized program failed to build, with:" << std::endl << entry.defines;
+      }
+    }
+  }
+}
+
+void ShaderCache::workerLoop() {
+  glfwMakeContextCurrent(workerWindow);
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stopping) {
+    Entry* entry = NULL;
+    for (std::map<std::string, Entry>::iterator it = entries.begin(); it != entries.end() && entry == NULL; ++it) {
+      if (it->second.state == QUEUED) {
+        entry = &it->second;
+      }
+    }
+    if (entry == NULL) {
+      condition.wait(lock);
+      continue;
+    }
+
+    // Only this thread touches a building entry, and map nodes stay put.
+    entry->state = BUILDING;
+    lock.unlock();
+    GLuint programId = 0;
+    if (beginShaderBuild(entry->types, entry->paths, entry->defines, entry->build)) {
+      programId = finishShaderBuild(entry->build);
+      // The GL thread may use the program as soon as it sees it.
+      glFinish();
+    }
+    lock.lock();
+    entry->programId = programId;
+    entry->state = DONE;
+    if (programId == 0) {
+      std::cerr << "Specialized program failed to build, with:" << std::endl << entry->defines;
+    }
+  }
+  lock.unlock();
+  glfwMakeContextCurrent(NULL);
+}
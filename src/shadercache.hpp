@@ -0,0 +1,84 @@
+#ifndef SHADER_CACHE_H
+#define SHADER_CACHE_H
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "shader.hpp"
+
+/**
+ * Programs built from the same shader files with different #defines, each
+ * built once on first request and kept.
+ *
+ * Requests return 0 until the program is ready, so a caller can carry on
+ * with one it already has rather than wait, and nothing builds on the
+ * caller's thread. With ARB_parallel_shader_compile every queued program
+ * builds on the driver's threads at once, and update() only picks up the
+ * finished ones. Without it, a worker thread builds them one at a time in a
+ * hidden context sharing objects with the caller's.
+ *
+ * Only if that context can't be created does update() build one queued
+ * program per call, stalling that frame.
+ */
+class ShaderCache {
+public:
+  /**
+   * shareWith is the window whose context will use the programs. Call on
+   * the main thread, which GLFW creates windows on.
+   */
+  ShaderCache(GLFWwindow* shareWith);
+  // Deletes every program built.
+  ~ShaderCache();
+
+  /**
+   * The program from a vertex and fragment shader with defines, or 0 until
+   * update() has built it, or for good if that failed.
+   */
+  GLuint getProgram(const std::string& vertexPath, const std::string& fragmentPath, const std::string& defines);
+  GLuint getComputeProgram(const std::string& path, const std::string& defines);
+
+  /**
+   * Start building queued programs and pick up finished ones. Once a frame.
+   */
+  void update();
+
+private:
+  enum EntryState {
+    QUEUED,
+    BUILDING,
+    DONE
+  };
+
+  struct Entry {
+    Entry(): state(QUEUED), programId(0) {}
+
+    std::vector<GLenum> types;
+    std::vector<std::string> paths;
+    std::string defines;
+    EntryState state;
+    ShaderBuild build;
+    GLuint programId;
+  };
+
+  GLuint get(const std::vector<GLenum>& types, const std::vector<std::string>& paths, const std::string& defines);
+  void workerLoop();
+
+  bool parallel;
+  // Keyed on the paths and defines.
+  std::map<std::string, Entry> entries;
+
+  // Without parallel compiles. The mutex guards entries against the worker.
+  GLFWwindow* workerWindow;
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool stopping;
+};
+
+#endif
@@ -0,0 +1,199 @@
+#include <algorithm>
+#include <atomic>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "tangents.hpp"
+
+void TangentFrames::compute(
+    const std::vector<glm::vec3>& vertices,
+    const std::vector<glm::vec2>& uvs,
+    const std::vector<unsigned int>& indices,
+    ThreadPool* pool) {
+  int numVertices = vertices.size();
+  int numFaces = indices.size() / 3;
+  this->uvs = uvs;
+
+  // Adjacency, with each vertex's faces in ascending order.
+  faceOffsets.assign(numVertices + 1, 0);
+  for (int i = 0; i < 3*numFaces; i++) {
+    faceOffsets[indices[i] + 1]++;
+  }
+  for (int v = 0; v < numVertices; v++) {
+    faceOffsets[v + 1] += faceOffsets[v];
+  }
+  vertexFaces.resize(3*numFaces);
+  std::vector<int> cursor(faceOffsets.begin(), faceOffsets.end() - 1);
+  for (int i = 0; i < 3*numFaces; i++) {
+    vertexFaces[cursor[indices[i]]++] = i / 3;
+  }
+
+  faceDegenerate.assign(numFaces, 0);
+  faceTangents.resize(numFaces);
+  faceBitangents.resize(numFaces);
+  tangents.resize(numVertices);
+  bitangents.resize(numVertices);
+
+  std::atomic<int> degenerate(0);
+  parallelFor(pool, 0, numFaces, TANGENT_GRAIN_SIZE, [&](int begin, int end) {
+    degenerate += computeFaces(vertices, indices, NULL, begin, end - begin);
+  });
+  numDegenerateFaces = degenerate;
+  parallelFor(pool, 0, numVertices, TANGENT_GRAIN_SIZE, [&](int begin, int end) {
+    sumVertices(NULL, begin, end - begin);
+  });
+}
+
+void TangentFrames::update(
+    const std::vector<glm::vec3>& vertices,
+    const std::vector<glm::vec2>& uvs,
+    const std::vector<unsigned int>& indices,
+    std::vector<int>& changedVertices,
+    ThreadPool* pool) {
+  changedVertices.clear();
+  if (uvs.size() != this->uvs.size()) {
+    compute(vertices, uvs, indices, pool);
+    for (unsigned int v = 0; v < vertices.size(); v++) {
+      changedVertices.push_back(v);
+    }
+    return;
+  }
+
+  // Faces around moved UVs, then every vertex of those faces.
+  std::vector<int> dirtyFaces;
+  for (unsigned int v = 0; v < uvs.size(); v++) {
+    if (uvs[v] != this->uvs[v]) {
+      this->uvs[v] = uvs[v];
+      changedVertices.push_back(v);
+      dirtyFaces.insert(dirtyFaces.end(), vertexFaces.begin() + faceOffsets[v], vertexFaces.begin() + faceOffsets[v + 1]);
+    }
+  }
+  if (dirtyFaces.empty()) {
+    return;
+  }
+  std::sort(dirtyFaces.begin(), dirtyFaces.end());
+  dirtyFaces.erase(std::unique(dirtyFaces.begin(), dirtyFaces.end()), dirtyFaces.end());
+  for (unsigned int i = 0; i < dirtyFaces.size(); i++) {
+    for (int c = 0; c < 3; c++) {
+      changedVertices.push_back(indices[3*dirtyFaces[i] + c]);
+    }
+  }
+  std::sort(changedVertices.begin(), changedVertices.end());
+  changedVertices.erase(std::unique(changedVertices.begin(), changedVertices.end()), changedVertices.end());
+
+  std::atomic<int> degenerate(0);
+  parallelFor(pool, 0, dirtyFaces.size(), TANGENT_GRAIN_SIZE, [&](int begin, int end) {
+    degenerate += computeFaces(vertices, indices, &dirtyFaces[begin], 0, end - begin);
+  });
+  numDegenerateFaces += degenerate;
+  parallelFor(pool, 0, changedVertices.size(), TANGENT_GRAIN_SIZE, [&](int begin, int end) {
+    sumVertices(&changedVertices[begin], 0, end - begin);
+  });
+}
+
+int TangentFrames::computeFaces(
+    const std::vector<glm::vec3>& vertices,
+    const std::vector<unsigned int>& indices,
+    const int* faces,
+    int first,
+    int count) {
+  int degenerateChange = 0;
+  int i = 0;
+
+#ifdef __SSE2__
+  for (; i + 4 <= count; i += 4) {
+    // Gather four faces, one component per register.
+    float p[3][3][4], t[3][2][4];
+    int face[4];
+    for (int lane = 0; lane < 4; lane++) {
+      face[lane] = faces ? faces[i + lane] : first + i + lane;
+      for (int c = 0; c < 3; c++) {
+        unsigned int v = indices[3*face[lane] + c];
+        p[c][0][lane] = vertices[v].x;
+        p[c][1][lane] = vertices[v].y;
+        p[c][2][lane] = vertices[v].z;
+        t[c][0][lane] = uvs[v].x;
+        t[c][1][lane] = uvs[v].y;
+      }
+    }
+
+    __m128 deltaPos1[3], deltaPos2[3];
+    for (int axis = 0; axis < 3; axis++) {
+      __m128 p0 = _mm_loadu_ps(p[0][axis]);
+      deltaPos1[axis] = _mm_sub_ps(_mm_loadu_ps(p[1][axis]), p0);
+      deltaPos2[axis] = _mm_sub_ps(_mm_loadu_ps(p[2][axis]), p0);
+    }
+    __m128 u0 = _mm_loadu_ps(t[0][0]);
+    __m128 v0 = _mm_loadu_ps(t[0][1]);
+    __m128 deltaU1 = _mm_sub_ps(_mm_loadu_ps(t[1][0]), u0);
+    __m128 deltaV1 = _mm_sub_ps(_mm_loadu_ps(t[1][1]), v0);
+    __m128 deltaU2 = _mm_sub_ps(_mm_loadu_ps(t[2][0]), u0);
+    __m128 deltaV2 = _mm_sub_ps(_mm_loadu_ps(t[2][1]), v0);
+
+    __m128 oneOverR = _mm_sub_ps(_mm_mul_ps(deltaU1, deltaV2), _mm_mul_ps(deltaV1, deltaU2));
+    __m128 valid = _mm_cmpneq_ps(oneOverR, _mm_setzero_ps());
+    // Zero r for degenerate faces, so they contribute nothing.
+    __m128 r = _mm_and_ps(valid, _mm_div_ps(_mm_set1_ps(1.0f), oneOverR));
+
+    float tangent[3][4], bitangent[3][4];
+    for (int axis = 0; axis < 3; axis++) {
+      __m128 tan = _mm_sub_ps(_mm_mul_ps(deltaPos1[axis], deltaV2), _mm_mul_ps(deltaPos2[axis], deltaV1));
+      __m128 bitan = _mm_sub_ps(_mm_mul_ps(deltaPos2[axis], deltaU1), _mm_mul_ps(deltaPos1[axis], deltaU2));
+      _mm_storeu_ps(tangent[axis], _mm_mul_ps(tan, r));
+      _mm_storeu_ps(bitangent[axis], _mm_mul_ps(bitan, r));
+    }
+
+    int validMask = _mm_movemask_ps(valid);
+    for (int lane = 0; lane < 4; lane++) {
+      faceTangents[face[lane]] = glm::vec3(tangent[0][lane], tangent[1][lane], tangent[2][lane]);
+      faceBitangents[face[lane]] = glm::vec3(bitangent[0][lane], bitangent[1][lane], bitangent[2][lane]);
+      char degenerate = (validMask >> lane) & 1 ? 0 : 1;
+      degenerateChange += degenerate - faceDegenerate[face[lane]];
+      faceDegenerate[face[lane]] = degenerate;
+    }
+  }
+#endif
+
+  // Remaining faces, or all of them without SSE.
+  for (; i < count; i++) {
+    int f = faces ? faces[i] : first + i;
+    unsigned int p[] = {
+      indices[f*3],
+      indices[f*3+1],
+      indices[f*3+2]
+    };
+
+    // Edges of the triangle - position delta.
+    glm::vec3 deltaPos1 = vertices[p[1]] - vertices[p[0]];
+    glm::vec3 deltaPos2 = vertices[p[2]] - vertices[p[0]];
+
+    // UV delta
+    glm::vec2 deltaUV1 = uvs[p[1]] - uvs[p[0]];
+    glm::vec2 deltaUV2 = uvs[p[2]] - uvs[p[0]];
+
+    float oneOverR = deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x;
+    char degenerate = oneOverR == 0 ? 1 : 0;
+    float r = degenerate ? 0 : 1.0f / oneOverR;
+    faceTangents[f] = (deltaPos1 * deltaUV2.y - deltaPos2 * deltaUV1.y) * r;
+    faceBitangents[f] = (deltaPos2 * deltaUV1.x - deltaPos1 * deltaUV2.x) * r;
+    degenerateChange += degenerate - faceDegenerate[f];
+    faceDegenerate[f] = degenerate;
+  }
+  return degenerateChange;
+}
+
+void TangentFrames::sumVertices(const int* vertexList, int first, int count) {
+  for (int i = 0; i < count; i++) {
+    int v = vertexList ? vertexList[i] : first + i;
+    glm::vec3 tangent(0);
+    glm::vec3 bitangent(0);
+    for (int k = faceOffsets[v]; k < faceOffsets[v + 1]; k++) {
+      tangent += faceTangents[vertexFaces[k]];
+      bitangent += faceBitangents[vertexFaces[k]];
+    }
+    tangents[v] = tangent;
+    bitangents[v] = bitangent;
+  }
+}
@@ -0,0 +1,94 @@
+#ifndef TANGENTS_H
+#define TANGENTS_H
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "threadpool.hpp"
+
+// Faces or vertices per parallelFor chunk.
+#define TANGENT_GRAIN_SIZE 4096
+
+/**
+ * Per-vertex tangents and bitangents derived from UVs, kept along with each
+ * face's contribution so that changing a few UVs only redoes their faces.
+ *
+ * Face tangents are computed four faces at a time with SSE, gathering
+ * positions and UVs into one register per component. Vertices then sum the
+ * tangents of their faces through a vertex-to-face adjacency, which lets
+ * vertices be summed in parallel without atomics, in the same order as a
+ * serial scatter over faces.
+ */
+class TangentFrames {
+public:
+  TangentFrames(): numDegenerateFaces(0) {}
+
+  /**
+   * Compute every tangent. uvs must have an entry per vertex.
+   */
+  void compute(
+    const std::vector<glm::vec3>& vertices,
+    const std::vector<glm::vec2>& uvs,
+    const std::vector<unsigned int>& indices,
+    ThreadPool* pool = NULL
+  );
+
+  /**
+   * Recompute the faces around vertices whose UV differs from the last
+   * compute() or update(). vertices and indices must be unchanged since.
+   * changedVertices is set to every vertex whose UV or tangents changed, sorted.
+   */
+  void update(
+    const std::vector<glm::vec3>& vertices,
+    const std::vector<glm::vec2>& uvs,
+    const std::vector<unsigned int>& indices,
+    std::vector<int>& changedVertices,
+    ThreadPool* pool = NULL
+  );
+
+  const std::vector<glm::vec2>& getUVs() const {
+    return uvs;
+  }
+
+  const std::vector<glm::vec3>& getTangents() const {
+    return tangents;
+  }
+
+  const std::vector<glm::vec3>& getBitangents() const {
+    return bitangents;
+  }
+
+  /**
+   * Faces whose UVs have no area, which contribute nothing.
+   */
+  int getNumDegenerateFaces() const {
+    return numDegenerateFaces;
+  }
+
+private:
+  // Compute faces[0..count), or faces [first, first + count) when faces is NULL.
+  // Returns the number of degenerate faces among them.
+  int computeFaces(
+    const std::vector<glm::vec3>& vertices,
+    const std::vector<unsigned int>& indices,
+    const int* faces,
+    int first,
+    int count
+  );
+
+  // Sum face tangents into each vertex of vertexList[0..count), or [first, first + count) when NULL.
+  void sumVertices(const int* vertexList, int first, int count);
+
+  std::vector<glm::vec2> uvs;
+  // Faces using vertex v are vertexFaces[faceOffsets[v]] up to vertexFaces[faceOffsets[v + 1]].
+  std::vector<int> faceOffsets;
+  std::vector<int> vertexFaces;
+  std::vector<char> faceDegenerate;
+  std::vector<glm::vec3> faceTangents;
+  std::vector<glm::vec3> faceBitangents;
+  std::vector<glm::vec3> tangents;
+  std::vector<glm::vec3> bitangents;
+  int numDegenerateFaces;
+};
+
+#endif
@@ -1,11 +1,50 @@
 
 #include <FreeImage.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
 #include <iostream>
 #include "texture.hpp"
 
+std::mutex Texture::loadedTexturesMutex;
 std::map<std::string, Texture*> Texture::loadedTextures;
-
-static bool fiError = false;
+std::vector<Texture::StreamRequest*> Texture::streamRequests;
+TaskGroup* Texture::streamTasks = NULL;
+ThreadPool* Texture::streamPool = NULL;
+size_t Texture::budget = TEXTURE_DEFAULT_BUDGET;
+TextureStats Texture::stats;
+unsigned int Texture::currentFrame = 1;
+
+/**
+ * One streamed texture. Workers decode and fill; the GL thread maps, uploads
+ * and retires. Each side only acts on the states it owns.
+ */
+struct Texture::StreamRequest {
+  enum State {
+    DECODING,   // Worker: loading the file, or its compressed cache.
+    DECODED,    // GL thread: map an unpack buffer of the image's size.
+    FILLING,    // Worker: copying the image into the mapped buffer.
+    FILLED,     // GL thread: unmap and upload.
+    FAILED      // GL thread: retire, leaving the placeholder.
+  };
+
+  Texture* texture;
+  bool useMipmaps;
+  bool compress;
+  CompressionFormat format;
+  // Compressed levels above this are skipped, for textures whose top mips were dropped.
+  int firstLevel;
+  std::atomic<int> state;
+  // Either bitmap or, when compressing, compressed holds the image.
+  FIBITMAP* bitmap;
+  CompressedTexture compressed;
+  GLuint unpackBuffer;
+  void* mapped;
+};
+
+// FreeImage reports errors on the thread that hit them.
+static thread_local bool fiError = false;
 
 void fiMessageFunction(FREE_IMAGE_FORMAT fif, const char *msg) {
   std::cerr << (int)fif << ": " << msg << std::endl;
@@ -16,42 +55,411 @@ void Texture::initialize() {
   FreeImage_SetOutputMessage(fiMessageFunction);
 }
 
-Texture* Texture::loadOrGet(std::string fname, bool useMipmaps) {
-  if (loadedTextures.find(fname) != loadedTextures.end()) {
-    return loadedTextures[fname];
-  }
-
+// Load fname as 24-bit BGR, or return NULL.
+static FIBITMAP* decodeBitmap(std::string fname) {
   FIBITMAP* bitmap = FreeImage_Load(FreeImage_GetFileType(fname.c_str(), 0), fname.c_str());
+  if (bitmap == NULL) {
+    fiError = false;
+    return NULL;
+  }
   FIBITMAP *pImage = FreeImage_ConvertTo24Bits(bitmap);
+  FreeImage_Unload(bitmap);
+
+  if (fiError) {
+    fiError = false;
+    if (pImage != NULL) {
+      FreeImage_Unload(pImage);
+    }
+    return NULL;
+  }
+  return pImage;
+}
 
-  const int texWidth = FreeImage_GetWidth(bitmap);
-  const int texHeight = FreeImage_GetHeight(bitmap);
+// Levels in a full mip chain.
+static int getNumLevels(int width, int height) {
+  int levels = 1;
+  while (width > 1 || height > 1) {
+    width = std::max(1, width / 2);
+    height = std::max(1, height / 2);
+    levels++;
+  }
+  return levels;
+}
+
+// GL_RGB8, which drivers store padded to 4 bytes a texel.
+static size_t getUncompressedSize(int width, int height, bool mipmaps) {
+  size_t size = 0;
+  int levels = mipmaps ? getNumLevels(width, height) : 1;
+  for (int level = 0; level < levels; level++) {
+    size += 4 * (size_t)std::max(1, width >> level) * std::max(1, height >> level);
+  }
+  return size;
+}
 
+// Read fname's compressed cache, or decode and compress it and write the cache.
+static bool loadCompressed(std::string fname, CompressionFormat format, bool mipmaps, CompressedTexture& out, ThreadPool* pool) {
+  if (readCompressedTexture(fname, format, mipmaps, out)) {
+    return true;
+  }
+  FIBITMAP* bitmap = decodeBitmap(fname);
+  if (bitmap == NULL) {
+    return false;
+  }
+  compressTexture(FreeImage_GetBits(bitmap), FreeImage_GetPitch(bitmap), FreeImage_GetWidth(bitmap), FreeImage_GetHeight(bitmap),
+    format, mipmaps, out, pool);
   FreeImage_Unload(bitmap);
+  writeCompressedTexture(fname, format, mipmaps, out);
+  return true;
+}
 
-  Texture* texture = new Texture(fname, texWidth, texHeight, (void*) FreeImage_GetBits(pImage), useMipmaps);
+bool TextureImage::decode(std::string fname) {
+  this->fname = fname;
+  FIBITMAP* pImage = decodeBitmap(fname);
+  if (pImage == NULL) {
+    return false;
+  }
+
+  width = FreeImage_GetWidth(pImage);
+  height = FreeImage_GetHeight(pImage);
+  const unsigned char* bits = FreeImage_GetBits(pImage);
+  pixels.assign(bits, bits + FreeImage_GetPitch(pImage) * height);
 
   FreeImage_Unload(pImage);
+  return true;
+}
 
-  if (fiError) {
-    fiError = false;
+Texture* Texture::loadOrGet(std::string fname, bool useMipmaps) {
+  Texture* loaded = find(fname);
+  if (loaded != NULL) {
+    stats.hits++;
+    return loaded;
+  }
+
+  TextureImage image;
+  if (!image.decode(fname)) {
     return 0;
   }
+  return loadOrGet(image, useMipmaps);
+}
+
+Texture* Texture::loadOrGet(const TextureImage& image, bool useMipmaps) {
+  Texture* loaded = find(image.fname);
+  if (loaded != NULL) {
+    stats.hits++;
+    return loaded;
+  }
+  stats.misses++;
 
-  loadedTextures[fname] = texture;
-  std::cout << "Loaded Texture " << fname << std::endl;
+  Texture* texture = new Texture(image.fname, image.width, image.height, (void*)&image.pixels[0], useMipmaps);
+  {
+    std::lock_guard<std::mutex> lock(loadedTexturesMutex);
+    loadedTextures[image.fname] = texture;
+  }
+  std::cout << "Loaded Texture " << image.fname << std::endl;
 
   return texture;
 }
 
+Texture* Texture::find(std::string fname) {
+  std::lock_guard<std::mutex> lock(loadedTexturesMutex);
+  std::map<std::string, Texture*>::iterator it = loadedTextures.find(fname);
+  return it != loadedTextures.end() ? it->second : NULL;
+}
+
+Texture* Texture::loadAsync(std::string fname, bool useMipmaps, Usage usage) {
+  Texture* loaded = find(fname);
+  if (loaded != NULL) {
+    stats.hits++;
+    return loaded;
+  }
+  stats.misses++;
+
+  Texture* texture = new Texture(fname, usage);
+  texture->residency.useMipmaps = useMipmaps;
+  {
+    std::lock_guard<std::mutex> lock(loadedTexturesMutex);
+    loadedTextures[fname] = texture;
+  }
+  texture->stream(0);
+  return texture;
+}
+
+void Texture::stream(int firstLevel) {
+  StreamRequest* request = new StreamRequest();
+  request->texture = this;
+  request->useMipmaps = residency.useMipmaps;
+  // RGTC is core, S3TC only an extension.
+  request->compress = residency.usage == USAGE_NORMAL || GLEW_EXT_texture_compression_s3tc;
+  request->format = residency.usage == USAGE_NORMAL ? COMPRESS_BC5 : COMPRESS_BC1;
+  request->firstLevel = request->compress ? firstLevel : 0;
+  request->state = StreamRequest::DECODING;
+  request->bitmap = NULL;
+  request->unpackBuffer = 0;
+  request->mapped = NULL;
+  streamRequests.push_back(request);
+  residency.streaming = true;
+
+  if (streamTasks == NULL) {
+    // A pool of n threads spawns n-1 workers, so this has at least one.
+    streamPool = new ThreadPool(std::max(ThreadPool::getDefaultNumThreads() / 2, 1) + 1);
+    streamTasks = new TaskGroup(streamPool);
+  }
+  std::string fname = name;
+  ThreadPool* pool = streamPool;
+  streamTasks->run([request, fname, pool]() {
+    bool decoded;
+    if (request->compress) {
+      CompressedTexture& image = request->compressed;
+      decoded = loadCompressed(fname, request->format, request->useMipmaps, image, pool);
+      // Skip the top levels, keeping at least the smallest.
+      int skipped = decoded ? std::min(request->firstLevel, (int)image.levels.size() - 1) : 0;
+      if (skipped > 0) {
+        int width = image.getLevelWidth(skipped);
+        int height = image.getLevelHeight(skipped);
+        image.levels.erase(image.levels.begin(), image.levels.begin() + skipped);
+        image.width = width;
+        image.height = height;
+      }
+      request->firstLevel = skipped;
+    } else {
+      request->bitmap = decodeBitmap(fname);
+      decoded = request->bitmap != NULL;
+    }
+    request->state = decoded ? StreamRequest::DECODED : StreamRequest::FAILED;
+  });
+}
+
+int Texture::streamTextures(double budget) {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  unsigned int kept = 0;
+  bool overBudget = false;
+  for (unsigned int i = 0; i < streamRequests.size(); i++) {
+    StreamRequest* request = streamRequests[i];
+    int state = request->state;
+    // Always make some progress, then stop once the budget is spent.
+    if (!overBudget && (state == StreamRequest::DECODED || state == StreamRequest::FILLED || state == StreamRequest::FAILED)) {
+      Texture* texture = request->texture;
+      if (state == StreamRequest::DECODED) {
+        GLsizeiptr size = request->compress ? request->compressed.getSize() :
+          FreeImage_GetPitch(request->bitmap) * FreeImage_GetHeight(request->bitmap);
+        glGenBuffers(1, &request->unpackBuffer);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, request->unpackBuffer);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+        request->mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        if (request->mapped == NULL) {
+          std::cerr << "Could not map an unpack buffer for " << texture->name << std::endl;
+          if (request->bitmap != NULL) {
+            FreeImage_Unload(request->bitmap);
+            request->bitmap = NULL;
+          }
+          request->compressed = CompressedTexture();
+          request->state = StreamRequest::FAILED;
+        } else {
+          request->state = StreamRequest::FILLING;
+          streamTasks->run([request, size]() {
+            if (request->compress) {
+              // Levels back to back, largest first.
+              unsigned char* dst = (unsigned char*)request->mapped;
+              const std::vector<std::vector<unsigned char> >& levels = request->compressed.levels;
+              for (unsigned int level = 0; level < levels.size(); level++) {
+                memcpy(dst, &levels[level][0], levels[level].size());
+                dst += levels[level].size();
+              }
+            } else {
+              memcpy(request->mapped, FreeImage_GetBits(request->bitmap), size);
+            }
+            request->state = StreamRequest::FILLED;
+          });
+        }
+      } else if (state == StreamRequest::FILLED) {
+        if (request->compress) {
+          texture->width = request->compressed.width;
+          texture->height = request->compressed.height;
+        } else {
+          texture->width = FreeImage_GetWidth(request->bitmap);
+          texture->height = FreeImage_GetHeight(request->bitmap);
+          FreeImage_Unload(request->bitmap);
+          request->bitmap = NULL;
+        }
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, request->unpackBuffer);
+        bool intact = glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_TRUE;
+        request->mapped = NULL;
+        if (intact) {
+          // Same parameters as the synchronous constructor, sourced from the bound unpack buffer.
+          glBindTexture(GL_TEXTURE_2D, texture->texId);
+          glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, request->useMipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+          if (request->compress) {
+            // The mip chain came with the image, so there is nothing to generate.
+            const CompressedTexture& image = request->compressed;
+            size_t offset = 0;
+            for (unsigned int level = 0; level < image.levels.size(); level++) {
+              glCompressedTexImage2D(GL_TEXTURE_2D, level, image.internalFormat, image.getLevelWidth(level), image.getLevelHeight(level),
+                0, image.levels[level].size(), (void*)offset);
+              offset += image.levels[level].size();
+            }
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, image.levels.size() - 1);
+            texture->residency.internalFormat = image.internalFormat;
+            texture->residency.numLevels = image.levels.size();
+            texture->setBytes(image.getSize());
+          } else {
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, texture->width, texture->height, 0, GL_BGR, GL_UNSIGNED_BYTE, (void*)0);
+            if (request->useMipmaps) {
+              glGenerateMipmap(GL_TEXTURE_2D);
+            }
+            texture->residency.internalFormat = GL_RGB8;
+            texture->residency.numLevels = request->useMipmaps ? getNumLevels(texture->width, texture->height) : 1;
+            // Undo any limit left by dropTopMip().
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, texture->residency.numLevels - 1);
+            texture->setBytes(getUncompressedSize(texture->width, texture->height, request->useMipmaps));
+          }
+          texture->residency.droppedLevels = request->firstLevel;
+          if (request->firstLevel == 0) {
+            texture->residency.fullBytes = texture->residency.bytes;
+          }
+          texture->resident = true;
+          std::cout << "Streamed Texture " << texture->name << std::endl;
+        } else {
+          std::cerr << "Unpack buffer for " << texture->name << " was lost" << std::endl;
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glDeleteBuffers(1, &request->unpackBuffer);
+        texture->residency.streaming = false;
+        delete request;
+        request = NULL;
+      } else {
+        // Zero unless mapping failed.
+        glDeleteBuffers(1, &request->unpackBuffer);
+        texture->residency.streaming = false;
+        delete request;
+        request = NULL;
+      }
+      overBudget = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() >= budget;
+    }
+    if (request != NULL) {
+      streamRequests[kept++] = request;
+    }
+  }
+  streamRequests.resize(kept);
+  return kept;
+}
+
 void Texture::freeLoadedTextures() {
+  // Let in-flight decodes and copies finish before freeing what they write to.
+  delete streamTasks;
+  streamTasks = NULL;
+  delete streamPool;
+  streamPool = NULL;
+  for (unsigned int i = 0; i < streamRequests.size(); i++) {
+    StreamRequest* request = streamRequests[i];
+    if (request->unpackBuffer != 0) {
+      if (request->mapped != NULL) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, request->unpackBuffer);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      }
+      glDeleteBuffers(1, &request->unpackBuffer);
+    }
+    if (request->bitmap != NULL) {
+      FreeImage_Unload(request->bitmap);
+    }
+    delete request;
+  }
+  streamRequests.clear();
+
+  std::lock_guard<std::mutex> lock(loadedTexturesMutex);
   for (std::map<std::string, Texture*>::iterator it = loadedTextures.begin(); it != loadedTextures.end(); it++) {
     delete it->second;
   }
   loadedTextures.clear();
+
+  std::map<std::string, TextureCube*>& cubes = TextureCube::loadedTextureCubes;
+  for (std::map<std::string, TextureCube*>::iterator it = cubes.begin(); it != cubes.end(); it++) {
+    delete it->second;
+  }
+  cubes.clear();
+}
+
+void Texture::setBudget(size_t bytes) {
+  budget = bytes;
 }
 
-Texture::Texture(std::string fname, int width, int height, void* data, bool useMipmaps): name(fname), width(width), height(height) {
+void Texture::updateResidency(double timeBudget) {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  // Unreferenced textures go first, least recently used first.
+  while (stats.residentBytes > budget) {
+    Texture* victim = NULL;
+    {
+      std::lock_guard<std::mutex> lock(loadedTexturesMutex);
+      for (std::map<std::string, Texture*>::iterator it = loadedTextures.begin(); it != loadedTextures.end(); it++) {
+        Texture* texture = it->second;
+        if (texture->residency.refCount <= 0 && !texture->residency.streaming &&
+            (victim == NULL || texture->residency.lastUsed < victim->residency.lastUsed)) {
+          victim = texture;
+        }
+      }
+      if (victim != NULL) {
+        loadedTextures.erase(victim->name);
+      }
+    }
+    if (victim == NULL) {
+      break;
+    }
+    delete victim;
+    stats.evictions++;
+  }
+
+  // Then the top mips of referenced ones, finer than anything needs first.
+  while (stats.residentBytes > budget &&
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < timeBudget) {
+    Texture* victim = NULL;
+    bool victimSurplus = false;
+    for (std::map<std::string, Texture*>::iterator it = loadedTextures.begin(); it != loadedTextures.end(); it++) {
+      Texture* texture = it->second;
+      if (!texture->canDropMip()) {
+        continue;
+      }
+      bool surplus = texture->residency.wantedLevel > texture->residency.droppedLevels;
+      if (victim == NULL || (surplus && !victimSurplus) ||
+          (surplus == victimSurplus && texture->residency.lastUsed < victim->residency.lastUsed)) {
+        victim = texture;
+        victimSurplus = surplus;
+      }
+    }
+    if (victim == NULL) {
+      break;
+    }
+    victim->dropTopMip();
+    stats.droppedMips++;
+  }
+
+  // Stream back mips that textures used this frame are missing, as far as they fit.
+  size_t projectedBytes = stats.residentBytes;
+  for (std::map<std::string, Texture*>::iterator it = loadedTextures.begin(); it != loadedTextures.end(); it++) {
+    Texture* texture = it->second;
+    Residency& r = texture->residency;
+    if (!r.streamed || !texture->resident || r.streaming || r.lastUsed != currentFrame || r.droppedLevels <= r.wantedLevel) {
+      continue;
+    }
+    // Each level is about a quarter of the one above.
+    bool compressed = r.internalFormat != GL_RGB8;
+    size_t restoredBytes = compressed ? r.fullBytes >> (2 * r.wantedLevel) : r.fullBytes;
+    if (projectedBytes - r.bytes + restoredBytes <= budget) {
+      projectedBytes = projectedBytes - r.bytes + restoredBytes;
+      texture->stream(r.wantedLevel);
+      stats.restores++;
+    }
+  }
+
+  currentFrame++;
+}
+
+Texture::Texture(std::string fname, int width, int height, void* data, bool useMipmaps): name(fname), width(width), height(height), resident(true) {
+  residency.numLevels = useMipmaps ? getNumLevels(width, height) : 1;
+  residency.useMipmaps = useMipmaps;
+  setBytes(getUncompressedSize(width, height, useMipmaps));
   texId = 0;
   glGenTextures(1, &texId);
   glBindTexture(GL_TEXTURE_2D, texId);
@@ -64,83 +472,265 @@ Texture::Texture(std::string fname, int width, int height, void* data, bool useM
   }
 }
 
-Texture::Texture(GLuint texId, int width, int height): texId(texId), name(""), width(width), height(height) {}
+Texture::Texture(GLuint texId, int width, int height): texId(texId), name(""), width(width), height(height), resident(true) {}
+
+Texture::Texture(std::string fname, Usage usage): name(fname), width(1), height(1), resident(false) {
+  residency.streamed = true;
+  residency.usage = usage;
+  setBytes(getUncompressedSize(1, 1, false));
+  // BGR, like every other upload here.
+  const unsigned char white[] = {255, 255, 255};
+  const unsigned char flatNormal[] = {255, 128, 128};
+  texId = 0;
+  glGenTextures(1, &texId);
+  glBindTexture(GL_TEXTURE_2D, texId);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, 1, 1, 0, GL_BGR, GL_UNSIGNED_BYTE, usage == USAGE_COLOUR ? white : flatNormal);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
 
 Texture::~Texture() {
   glDeleteTextures(1, &texId);
+  setBytes(0);
 }
 
-void Texture::saveTextureToFile(unsigned char* pixels, int width, int height, std::string filename) {
-  FIBITMAP* img = FreeImage_ConvertFromRawBits(pixels, width, height, 3*width, 24, 0xFF0000, 0x00FF00, 0x0000FF, false);
-  FreeImage_Save(FIF_PNG, img, filename.c_str(), 0);
-  FreeImage_Unload(img);
+void Texture::setBytes(size_t bytes) {
+  stats.residentBytes = stats.residentBytes - residency.bytes + bytes;
+  residency.bytes = bytes;
 }
 
+void Texture::acquire() {
+  residency.refCount++;
+  residency.lastUsed = currentFrame;
+}
 
+void Texture::release() {
+  residency.refCount--;
+  residency.lastUsed = currentFrame;
+}
 
-std::map<std::string, TextureCube*> TextureCube::loadedTextureCubes;
-
-TextureCube* TextureCube::loadOrGet(std::string fnames[6]) {
-  if (loadedTextureCubes.find(fnames[0]) != loadedTextureCubes.end()) {
-    return loadedTextureCubes[fnames[0]];
+void Texture::touch(int level) {
+  if (residency.lastUsed != currentFrame) {
+    residency.lastUsed = currentFrame;
+    residency.wantedLevel = level;
+  } else {
+    residency.wantedLevel = std::min(residency.wantedLevel, level);
   }
+}
 
-  void* data[6];
-  FIBITMAP* pImages[6];
-  int texWidth, texHeight;
+bool Texture::canDropMip() {
+  return residency.streamed && resident && !residency.streaming && residency.numLevels > 1;
+}
+
+void Texture::dropTopMip() {
+  bool compressed = residency.internalFormat != GL_RGB8;
+  GLuint oldTexId = texId;
+  texId = 0;
+  glGenTextures(1, &texId);
+  glBindTexture(GL_TEXTURE_2D, texId);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+  size_t bytes = 0;
+  std::vector<unsigned char> pixels;
+  for (int level = 1; level < residency.numLevels; level++) {
+    GLint levelWidth, levelHeight;
+    glBindTexture(GL_TEXTURE_2D, oldTexId);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_WIDTH, &levelWidth);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_HEIGHT, &levelHeight);
+    if (compressed) {
+      GLint levelSize;
+      glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &levelSize);
+      pixels.resize(levelSize);
+      glGetCompressedTexImage(GL_TEXTURE_2D, level, &pixels[0]);
+      glBindTexture(GL_TEXTURE_2D, texId);
+      glCompressedTexImage2D(GL_TEXTURE_2D, level - 1, residency.internalFormat, levelWidth, levelHeight, 0, levelSize, &pixels[0]);
+      bytes += levelSize;
+    } else {
+      // Rows padded to 4 bytes, the default pack and unpack alignment.
+      pixels.resize(((3 * levelWidth + 3) & ~3) * levelHeight);
+      glGetTexImage(GL_TEXTURE_2D, level, GL_BGR, GL_UNSIGNED_BYTE, &pixels[0]);
+      glBindTexture(GL_TEXTURE_2D, texId);
+      glTexImage2D(GL_TEXTURE_2D, level - 1, GL_RGB8, levelWidth, levelHeight, 0, GL_BGR, GL_UNSIGNED_BYTE, &pixels[0]);
+      bytes += 4 * (size_t)levelWidth * levelHeight;
+    }
+    if (level == 1) {
+      width = levelWidth;
+      height = levelHeight;
+    }
+  }
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, residency.numLevels - 2);
+  glDeleteTextures(1, &oldTexId);
 
-  int i;
-  for (i = 0; !fiError && i < 6; i++) {
-    std::string fname = fnames[i];
+  residency.numLevels--;
+  residency.droppedLevels++;
+  setBytes(bytes);
+}
 
-    FIBITMAP* bitmap = FreeImage_Load(FreeImage_GetFileType(fname.c_str(), 0), fname.c_str());
-    pImages[i] = FreeImage_ConvertTo24Bits(bitmap);
+void Texture::saveTextureToFile(unsigned char* pixels, int width, int height, std::string filename) {
+  FIBITMAP* img = FreeImage_ConvertFromRawBits(pixels, width, height, 3*width, 24, 0xFF0000, 0x00FF00, 0x0000FF, false);
+  FreeImage_Save(FIF_PNG, img, filename.c_str(), 0);
+  FreeImage_Unload(img);
+}
 
-    texWidth = FreeImage_GetWidth(bitmap);
-    texHeight = FreeImage_GetHeight(bitmap);
 
-    FreeImage_Unload(bitmap);
 
-    data[i] = (void*) FreeImage_GetBits(pImages[i]);
-  }
+std::map<std::string, TextureCube*> TextureCube::loadedTextureCubes;
 
-  TextureCube* texture = 0;
-  if (!fiError) {
-    texture = new TextureCube(fnames, texWidth, texHeight, data);
-    loadedTextureCubes[fnames[0]] = texture;
-    std::cout << "Loaded TextureCube " << fnames[0] << std::endl;
+TextureCube* TextureCube::loadOrGet(std::string fnames[6], ThreadPool* pool) {
+  if (loadedTextureCubes.find(fnames[0]) != loadedTextureCubes.end()) {
+    return loadedTextureCubes[fnames[0]];
   }
 
-  i--;
-  for (; i >= 0; i--) {
-    FreeImage_Unload(pImages[i]);
+  bool compress = GLEW_EXT_texture_compression_s3tc;
+  EnvironmentMap map;
+  if (!readEnvironmentMap(fnames, compress, map)) {
+    FIBITMAP* bitmaps[6];
+    TaskGroup group(pool);
+    for (int i = 0; i < 6; i++) {
+      group.run([&bitmaps, fnames, i]() {
+        bitmaps[i] = decodeBitmap(fnames[i]);
+      });
+    }
+    group.wait();
+
+    bool valid = true;
+    const unsigned char* faces[6];
+    int size = bitmaps[0] != NULL ? FreeImage_GetWidth(bitmaps[0]) : 0;
+    for (int i = 0; i < 6; i++) {
+      if (bitmaps[i] == NULL || FreeImage_GetWidth(bitmaps[i]) != (unsigned int)size || FreeImage_GetHeight(bitmaps[i]) != (unsigned int)size) {
+        std::cerr << "TextureCube face " << fnames[i] << " is missing or not the size of the others" << std::endl;
+        valid = false;
+      } else {
+        faces[i] = FreeImage_GetBits(bitmaps[i]);
+      }
+    }
+    if (valid) {
+      prefilterEnvironment(faces, FreeImage_GetPitch(bitmaps[0]), size, compress, map, pool);
+    }
+    for (int i = 0; i < 6; i++) {
+      if (bitmaps[i] != NULL) {
+        FreeImage_Unload(bitmaps[i]);
+      }
+    }
+    if (!valid) {
+      return 0;
+    }
+    writeEnvironmentMap(fnames, map);
   }
 
-  fiError = false;
+  TextureCube* texture = new TextureCube(fnames, map);
+  loadedTextureCubes[fnames[0]] = texture;
+  std::cout << "Loaded TextureCube " << fnames[0] << " with " << map.getNumLevels() << " prefiltered levels" << std::endl;
   return texture;
 }
 
-TextureCube::TextureCube(std::string fnames[6], int width, int height, void* data[6]) {
+TextureCube::TextureCube(std::string fnames[6], const EnvironmentMap& map): numLevels(map.getNumLevels()) {
   this->name = fnames[0];
-  this->width = width;
-  this->height = height;
+  this->width = map.size;
+  this->height = map.size;
   texId = 0;
+  irradianceTexId = 0;
 
   glGenTextures(1, &texId);
   glBindTexture(GL_TEXTURE_CUBE_MAP, texId);
 
+  glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+  glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, numLevels - 1);
+
+  // Levels are tightly packed.
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  size_t bytes = 0;
+  for (int i = 0; i < 6; i++) {
+    for (int level = 0; level < numLevels; level++) {
+      const std::vector<unsigned char>& data = map.radiance[i][level];
+      int size = map.getLevelSize(level);
+      if (map.compressed) {
+        glCompressedTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, level, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, size, size, 0, data.size(), &data[0]);
+        bytes += data.size();
+      } else {
+        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, level, GL_RGB8, size, size, 0, GL_BGR, GL_UNSIGNED_BYTE, &data[0]);
+        bytes += getUncompressedSize(size, size, false);
+      }
+    }
+  }
+
+  glGenTextures(1, &irradianceTexId);
+  glBindTexture(GL_TEXTURE_CUBE_MAP, irradianceTexId);
   glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
   glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
   glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+  for (int i = 0; i < 6; i++) {
+    glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB8, map.irradianceSize, map.irradianceSize, 0, GL_BGR, GL_UNSIGNED_BYTE,
+      &map.irradiance[i][0]);
+    bytes += getUncompressedSize(map.irradianceSize, map.irradianceSize, false);
+  }
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  setBytes(bytes);
+}
 
-  // Note: Assuming texture was BGR.
-  glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X, 0, GL_RGB8, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data[0]);
-  glTexImage2D(GL_TEXTURE_CUBE_MAP_NEGATIVE_X, 0, GL_RGB8, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data[1]);
-  glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_Y, 0, GL_RGB8, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data[2]);
-  glTexImage2D(GL_TEXTURE_CUBE_MAP_NEGATIVE_Y, 0, GL_RGB8, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data[3]);
-  glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_Z, 0, GL_RGB8, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data[4]);
-  glTexImage2D(GL_TEXTURE_CUBE_MAP_NEGATIVE_Z, 0, GL_RGB8, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data[5]);
+TextureCube::~TextureCube() {
+  glDeleteTextures(1, &irradianceTexId);
 }
 
+
+
+TextureBuffer::TextureBuffer(GLenum internalFormat): internalFormat(internalFormat) {
+  this->width = 0;
+  this->height = 1;
+  texId = 0;
+  bufferId = 0;
+
+  glGenBuffers(1, &bufferId);
+  glGenTextures(1, &texId);
+}
+
+TextureBuffer::~TextureBuffer() {
+  glDeleteBuffers(1, &bufferId);
+}
+
+void TextureBuffer::setData(const void* data, GLsizeiptr size) {
+  this->width = size;
+  checkSize(internalFormat, size);
+
+  glBindBuffer(GL_TEXTURE_BUFFER, bufferId);
+  glBufferData(GL_TEXTURE_BUFFER, size, data, GL_STATIC_DRAW);
+
+  glBindTexture(GL_TEXTURE_BUFFER, texId);
+  glTexBuffer(GL_TEXTURE_BUFFER, internalFormat, bufferId);
+}
+
+bool TextureBuffer::checkSize(GLenum internalFormat, GLsizeiptr size) {
+  static GLint maxTexels = 0;
+  if (maxTexels == 0) {
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+  }
+  GLsizeiptr texelSize = 4;
+  if (internalFormat == GL_RGBA32F || internalFormat == GL_RGBA32I) {
+    texelSize = 16;
+  } else if (internalFormat == GL_RGBA16) {
+    texelSize = 8;
+  }
+  GLsizeiptr texels = size / texelSize;
+  if (texels <= maxTexels) {
+    return true;
+  }
+  std::cerr << "Texture buffer of " << texels << " texels exceeds the maximum of " << maxTexels << std::endl;
+  return false;
+}
+
+void TextureBuffer::update(GLintptr offset, GLsizeiptr size, const void* data) {
+  if (size <= 0) {
+    return;
+  }
+  glBindBuffer(GL_TEXTURE_BUFFER, bufferId);
+  glBufferSubData(GL_TEXTURE_BUFFER, offset, size, data);
+}
@@ -4,23 +4,154 @@
 #include <GL/glew.h>
 #include <GL/gl.h>
 #include <map>
+#include <mutex>
 #include <string>
+#include <vector>
+
+#include "envmap.hpp"
+#include "texturecompress.hpp"
+#include "threadpool.hpp"
+
+// Seconds of GL work per frame that Texture::streamTextures() should spend finishing streamed textures.
+#define TEXTURE_STREAM_BUDGET 0.002
+// Seconds per frame that Texture::updateResidency() may spend reading back textures to drop their top mips.
+#define TEXTURE_RESIDENCY_BUDGET 0.001
+// Bytes of GL memory that loaded textures are kept within, unless changed with Texture::setBudget().
+#define TEXTURE_DEFAULT_BUDGET ((size_t)512 << 20)
+
+/**
+ * Running totals from Texture's residency management.
+ */
+struct TextureStats {
+  TextureStats(): residentBytes(0), hits(0), misses(0), evictions(0), droppedMips(0), restores(0) {}
+
+  // GL memory held by every texture other than buffers, estimated from formats and sizes.
+  size_t residentBytes;
+  // Loads that found the texture already loaded or streaming, and loads that had to start one.
+  int hits;
+  int misses;
+  // Unreferenced textures freed to get back under budget.
+  int evictions;
+  // Top mips dropped from referenced textures, and textures streamed back in after.
+  int droppedMips;
+  int restores;
+};
+
+/**
+ * Pixels decoded from an image file, ready for upload. Decoding touches no
+ * GL state, so it may run on any thread.
+ */
+struct TextureImage {
+  TextureImage(): width(0), height(0) {}
+
+  bool decode(std::string fname);
+
+  std::string fname;
+  int width;
+  int height;
+  // BGR rows, each padded to 4 bytes as FreeImage stores them.
+  std::vector<unsigned char> pixels;
+};
 
 class Texture {
 public:
+  /**
+   * What a streamed texture holds, which picks its placeholder and format.
+   * Colour maps are BC1 when the driver has S3TC. Normal maps are BC5, so
+   * shaders read x and y from red and green and rebuild z.
+   */
+  enum Usage {
+    USAGE_COLOUR,
+    USAGE_NORMAL
+  };
+
   static void initialize();
+  /**
+   * Loaded textures start unreferenced. Hold them with acquire(), or they may
+   * be freed by updateResidency() once over budget.
+   */
   static Texture* loadOrGet(std::string fname, bool useMipmaps);
+  /**
+   * Upload an already decoded image, unless one of the same name is loaded.
+   */
+  static Texture* loadOrGet(const TextureImage& image, bool useMipmaps);
+  /**
+   * A loaded or streaming texture, or NULL. Safe from any thread.
+   */
+  static Texture* find(std::string fname);
   static void freeLoadedTextures();
 
-  Texture() {}
+  /**
+   * Start streaming fname and return at once. The image is read from its
+   * compressed cache, or decoded and block compressed, on the streaming
+   * workers, then copied
+   * into a mapped pixel unpack buffer and uploaded by streamTextures() along
+   * with its precomputed mips. Until then the texture is a 1x1 placeholder.
+   * Requests for a name already loaded or in flight return the same Texture.
+   * GL thread only.
+   */
+  static Texture* loadAsync(std::string fname, bool useMipmaps, Usage usage);
+
+  /**
+   * Move streamed textures along on the GL thread, mapping unpack buffers for
+   * decoded images and uploading filled ones, for about budget seconds.
+   * Returns the number still in flight.
+   */
+  static int streamTextures(double budget);
+
+  /**
+   * Bytes of GL memory for updateResidency() to keep loaded textures within.
+   */
+  static void setBudget(size_t bytes);
+
+  /**
+   * Once a frame on the GL thread, after every touch(). While over budget,
+   * frees unreferenced textures, least recently used first, then drops the
+   * top mip of referenced streamed textures: first those holding finer mips
+   * than touch() asked for, then the least recently used. That reads the
+   * texture back, so mips are dropped for only about budget seconds a frame.
+   * Textures touched for finer mips than they hold stream back in once they
+   * fit. Cubes count towards the budget but are never freed early.
+   */
+  static void updateResidency(double budget);
+
+  static const TextureStats& getStats() {
+    return stats;
+  }
+
+  Texture(): resident(true) {}
   Texture(std::string fname, int width, int height, void* data, bool useMipmaps);
   Texture(GLuint texId, int width, int height);
   ~Texture();
 
+  /**
+   * May change when updateResidency() drops mips, so fetch it each frame.
+   */
   GLuint getTextureId() {
     return texId;
   }
 
+  /**
+   * Reference counting, so updateResidency() only frees what nothing holds.
+   * An unreferenced texture stays loaded, for whatever loads it next, until
+   * the room is needed.
+   */
+  void acquire();
+  void release();
+
+  /**
+   * Mark as used this frame, needing mips from level down. With several
+   * touches in a frame, the finest level wins.
+   */
+  void touch(int level = 0);
+
+  /**
+   * False while a streamed texture still shows its placeholder.
+   */
+  bool isResident() {
+    return resident;
+  }
+
   static void saveTextureToFile(unsigned char* pixels, int width, int height, std::string filename);
 
 protected:
@@ -28,20 +159,133 @@ protected:
   std::string name;
   int width;
   int height;
+  bool resident;
+
+  // Record the GL memory now held, updating the resident total.
+  void setBytes(size_t bytes);
 
 private:
+  struct StreamRequest;
+
+  /**
+   * What updateResidency() tracks beyond the GL texture itself.
+   */
+  struct Residency {
+    Residency(): refCount(0), lastUsed(0), wantedLevel(0), bytes(0), fullBytes(0), internalFormat(GL_RGB8), numLevels(1),
+      droppedLevels(0), streamed(false), streaming(false), usage(USAGE_COLOUR), useMipmaps(false) {}
+
+    int refCount;
+    // Frame of the last touch(), acquire() or release().
+    unsigned int lastUsed;
+    int wantedLevel;
+    size_t bytes;
+    // Bytes with every mip, as first streamed.
+    size_t fullBytes;
+    GLenum internalFormat;
+    int numLevels;
+    // Top mips missing relative to the source image.
+    int droppedLevels;
+    // From loadAsync(), so dropped mips can be streamed back in.
+    bool streamed;
+    bool streaming;
+    Usage usage;
+    bool useMipmaps;
+  };
+
+  Texture(std::string fname, Usage usage);
+
+  // Stream the image in again, from firstLevel down when it is block compressed.
+  void stream(int firstLevel);
+  // Replace the texture with one lacking its largest mip, read back from this one.
+  void dropTopMip();
+  bool canDropMip();
+
+  Residency residency;
+
+  // Guards loadedTextures, which worker threads may search.
+  static std::mutex loadedTexturesMutex;
   static std::map<std::string, Texture*> loadedTextures;
+  // In flight, touched only on the GL thread; workers only advance each request's state.
+  static std::vector<StreamRequest*> streamRequests;
+  static TaskGroup* streamTasks;
+  // Streaming's own workers. Nothing on the GL thread waits on them, so it
+  // never ends up running a decode itself, and they run with no other workers.
+  static ThreadPool* streamPool;
+
+  static size_t budget;
+  static TextureStats stats;
+  // Counts updateResidency() calls, for least recently used ordering.
+  static unsigned int currentFrame;
 };
 
 class TextureCube: public Texture {
 public:
-  static TextureCube* loadOrGet(std::string fnames[6]);
+  /**
+   * Decode the faces in parallel on pool and prefilter them into an
+   * EnvironmentMap, or read one from its cache. Levels are BC1 compressed
+   * when the driver has S3TC.
+   */
+  static TextureCube* loadOrGet(std::string fnames[6], ThreadPool* pool = NULL);
 
-  TextureCube(std::string fnames[6], int width, int height, void* data[6]);
+  TextureCube(std::string fnames[6], const EnvironmentMap& map);
+  ~TextureCube();
+
+  /**
+   * Cosine-convolved cube, for diffuse lighting from the environment.
+   */
+  GLuint getIrradianceTextureId() {
+    return irradianceTexId;
+  }
+
+  /**
+   * The roughest level, which textureLod() reaches at roughness 1.
+   */
+  float getMaxLod() {
+    return numLevels - 1;
+  }
 
 private:
-  // TODO: free these.
+  GLuint irradianceTexId;
+  int numLevels;
+
+  // Freed by Texture::freeLoadedTextures().
+  friend class Texture;
   static std::map<std::string, TextureCube*> loadedTextureCubes;
 };
 
+/**
+ * Buffer object viewed through a GL_TEXTURE_BUFFER, for handing the shader
+ * arrays that are too large for a uniform block.
+ */
+class TextureBuffer: public Texture {
+public:
+  TextureBuffer(GLenum internalFormat);
+  ~TextureBuffer();
+
+  void setData(const void* data, GLsizeiptr size);
+
+  /**
+   * Whether size bytes of internalFormat texels fit within
+   * GL_MAX_TEXTURE_BUFFER_SIZE. Reports to std::cerr when they don't.
+   */
+  static bool checkSize(GLenum internalFormat, GLsizeiptr size);
+
+  /**
+   * Overwrite part of the data given to setData(). The range must lie within it.
+   */
+  void update(GLintptr offset, GLsizeiptr size, const void* data);
+
+  GLsizeiptr getSize() {
+    return width;
+  }
+
+  GLuint getBufferId() {
+    return bufferId;
+  }
+
+private:
+  GLuint bufferId;
+  GLenum internalFormat;
+};
+
 #endif
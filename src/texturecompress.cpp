@@ -0,0 +1,453 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "texturecompress.hpp"
+
+static const char textureCacheMagic[4] = {'R', 'T', '2', 'T'};
+
+struct TextureCacheHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t format;
+  uint32_t mipmaps;
+  int64_t sourceModified;
+  int64_t sourceSize;
+  uint32_t internalFormat;
+  int32_t width;
+  int32_t height;
+  uint32_t numLevels;
+};
+
+static GLenum getInternalFormat(CompressionFormat format) {
+  return format == COMPRESS_BC1 ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : GL_COMPRESSED_RG_RGTC2;
+}
+
+static int getBlockSize(CompressionFormat format) {
+  return format == COMPRESS_BC1 ? 8 : 16;
+}
+
+static size_t getLevelSize(CompressionFormat format, int width, int height) {
+  return (size_t)((width + 3) / 4) * ((height + 3) / 4) * getBlockSize(format);
+}
+
+GLsizei CompressedTexture::getLevelWidth(int level) const {
+  return std::max(1, width >> level);
+}
+
+GLsizei CompressedTexture::getLevelHeight(int level) const {
+  return std::max(1, height >> level);
+}
+
+size_t CompressedTexture::getSize() const {
+  size_t size = 0;
+  for (unsigned int i = 0; i < levels.size(); i++) {
+    size += levels[i].size();
+  }
+  return size;
+}
+
+static uint16_t packRGB565(const float c[3]) {
+  int r = std::min(std::max((int)(c[0] * 31 / 255 + 0.5f), 0), 31);
+  int g = std::min(std::max((int)(c[1] * 63 / 255 + 0.5f), 0), 63);
+  int b = std::min(std::max((int)(c[2] * 31 / 255 + 0.5f), 0), 31);
+  return (r << 11) | (g << 5) | b;
+}
+
+static void unpackRGB565(uint16_t c, int out[3]) {
+  int r = (c >> 11) & 31;
+  int g = (c >> 5) & 63;
+  int b = c & 31;
+  out[0] = (r << 3) | (r >> 2);
+  out[1] = (g << 2) | (g >> 4);
+  out[2] = (b << 3) | (b >> 2);
+}
+
+// Choose the nearest of c0 and c1's four-colour palette for each texel. Returns the squared error.
+static int selectBC1Indices(const unsigned char block[16][3], uint16_t c0, uint16_t c1, uint32_t& indices) {
+  int palette[4][3];
+  unpackRGB565(c0, palette[0]);
+  unpackRGB565(c1, palette[1]);
+  for (int c = 0; c < 3; c++) {
+    palette[2][c] = (2*palette[0][c] + palette[1][c]) / 3;
+    palette[3][c] = (palette[0][c] + 2*palette[1][c]) / 3;
+  }
+
+  indices = 0;
+  int error = 0;
+  for (int i = 0; i < 16; i++) {
+    int best = 0;
+    int bestError = -1;
+    for (int k = 0; k < 4; k++) {
+      int dr = block[i][0] - palette[k][0];
+      int dg = block[i][1] - palette[k][1];
+      int db = block[i][2] - palette[k][2];
+      int e = dr*dr + dg*dg + db*db;
+      if (bestError < 0 || e < bestError) {
+        bestError = e;
+        best = k;
+      }
+    }
+    indices |= best << (2*i);
+    error += bestError;
+  }
+  return error;
+}
+
+// Pack endpoints in four-colour order (c0 > c1) and pick indices for them.
+static int fitBC1(const unsigned char block[16][3], const float e0[3], const float e1[3], uint16_t& c0, uint16_t& c1, uint32_t& indices) {
+  c0 = packRGB565(e0);
+  c1 = packRGB565(e1);
+  if (c0 < c1) {
+    std::swap(c0, c1);
+  }
+  if (c0 == c1) {
+    // Three-colour mode, but index 0 is still c0.
+    indices = 0;
+    int palette[3];
+    unpackRGB565(c0, palette);
+    int error = 0;
+    for (int i = 0; i < 16; i++) {
+      for (int c = 0; c < 3; c++) {
+        error += (block[i][c] - palette[c]) * (block[i][c] - palette[c]);
+      }
+    }
+    return error;
+  }
+  return selectBC1Indices(block, c0, c1, indices);
+}
+
+static void encodeBC1Block(const unsigned char block[16][3], unsigned char* out) {
+  // Endpoints along the principal axis of the block's colours.
+  float mean[3] = {0, 0, 0};
+  for (int i = 0; i < 16; i++) {
+    for (int c = 0; c < 3; c++) {
+      mean[c] += block[i][c] / 16.0f;
+    }
+  }
+  float cov[3][3] = {{0}};
+  for (int i = 0; i < 16; i++) {
+    float d[3] = {block[i][0] - mean[0], block[i][1] - mean[1], block[i][2] - mean[2]};
+    for (int a = 0; a < 3; a++) {
+      for (int b = 0; b < 3; b++) {
+        cov[a][b] += d[a] * d[b];
+      }
+    }
+  }
+  float axis[3] = {1, 1, 1};
+  for (int iteration = 0; iteration < 8; iteration++) {
+    float next[3];
+    for (int a = 0; a < 3; a++) {
+      next[a] = cov[a][0]*axis[0] + cov[a][1]*axis[1] + cov[a][2]*axis[2];
+    }
+    float scale = std::max(fabsf(next[0]), std::max(fabsf(next[1]), fabsf(next[2])));
+    if (scale == 0) {
+      break;
+    }
+    for (int a = 0; a < 3; a++) {
+      axis[a] = next[a] / scale;
+    }
+  }
+  float length = sqrtf(axis[0]*axis[0] + axis[1]*axis[1] + axis[2]*axis[2]);
+  for (int a = 0; a < 3; a++) {
+    axis[a] /= length;
+  }
+
+  float minT = 0, maxT = 0;
+  for (int i = 0; i < 16; i++) {
+    float t = (block[i][0] - mean[0])*axis[0] + (block[i][1] - mean[1])*axis[1] + (block[i][2] - mean[2])*axis[2];
+    minT = std::min(minT, t);
+    maxT = std::max(maxT, t);
+  }
+  // Inset the endpoints slightly, as the extremes are rarely worth a whole palette entry.
+  float inset = (maxT - minT) / 16;
+  float e0[3], e1[3];
+  for (int c = 0; c < 3; c++) {
+    e0[c] = mean[c] + axis[c] * (maxT - inset);
+    e1[c] = mean[c] + axis[c] * (minT + inset);
+  }
+
+  uint16_t c0, c1;
+  uint32_t indices;
+  int error = fitBC1(block, e0, e1, c0, c1, indices);
+
+  // Refit the endpoints to the chosen indices by least squares, once.
+  if (c0 != c1 && error > 0) {
+    static const float weights[4] = {1.0f, 0.0f, 2.0f / 3, 1.0f / 3};
+    float aa = 0, ab = 0, bb = 0;
+    float ax[3] = {0, 0, 0}, bx[3] = {0, 0, 0};
+    for (int i = 0; i < 16; i++) {
+      float w = weights[(indices >> (2*i)) & 3];
+      aa += w * w;
+      ab += w * (1 - w);
+      bb += (1 - w) * (1 - w);
+      for (int c = 0; c < 3; c++) {
+        ax[c] += w * block[i][c];
+        bx[c] += (1 - w) * block[i][c];
+      }
+    }
+    float det = aa*bb - ab*ab;
+    if (fabsf(det) > 1e-6f) {
+      for (int c = 0; c < 3; c++) {
+        e0[c] = (ax[c]*bb - bx[c]*ab) / det;
+        e1[c] = (bx[c]*aa - ax[c]*ab) / det;
+      }
+      uint16_t refit0, refit1;
+      uint32_t refitIndices;
+      int refitError = fitBC1(block, e0, e1, refit0, refit1, refitIndices);
+      if (refitError < error) {
+        c0 = refit0;
+        c1 = refit1;
+        indices = refitIndices;
+      }
+    }
+  }
+
+  out[0] = c0 & 0xFF;
+  out[1] = c0 >> 8;
+  out[2] = c1 & 0xFF;
+  out[3] = c1 >> 8;
+  for (int i = 0; i < 4; i++) {
+    out[4 + i] = (indices >> (8*i)) & 0xFF;
+  }
+}
+
+static void encodeBC4Block(const unsigned char values[16], unsigned char* out) {
+  int minValue = 255, maxValue = 0;
+  for (int i = 0; i < 16; i++) {
+    minValue = std::min(minValue, (int)values[i]);
+    maxValue = std::max(maxValue, (int)values[i]);
+  }
+  // Eight-value mode needs the first endpoint larger.
+  out[0] = maxValue;
+  out[1] = minValue;
+  uint64_t bits = 0;
+  if (maxValue > minValue) {
+    for (int i = 0; i < 16; i++) {
+      // Steps up from the minimum; index 0 is the maximum, 1 the minimum, 2..7 in between from the top.
+      int step = (int)((values[i] - minValue) * 7.0f / (maxValue - minValue) + 0.5f);
+      uint64_t index = step == 7 ? 0 : step == 0 ? 1 : 8 - step;
+      bits |= index << (3*i);
+    }
+  }
+  for (int i = 0; i < 6; i++) {
+    out[2 + i] = (bits >> (8*i)) & 0xFF;
+  }
+}
+
+// Gather the 4x4 block at (bx, by) from tight RGB, clamping at the edges.
+static void fetchBlock(const std::vector<unsigned char>& rgb, int width, int height, int bx, int by, unsigned char block[16][3]) {
+  for (int y = 0; y < 4; y++) {
+    int sy = std::min(4*by + y, height - 1);
+    for (int x = 0; x < 4; x++) {
+      int sx = std::min(4*bx + x, width - 1);
+      const unsigned char* texel = &rgb[3 * ((size_t)sy * width + sx)];
+      for (int c = 0; c < 3; c++) {
+        block[4*y + x][c] = texel[c];
+      }
+    }
+  }
+}
+
+static void encodeLevel(const std::vector<unsigned char>& rgb, int width, int height, CompressionFormat format,
+    std::vector<unsigned char>& out, ThreadPool* pool) {
+  int blocksX = (width + 3) / 4;
+  int blocksY = (height + 3) / 4;
+  int blockSize = getBlockSize(format);
+  out.resize(getLevelSize(format, width, height));
+  parallelFor(pool, 0, blocksY, TEXTURE_COMPRESS_GRAIN_SIZE, [&](int begin, int end) {
+    unsigned char block[16][3];
+    for (int by = begin; by < end; by++) {
+      for (int bx = 0; bx < blocksX; bx++) {
+        fetchBlock(rgb, width, height, bx, by, block);
+        unsigned char* dst = &out[((size_t)by * blocksX + bx) * blockSize];
+        if (format == COMPRESS_BC1) {
+          encodeBC1Block(block, dst);
+        } else {
+          unsigned char red[16], green[16];
+          for (int i = 0; i < 16; i++) {
+            red[i] = block[i][0];
+            green[i] = block[i][1];
+          }
+          encodeBC4Block(red, dst);
+          encodeBC4Block(green, dst + 8);
+        }
+      }
+    }
+  });
+}
+
+// Box filter to half size. Normal maps are averaged as vectors and renormalized.
+static void downsample(const std::vector<unsigned char>& src, int width, int height, bool normalMap,
+    std::vector<unsigned char>& dst, int dstWidth, int dstHeight) {
+  dst.resize(3 * (size_t)dstWidth * dstHeight);
+  for (int y = 0; y < dstHeight; y++) {
+    int y0 = std::min(2*y, height - 1);
+    int y1 = std::min(2*y + 1, height - 1);
+    for (int x = 0; x < dstWidth; x++) {
+      int x0 = std::min(2*x, width - 1);
+      int x1 = std::min(2*x + 1, width - 1);
+      const unsigned char* texels[4] = {
+        &src[3 * ((size_t)y0 * width + x0)],
+        &src[3 * ((size_t)y0 * width + x1)],
+        &src[3 * ((size_t)y1 * width + x0)],
+        &src[3 * ((size_t)y1 * width + x1)]
+      };
+      float sum[3] = {0, 0, 0};
+      for (int t = 0; t < 4; t++) {
+        for (int c = 0; c < 3; c++) {
+          sum[c] += normalMap ? texels[t][c] / 127.5f - 1 : texels[t][c];
+        }
+      }
+      unsigned char* out = &dst[3 * ((size_t)y * dstWidth + x)];
+      if (normalMap) {
+        float length = sqrtf(sum[0]*sum[0] + sum[1]*sum[1] + sum[2]*sum[2]);
+        for (int c = 0; c < 3; c++) {
+          float n = length > 0 ? sum[c] / length : (c == 2 ? 1 : 0);
+          out[c] = (unsigned char)std::min(std::max((n + 1) * 127.5f + 0.5f, 0.0f), 255.0f);
+        }
+      } else {
+        for (int c = 0; c < 3; c++) {
+          out[c] = (unsigned char)(sum[c] / 4 + 0.5f);
+        }
+      }
+    }
+  }
+}
+
+void compressTexture(
+    const unsigned char* bgr,
+    int pitch,
+    int width,
+    int height,
+    CompressionFormat format,
+    bool mipmaps,
+    CompressedTexture& out,
+    ThreadPool* pool) {
+  out.internalFormat = getInternalFormat(format);
+  out.width = width;
+  out.height = height;
+  out.levels.clear();
+
+  // Tight RGB, so every level has the same layout.
+  std::vector<unsigned char> rgb(3 * (size_t)width * height);
+  for (int y = 0; y < height; y++) {
+    const unsigned char* row = bgr + (size_t)y * pitch;
+    for (int x = 0; x < width; x++) {
+      unsigned char* texel = &rgb[3 * ((size_t)y * width + x)];
+      texel[0] = row[3*x + 2];
+      texel[1] = row[3*x + 1];
+      texel[2] = row[3*x];
+    }
+  }
+
+  std::vector<unsigned char> smaller;
+  int levelWidth = width;
+  int levelHeight = height;
+  while (true) {
+    out.levels.push_back(std::vector<unsigned char>());
+    encodeLevel(rgb, levelWidth, levelHeight, format, out.levels.back(), pool);
+    if (!mipmaps || (levelWidth == 1 && levelHeight == 1)) {
+      break;
+    }
+    int nextWidth = std::max(1, levelWidth / 2);
+    int nextHeight = std::max(1, levelHeight / 2);
+    downsample(rgb, levelWidth, levelHeight, format == COMPRESS_BC5, smaller, nextWidth, nextHeight);
+    rgb.swap(smaller);
+    levelWidth = nextWidth;
+    levelHeight = nextHeight;
+  }
+}
+
+bool getSourceStamp(std::string sourceFile, int64_t& modified, int64_t& size) {
+  struct stat info;
+  if (stat(sourceFile.c_str(), &info) != 0) {
+    return false;
+  }
+  modified = info.st_mtime;
+  size = info.st_size;
+  return true;
+}
+
+bool readCompressedTexture(std::string sourceFile, CompressionFormat format, bool mipmaps, CompressedTexture& out) {
+  int64_t sourceModified, sourceSize;
+  if (!getSourceStamp(sourceFile, sourceModified, sourceSize)) {
+    return false;
+  }
+  std::ifstream in((sourceFile + TEXTURE_CACHE_EXTENSION).c_str(), std::ios::binary);
+  if (!in) {
+    return false;
+  }
+
+  TextureCacheHeader header;
+  if (!in.read((char*)&header, sizeof(header)) ||
+      memcmp(header.magic, textureCacheMagic, sizeof(textureCacheMagic)) != 0 ||
+      header.version != TEXTURE_CACHE_VERSION ||
+      header.format != (uint32_t)format ||
+      header.mipmaps != (mipmaps ? 1u : 0u) ||
+      header.sourceModified != sourceModified ||
+      header.sourceSize != sourceSize ||
+      header.width <= 0 || header.height <= 0 || header.numLevels == 0 || header.numLevels > 32) {
+    return false;
+  }
+
+  out.internalFormat = getInternalFormat(format);
+  out.width = header.width;
+  out.height = header.height;
+  out.levels.resize(header.numLevels);
+  for (unsigned int i = 0; i < header.numLevels; i++) {
+    uint64_t size = 0;
+    if (!in.read((char*)&size, sizeof(size)) || size != getLevelSize(format, out.getLevelWidth(i), out.getLevelHeight(i))) {
+      out = CompressedTexture();
+      return false;
+    }
+    out.levels[i].resize(size);
+    if (!in.read((char*)&out.levels[i][0], size)) {
+      out = CompressedTexture();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool writeCompressedTexture(std::string sourceFile, CompressionFormat format, bool mipmaps, const CompressedTexture& texture) {
+  TextureCacheHeader header;
+  memcpy(header.magic, textureCacheMagic, sizeof(textureCacheMagic));
+  header.version = TEXTURE_CACHE_VERSION;
+  header.format = format;
+  header.mipmaps = mipmaps ? 1 : 0;
+  if (!getSourceStamp(sourceFile, header.sourceModified, header.sourceSize)) {
+    return false;
+  }
+  header.internalFormat = texture.internalFormat;
+  header.width = texture.width;
+  header.height = texture.height;
+  header.numLevels = texture.levels.size();
+
+  // Write beside the cache and rename over it, so a concurrent reader never sees a partial file.
+  std::string cacheFile = sourceFile + TEXTURE_CACHE_EXTENSION;
+  std::string tempFile = cacheFile + ".tmp";
+  std::ofstream out(tempFile.c_str(), std::ios::binary | std::ios::trunc);
+  if (!out) {
+    std::cerr << "Could not write " << tempFile << std::endl;
+    return false;
+  }
+  out.write((const char*)&header, sizeof(header));
+  for (unsigned int i = 0; i < texture.levels.size(); i++) {
+    uint64_t size = texture.levels[i].size();
+    out.write((const char*)&size, sizeof(size));
+    out.write((const char*)&texture.levels[i][0], size);
+  }
+  out.close();
+  if (!out || std::rename(tempFile.c_str(), cacheFile.c_str()) != 0) {
+    std::cerr << "Could not write " << cacheFile << std::endl;
+    std::remove(tempFile.c_str());
+    return false;
+  }
+  return true;
+}
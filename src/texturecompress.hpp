@@ -0,0 +1,75 @@
+#ifndef TEXTURE_COMPRESS_H
+#define TEXTURE_COMPRESS_H
+
+#include <GL/glew.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "threadpool.hpp"
+
+// Bump whenever the encoder or the file layout changes.
+#define TEXTURE_CACHE_VERSION 1
+// Appended to the source image's file name.
+#define TEXTURE_CACHE_EXTENSION ".rt2tex"
+// Block rows per parallelFor chunk.
+#define TEXTURE_COMPRESS_GRAIN_SIZE 8
+
+enum CompressionFormat {
+  // RGB, 8 bytes per 4x4 block. For colour maps.
+  COMPRESS_BC1,
+  // Two independent channels, 16 bytes per block. For normal maps, storing x
+  // and y in red and green; z = sqrt(1 - x*x - y*y).
+  COMPRESS_BC5
+};
+
+/**
+ * Block-compressed image and its mip chain, ready for glCompressedTexImage2D.
+ * Level i is max(1, width >> i) by max(1, height >> i) texels.
+ */
+struct CompressedTexture {
+  CompressedTexture(): internalFormat(0), width(0), height(0) {}
+
+  GLsizei getLevelWidth(int level) const;
+  GLsizei getLevelHeight(int level) const;
+  // Bytes across every level.
+  size_t getSize() const;
+
+  GLenum internalFormat;
+  int width;
+  int height;
+  std::vector<std::vector<unsigned char> > levels;
+};
+
+/**
+ * Encode 24-bit BGR rows, pitch bytes apart, as FreeImage stores them. With
+ * mipmaps, also encode a box-filtered chain down to 1x1; normal maps are
+ * renormalized at each level. Blocks are encoded in parallel on pool.
+ */
+void compressTexture(
+  const unsigned char* bgr,
+  int pitch,
+  int width,
+  int height,
+  CompressionFormat format,
+  bool mipmaps,
+  CompressedTexture& out,
+  ThreadPool* pool = NULL
+);
+
+/**
+ * Read the cache next to sourceFile. Fails if it is missing, damaged, from
+ * another TEXTURE_CACHE_VERSION, encoded differently, or if sourceFile has
+ * changed since.
+ */
+bool readCompressedTexture(std::string sourceFile, CompressionFormat format, bool mipmaps, CompressedTexture& out);
+
+bool writeCompressedTexture(std::string sourceFile, CompressionFormat format, bool mipmaps, const CompressedTexture& texture);
+
+/**
+ * Modification time and size of sourceFile, which caches keep to tell when
+ * they are stale.
+ */
+bool getSourceStamp(std::string sourceFile, int64_t& modified, int64_t& size);
+
+#endif
@@ -0,0 +1,111 @@
+#include <algorithm>
+
+#include "threadpool.hpp"
+
+ThreadPool::ThreadPool(int numThreads): stopping(false) {
+  for (int i = 1; i < numThreads; i++) {
+    workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  condition.notify_all();
+  for (unsigned int i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+}
+
+int ThreadPool::getDefaultNumThreads() {
+  int n = std::thread::hardware_concurrency();
+  return n > 0 ? n : 1;
+}
+
+void ThreadPool::enqueue(const std::function<void()>& task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks.push_back(task);
+  }
+  condition.notify_one();
+}
+
+bool ThreadPool::runPendingTask() {
+  std::function<void()> task;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (tasks.empty()) {
+      return false;
+    }
+    task = tasks.front();
+    tasks.pop_front();
+  }
+  task();
+  return true;
+}
+
+void ThreadPool::workerLoop() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (!stopping && tasks.empty()) {
+        condition.wait(lock);
+      }
+      if (stopping && tasks.empty()) {
+        return;
+      }
+      task = tasks.front();
+      tasks.pop_front();
+    }
+    task();
+  }
+}
+
+
+TaskGroup::TaskGroup(ThreadPool* pool): pool(pool), pending(0) {}
+
+TaskGroup::~TaskGroup() {
+  wait();
+}
+
+void TaskGroup::run(const std::function<void()>& task) {
+  if (pool == NULL) {
+    task();
+    return;
+  }
+  pending++;
+  pool->enqueue([this, task]() {
+    task();
+    pending--;
+  });
+}
+
+void TaskGroup::wait() {
+  while (pending.load() > 0) {
+    if (pool == NULL || !pool->runPendingTask()) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+
+void parallelFor(ThreadPool* pool, int begin, int end, int grainSize, const std::function<void(int, int)>& body) {
+  if (pool == NULL || end - begin <= grainSize) {
+    if (begin < end) {
+      body(begin, end);
+    }
+    return;
+  }
+
+  TaskGroup group(pool);
+  for (int chunkBegin = begin; chunkBegin < end; chunkBegin += grainSize) {
+    int chunkEnd = std::min(end, chunkBegin + grainSize);
+    group.run([&body, chunkBegin, chunkEnd]() {
+      body(chunkBegin, chunkEnd);
+    });
+  }
+  group.wait();
+}
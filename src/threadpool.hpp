@@ -0,0 +1,74 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Fixed set of worker threads pulling from one shared task queue.
+ * A pool of numThreads spawns numThreads-1 workers; the thread waiting on a
+ * TaskGroup makes up the last one by running queued tasks itself.
+ */
+class ThreadPool {
+public:
+  ThreadPool(int numThreads);
+  ~ThreadPool();
+
+  static int getDefaultNumThreads();
+
+  int getNumThreads() {
+    return workers.size() + 1;
+  }
+
+  void enqueue(const std::function<void()>& task);
+
+  /**
+   * Run one queued task on the calling thread.
+   * Returns false if the queue was empty.
+   */
+  bool runPendingTask();
+
+private:
+  void workerLoop();
+
+  std::vector<std::thread> workers;
+  std::deque<std::function<void()> > tasks;
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool stopping;
+};
+
+/**
+ * Set of tasks that can be waited on together. Tasks may add more tasks to
+ * their own group. With a NULL pool, tasks run inline.
+ */
+class TaskGroup {
+public:
+  TaskGroup(ThreadPool* pool);
+  ~TaskGroup();
+
+  void run(const std::function<void()>& task);
+
+  /**
+   * Block until every task in the group has finished, running queued
+   * tasks on this thread in the meantime.
+   */
+  void wait();
+
+private:
+  ThreadPool* pool;
+  std::atomic<int> pending;
+};
+
+/**
+ * Split [begin, end) into chunks of grainSize and run body(chunkBegin, chunkEnd)
+ * for each, in parallel when a pool is given.
+ */
+void parallelFor(ThreadPool* pool, int begin, int end, int grainSize, const std::function<void(int, int)>& body);
+
+#endif
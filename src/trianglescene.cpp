@@ -0,0 +1,278 @@
+#include <algorithm>
+#include <iostream>
+
+#include "meshopt.hpp"
+#include "trianglescene.hpp"
+
+TriangleScene::TriangleScene() {
+  bvhBuffer = new TextureBuffer(GL_RGBA32F);
+  vertexBuffer = new TextureBuffer(GL_RGBA16);
+  normalBuffer = new TextureBuffer(GL_RG16I);
+  triangleBuffer = new TextureBuffer(GL_RGBA32I);
+  instanceBVHBuffer = new SceneBuffer(GL_RGBA32F);
+  instanceBuffer = new SceneBuffer(GL_RGBA32F);
+}
+
+TriangleScene::~TriangleScene() {
+  delete bvhBuffer;
+  delete vertexBuffer;
+  delete normalBuffer;
+  delete triangleBuffer;
+  delete instanceBVHBuffer;
+  delete instanceBuffer;
+}
+
+int TriangleScene::addInstance(Mesh* mesh, const glm::mat4& transform, int materialId) {
+  std::map<Mesh*, int>::iterator it = geometryIds.find(mesh);
+  int geometry = it != geometryIds.end() ? it->second : addGeometry(mesh);
+
+  Instance instance;
+  instance.geometry = geometry;
+  instance.materialId = materialId;
+  instance.transform = transform;
+  instance.moved = false;
+  instances.push_back(instance);
+  return instances.size() - 1;
+}
+
+void TriangleScene::setInstanceTransform(int instanceIdx, const glm::mat4& transform) {
+  Instance& instance = instances[instanceIdx];
+  if (instance.transform != transform) {
+    instance.transform = transform;
+    instance.moved = true;
+  }
+}
+
+int TriangleScene::addGeometry(Mesh* mesh) {
+  const std::vector<glm::vec3>& meshVertices = mesh->getVertices();
+  const std::vector<glm::vec3>& meshNormals = mesh->getNormals();
+  const std::vector<unsigned int>& meshIndices = mesh->getIndices();
+
+  Geometry geometry;
+  geometry.mesh = mesh;
+  geometry.firstVertex = vertices.size();
+  geometry.numVertices = meshVertices.size();
+  geometry.firstTriangle = triangles.size();
+  geometry.numTriangles = meshIndices.size() / 3;
+  geometry.rootNode = 0;
+
+  for (unsigned int i = 0; i < meshVertices.size(); i++) {
+    vertices.push_back(glm::vec4(meshVertices[i], 1));
+    geometry.bounds.grow(meshVertices[i]);
+  }
+  geometry.positionOffset = meshVertices.empty() ? glm::vec3(0) : geometry.bounds.min;
+  geometry.positionScale = meshVertices.empty() ? glm::vec3(0) : geometry.bounds.max - geometry.bounds.min;
+
+  // Fall back to area-weighted face normals when the mesh has none.
+  std::vector<glm::vec3> faceNormals;
+  if (meshNormals.size() < meshVertices.size()) {
+    faceNormals.resize(meshVertices.size(), glm::vec3(0));
+    for (unsigned int face = 0; face*3 + 2 < meshIndices.size(); face++) {
+      const glm::vec3& p0 = meshVertices[meshIndices[face*3]];
+      const glm::vec3& p1 = meshVertices[meshIndices[face*3+1]];
+      const glm::vec3& p2 = meshVertices[meshIndices[face*3+2]];
+      glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+      for (unsigned int v = 0; v < 3; v++) {
+        faceNormals[meshIndices[face*3+v]] += n;
+      }
+    }
+  }
+  const std::vector<glm::vec3>& vertexNormals = faceNormals.empty() ? meshNormals : faceNormals;
+  for (unsigned int i = 0; i < meshVertices.size(); i++) {
+    float len = glm::length(vertexNormals[i]);
+    normals.push_back(glm::vec4(len > 0 ? vertexNormals[i] / len : vertexNormals[i], 0));
+  }
+
+  for (int face = 0; face < geometry.numTriangles; face++) {
+    triangles.push_back(glm::ivec4(
+      geometry.firstVertex + meshIndices[face*3],
+      geometry.firstVertex + meshIndices[face*3+1],
+      geometry.firstVertex + meshIndices[face*3+2],
+      0
+    ));
+  }
+
+  geometries.push_back(geometry);
+  geometryIds[mesh] = geometries.size() - 1;
+  return geometries.size() - 1;
+}
+
+AABB TriangleScene::getInstanceBounds(const Instance& instance) {
+  const AABB& local = geometries[instance.geometry].bounds;
+  AABB bounds;
+  if (local.min.x > local.max.x) {
+    return bounds;
+  }
+  for (int corner = 0; corner < 8; corner++) {
+    glm::vec3 p(
+      corner & 1 ? local.max.x : local.min.x,
+      corner & 2 ? local.max.y : local.min.y,
+      corner & 4 ? local.max.z : local.min.z
+    );
+    bounds.grow(glm::vec3(instance.transform * glm::vec4(p, 1)));
+  }
+  return bounds;
+}
+
+TriangleScene::InstanceData TriangleScene::packInstance(const Instance& instance) {
+  // Rows of the affine world-to-object matrix, so the shader can transform with dot products.
+  glm::mat4 worldToObject = glm::transpose(glm::inverse(instance.transform));
+  InstanceData data;
+  for (int row = 0; row < 3; row++) {
+    data.worldToObject[row] = worldToObject[row];
+  }
+  data.rootNode = geometries[instance.geometry].rootNode;
+  data.materialId = instance.materialId;
+  data.padding[0] = 0;
+  data.padding[1] = 0;
+  data.positionOffset = glm::vec4(geometries[instance.geometry].positionOffset, 0);
+  data.positionScale = glm::vec4(geometries[instance.geometry].positionScale, 0);
+  return data;
+}
+
+void TriangleScene::build(ThreadPool* pool) {
+  // Bottom level: one BVH per geometry, appended to a shared node buffer.
+  bvhNodes.clear();
+  for (unsigned int g = 0; g < geometries.size(); g++) {
+    Geometry& geometry = geometries[g];
+    // Meshes from loadScene() come with their BVH already built.
+    const BVH* bvh = &geometry.mesh->getBVH();
+    BVH builtBVH;
+    if (bvh->getNumNodes() == 0 || (int)bvh->getPrimitiveIndices().size() != geometry.numTriangles) {
+      std::vector<AABB> triangleBounds(geometry.numTriangles);
+      for (int i = 0; i < geometry.numTriangles; i++) {
+        const glm::ivec4& tri = triangles[geometry.firstTriangle + i];
+        triangleBounds[i].grow(glm::vec3(vertices[tri.x]));
+        triangleBounds[i].grow(glm::vec3(vertices[tri.y]));
+        triangleBounds[i].grow(glm::vec3(vertices[tri.z]));
+      }
+      builtBVH.build(triangleBounds, pool);
+      bvh = &builtBVH;
+    }
+
+    // Reorder triangles so each leaf references a contiguous range.
+    const std::vector<int>& order = bvh->getPrimitiveIndices();
+    std::vector<glm::ivec4> orderedTriangles(order.size());
+    for (unsigned int i = 0; i < order.size(); i++) {
+      orderedTriangles[i] = triangles[geometry.firstTriangle + order[i]];
+    }
+
+    // Renumber vertices in leaf order too, so neighbouring triangles fetch neighbouring texels.
+    std::vector<unsigned int> localIndices(3 * order.size());
+    for (unsigned int i = 0; i < order.size(); i++) {
+      for (int c = 0; c < 3; c++) {
+        localIndices[3*i + c] = orderedTriangles[i][c] - geometry.firstVertex;
+      }
+    }
+    std::vector<unsigned int> remap = optimizeVertexFetch(localIndices, geometry.numVertices);
+    for (unsigned int i = 0; i < order.size(); i++) {
+      for (int c = 0; c < 3; c++) {
+        orderedTriangles[i][c] = geometry.firstVertex + localIndices[3*i + c];
+      }
+    }
+    std::vector<glm::vec4>::iterator firstVertex = vertices.begin() + geometry.firstVertex;
+    std::vector<glm::vec4>::iterator firstNormal = normals.begin() + geometry.firstVertex;
+    std::vector<glm::vec4> geometryVertices(firstVertex, firstVertex + geometry.numVertices);
+    std::vector<glm::vec4> geometryNormals(firstNormal, firstNormal + geometry.numVertices);
+    remapVertices(geometryVertices, remap);
+    remapVertices(geometryNormals, remap);
+    std::copy(geometryVertices.begin(), geometryVertices.end(), firstVertex);
+    std::copy(geometryNormals.begin(), geometryNormals.end(), firstNormal);
+    std::copy(orderedTriangles.begin(), orderedTriangles.end(), triangles.begin() + geometry.firstTriangle);
+
+    if (geometry.numTriangles == 0) {
+      // The shader skips instances without a root.
+      geometry.rootNode = -1;
+      continue;
+    }
+    geometry.rootNode = bvhNodes.size();
+    // Quantized positions lie within half a step of the originals the BVH was built over.
+    glm::vec3 quantizationStep = geometry.positionScale / 65535.0f;
+    const std::vector<BVHNode>& nodes = bvh->getNodes();
+    for (unsigned int i = 0; i < nodes.size(); i++) {
+      BVHNode node = nodes[i];
+      node.leftFirst += node.isLeaf() ? geometry.firstTriangle : geometry.rootNode;
+      node.min -= quantizationStep;
+      node.max += quantizationStep;
+      bvhNodes.push_back(node);
+    }
+  }
+
+  // Pack vertices in their final order.
+  std::vector<uint16_t> packedVertices(4 * vertices.size(), 0);
+  std::vector<int16_t> packedNormals(2 * normals.size());
+  for (unsigned int g = 0; g < geometries.size(); g++) {
+    const Geometry& geometry = geometries[g];
+    for (int i = geometry.firstVertex; i < geometry.firstVertex + geometry.numVertices; i++) {
+      quantizePosition(glm::vec3(vertices[i]), geometry.positionOffset, geometry.positionScale, &packedVertices[4*i]);
+      octEncode(glm::vec3(normals[i]), &packedNormals[2*i]);
+    }
+  }
+
+  // Top level, over instances in world space.
+  instanceBounds.resize(instances.size());
+  for (unsigned int i = 0; i < instances.size(); i++) {
+    instanceBounds[i] = getInstanceBounds(instances[i]);
+    instances[i].moved = false;
+  }
+  instanceBVH.build(instanceBounds, pool);
+
+  const std::vector<int>& instanceOrder = instanceBVH.getPrimitiveIndices();
+  orderedInstances.resize(instances.size());
+  for (unsigned int i = 0; i < instanceOrder.size(); i++) {
+    orderedInstances[i] = packInstance(instances[instanceOrder[i]]);
+  }
+
+  bvhBuffer->setData(bvhNodes.empty() ? NULL : &bvhNodes[0], bvhNodes.size() * sizeof(BVHNode));
+  vertexBuffer->setData(packedVertices.empty() ? NULL : &packedVertices[0], packedVertices.size() * sizeof(uint16_t));
+  normalBuffer->setData(packedNormals.empty() ? NULL : &packedNormals[0], packedNormals.size() * sizeof(int16_t));
+  triangleBuffer->setData(triangles.empty() ? NULL : &triangles[0], triangles.size() * sizeof(glm::ivec4));
+  instanceBVHBuffer->setData(&instanceBVH.getNodes()[0], instanceBVH.getNumNodes() * sizeof(BVHNode));
+  instanceBuffer->setData(orderedInstances.empty() ? NULL : &orderedInstances[0], orderedInstances.size() * sizeof(InstanceData));
+
+  std::cout << "Triangle BVH: " << triangles.size() << " triangles in " << geometries.size() << " meshes, "
+    << bvhNodes.size() << " nodes; " << instances.size() << " instances, " << instanceBVH.getNumNodes() << " nodes" << std::endl;
+  size_t fullVertexMemory = (vertices.size() + normals.size()) * sizeof(glm::vec4);
+  size_t vertexMemory = packedVertices.size() * sizeof(uint16_t) + packedNormals.size() * sizeof(int16_t);
+  std::cout << "Triangle vertices: " << vertexMemory / 1024 << " KB, down from " << fullVertexMemory / 1024
+    << " KB at full precision" << std::endl;
+}
+
+bool TriangleScene::update(ThreadPool* pool) {
+  std::vector<int> movedInstances;
+  for (unsigned int i = 0; i < instances.size(); i++) {
+    if (instances[i].moved) {
+      instanceBounds[i] = getInstanceBounds(instances[i]);
+      instances[i].moved = false;
+      movedInstances.push_back(i);
+    }
+  }
+  if (movedInstances.empty()) {
+    return false;
+  }
+
+  int oldNumNodes = instanceBVH.getNumNodes();
+  instanceBVH.refit(instanceBounds, movedInstances, pool);
+
+  // Covers both moved instances and any reordered by a subtree rebuild.
+  const std::vector<int>& instanceOrder = instanceBVH.getPrimitiveIndices();
+  const std::vector<IndexRange>& slotRanges = instanceBVH.getDirtyPrimitiveRanges();
+  for (unsigned int r = 0; r < slotRanges.size(); r++) {
+    const IndexRange& range = slotRanges[r];
+    for (int i = range.begin; i < range.end; i++) {
+      orderedInstances[i] = packInstance(instances[instanceOrder[i]]);
+    }
+    instanceBuffer->update(range.begin * sizeof(InstanceData), range.size() * sizeof(InstanceData), &orderedInstances[range.begin]);
+  }
+
+  const std::vector<BVHNode>& nodes = instanceBVH.getNodes();
+  if (instanceBVH.getNumNodes() != oldNumNodes) {
+    instanceBVHBuffer->setData(&nodes[0], nodes.size() * sizeof(BVHNode));
+    return true;
+  }
+  const std::vector<IndexRange>& nodeRanges = instanceBVH.getDirtyNodeRanges();
+  for (unsigned int r = 0; r < nodeRanges.size(); r++) {
+    instanceBVHBuffer->update(nodeRanges[r].begin * sizeof(BVHNode), nodeRanges[r].size() * sizeof(BVHNode), &nodes[nodeRanges[r].begin]);
+  }
+  return true;
+}
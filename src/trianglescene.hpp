@@ -0,0 +1,150 @@
+#ifndef TRIANGLE_SCENE_H
+#define TRIANGLE_SCENE_H
+
+#include <map>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "bvh.hpp"
+#include "mesh.hpp"
+#include "scenebuffer.hpp"
+#include "texture.hpp"
+
+/**
+ * Two-level acceleration structure over instanced Meshes.
+ *
+ * Each unique Mesh is stored once in object space with its own bottom-level
+ * BVH. A top-level BVH over instances holds a transform per instance, so
+ * memory scales with unique geometry and moving an instance only refits the
+ * top level. Packed into texture buffers for raytrace.frag:
+ *   triangleVertices - RGBA16, one position per texel, quantized over the
+ *                      bounds of its mesh (see quantizePosition()), w unused.
+ *   triangleNormals  - RG16I, one object-space normal per texel, octahedral
+ *                      encoded (see octEncode()).
+ *   triangles        - RGBA32I, (vertex0, vertex1, vertex2, 0).
+ *   triangleBVH      - RGBA32F, every bottom-level BVH, two texels per BVHNode,
+ *                      with child and triangle indices rebased into the shared
+ *                      buffers, and grown to cover the quantized positions.
+ *   instanceBVH      - RGBA32F, top-level BVH, two texels per BVHNode.
+ *   instances        - RGBA32F, six texels per instance in instanceBVH leaf
+ *                      order: the rows of the world-to-object matrix, then
+ *                      (root node, materialId, 0, 0) as int bits, then the
+ *                      mesh's position offset and scale.
+ */
+class TriangleScene {
+public:
+  TriangleScene();
+  ~TriangleScene();
+
+  /**
+   * Add an instance of mesh placed by transform. Instances of the same Mesh
+   * share its geometry and bottom-level BVH. Returns the instance index.
+   */
+  int addInstance(Mesh* mesh, const glm::mat4& transform, int materialId);
+
+  /**
+   * Move an instance. Takes effect on the next update().
+   */
+  void setInstanceTransform(int instanceIdx, const glm::mat4& transform);
+
+  /**
+   * Build every BVH and upload everything added so far.
+   */
+  void build(ThreadPool* pool = NULL);
+
+  /**
+   * Refit the top-level BVH around instances moved since the last build or
+   * update, and upload only the ranges that changed. Returns whether any had.
+   */
+  bool update(ThreadPool* pool = NULL);
+
+  int getNumTriangles() {
+    return triangles.size();
+  }
+
+  int getNumInstances() {
+    return instances.size();
+  }
+
+  TextureBuffer* getBVHBuffer() {
+    return bvhBuffer;
+  }
+  TextureBuffer* getVertexBuffer() {
+    return vertexBuffer;
+  }
+  TextureBuffer* getNormalBuffer() {
+    return normalBuffer;
+  }
+  TextureBuffer* getTriangleBuffer() {
+    return triangleBuffer;
+  }
+  SceneBuffer* getInstanceBVHBuffer() {
+    return instanceBVHBuffer;
+  }
+  SceneBuffer* getInstanceBuffer() {
+    return instanceBuffer;
+  }
+
+private:
+  struct Geometry {
+    Mesh* mesh;
+    int firstVertex;
+    int numVertices;
+    int firstTriangle;
+    int numTriangles;
+    // Root of this geometry's BVH within bvhNodes.
+    int rootNode;
+    AABB bounds;
+    // Positions decode as positionOffset + quantized / 65535 * positionScale.
+    glm::vec3 positionOffset;
+    glm::vec3 positionScale;
+  };
+
+  struct Instance {
+    int geometry;
+    int materialId;
+    glm::mat4 transform;
+    bool moved;
+  };
+
+  /**
+   * Matches the instances texture buffer layout.
+   */
+  struct InstanceData {
+    glm::vec4 worldToObject[3];
+    int32_t rootNode;
+    int32_t materialId;
+    int32_t padding[2];
+    glm::vec4 positionOffset;
+    glm::vec4 positionScale;
+  };
+
+  int addGeometry(Mesh* mesh);
+  AABB getInstanceBounds(const Instance& instance);
+  InstanceData packInstance(const Instance& instance);
+
+  std::map<Mesh*, int> geometryIds;
+  std::vector<Geometry> geometries;
+  std::vector<Instance> instances;
+
+  // Full precision, packed by build().
+  std::vector<glm::vec4> vertices;
+  std::vector<glm::vec4> normals;
+  // Triangles in the order they were added, reordered into bottom-level leaf order by build().
+  std::vector<glm::ivec4> triangles;
+  std::vector<BVHNode> bvhNodes;
+
+  BVH instanceBVH;
+  std::vector<AABB> instanceBounds;
+  // Instances in instanceBVH leaf order, as uploaded.
+  std::vector<InstanceData> orderedInstances;
+
+  TextureBuffer* bvhBuffer;
+  TextureBuffer* vertexBuffer;
+  TextureBuffer* normalBuffer;
+  TextureBuffer* triangleBuffer;
+  SceneBuffer* instanceBVHBuffer;
+  SceneBuffer* instanceBuffer;
+};
+
+#endif
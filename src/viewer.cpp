@@ -5,6 +5,10 @@
 #include <iomanip>
 #include <ctime>
 #include <cmath>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <thread>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -13,6 +17,9 @@
 #include "shader.hpp"
 #include "mesh.hpp"
 #include "sound.hpp"
+#include "trianglescene.hpp"
+#include "lightgrid.hpp"
+#include "shadercache.hpp"
 
 #include "viewer.hpp"
 #include "controller.hpp"
@@ -20,11 +27,39 @@
 #define MIN_REQUIRED_COLOUR_ATTACHMENTS 6
 #define RENDER_DEBUG_IMAGES false
 #define TARGET_FPS 60
-#define TARGET_FRAME_DELTA 0.01666667
+#define TARGET_FRAME_DELTA (1.0 / TARGET_FPS)
 #define FPS_SAMPLE_RATE 20
-
-// TODO.
-#define NUM_SPHERES 3
+#define MATERIAL_FLOATS 16
+// Meshes this far away only need their textures' second mip, twice as far the third, and so on.
+#define TEXTURE_DETAIL_DISTANCE 20.0f
+// Samples a still view accumulates at most.
+#define ACCUMULATION_MAX_SAMPLES 256
+// Fewer samples give too rough a variance estimate to stop on.
+#define ACCUMULATION_MIN_SAMPLES 16
+// Samples between convergence checks, each of which reads back one float.
+#define ACCUMULATION_CHECK_INTERVAL 8
+// A pixel has converged once the standard error of its mean luminance is under half an 8 bit step.
+#define ACCUMULATION_ERROR_TARGET (0.5f / 255)
+// Accumulation stops once no more than this fraction of pixels has yet to converge.
+#define ACCUMULATION_UNCONVERGED_FRACTION 0.001f
+// Share of TARGET_FRAME_DELTA the ray traced pass may take on the GPU, leaving the rest for everything else.
+#define RESOLUTION_GPU_SHARE 0.8
+// Smallest fraction of the window's width and height to ray trace at.
+#define RESOLUTION_MIN_SCALE 0.25f
+// How far each frame moves the scale towards the one that would exactly meet the budget.
+#define RESOLUTION_ADAPT_RATE 0.2f
+// Must match the definitions in shaders/wavefront/common.glsl and MAX_DEPTH in shaders/scene.glsl.
+#define WAVEFRONT_GROUP_SIZE 64
+#define WAVEFRONT_TILE_SIZE 8
+#define WAVEFRONT_MAX_BOUNCES 10
+// Layout of the Counters block: four uints, then the indirect dispatch sizes for paths and shadow rays.
+#define WAVEFRONT_COUNTER_WORDS 12
+#define WAVEFRONT_PATH_GROUPS_OFFSET 16
+#define WAVEFRONT_SHADOW_GROUPS_OFFSET 32
+// Bytes per PathState, PathHit and ShadowRay.
+#define WAVEFRONT_PATH_BYTES 48
+#define WAVEFRONT_HIT_BYTES 32
+#define WAVEFRONT_SHADOW_RAY_BYTES 48
 
 void window_size_callback(GLFWwindow* window, int width, int height) {
   Viewer* viewer = (Viewer*)glfwGetWindowUserPointer(window);
@@ -48,6 +83,58 @@ bool checkGLErrors(std::string msg) {
   return true;
 }
 
+/**
+ * Point each scene sampler of a program at its fixed texture unit.
+ */
+static void setSamplerUnits(GLuint programId) {
+  const char* samplerNames[] = {
+    "skyboxTexture",
+    "sphereBVH",
+    "triangleBVH",
+    "triangleVertices",
+    "triangleNormals",
+    "triangles",
+    "spheres",
+    "sphereMaterials",
+    "materials",
+    "lights",
+    "instanceBVH",
+    "instances",
+    "irradianceTexture",
+    "historyColour",
+    "historyHits",
+    "lightGrid",
+  };
+  glUseProgram(programId);
+  for (unsigned int i = 0; i < sizeof(samplerNames)/sizeof(const char*); i++) {
+    glUniform1i(glGetUniformLocation(programId, samplerNames[i]), i);
+  }
+}
+
+// Compute shaders of the wavefront pipeline, in the order of its program ids in Viewer.
+#define WAVEFRONT_STAGES 6
+static const char* wavefrontShaderPaths[WAVEFRONT_STAGES] = {
+  "shaders/wavefront/generate.comp",
+  "shaders/wavefront/extend.comp",
+  "shaders/wavefront/shade.comp",
+  "shaders/wavefront/shadow.comp",
+  "shaders/wavefront/dispatch.comp",
+  "shaders/wavefront/accumulate.comp",
+};
+
+/**
+ * Radical inverse of index in base, the index'th point of a Halton sequence in [0, 1).
+ */
+static float halton(int index, int base) {
+  float result = 0;
+  float digitWeight = 1.0f / base;
+  for (; index > 0; index /= base) {
+    result += (index % base) * digitWeight;
+    digitWeight /= base;
+  }
+  return result;
+}
+
 bool checkGLFramebuffer() {
   GLenum frameBufferStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
   if (frameBufferStatus != GL_FRAMEBUFFER_COMPLETE) {
@@ -57,7 +144,7 @@ bool checkGLFramebuffer() {
   return true;
 }
 
-Viewer::Viewer(): width(DEFAULT_WIDTH), height(DEFAULT_HEIGHT) {
+Viewer::Viewer(): width(DEFAULT_WIDTH), height(DEFAULT_HEIGHT), threadPool(NULL), currentAccumulation(0), historyValid(false), temporalFrame(0), previousRenderWidth(0), previousRenderHeight(0), convergenceFBO(0), convergenceTexture(0), accumulatedSamples(0), accumulationConverged(false), renderScale(1), renderWidth(DEFAULT_WIDTH), renderHeight(DEFAULT_HEIGHT), gpuTimePerPixel(0), timerQueryIdx(0), wavefrontSupported(false), usingWavefront(false), samplingLights(false), sphereBVHBuffer(NULL), sphereBuffer(NULL), sphereMaterialBuffer(NULL), triangleScene(NULL), materialBuffer(NULL), lightGrid(NULL), shaderCache(NULL) {
   glfwWindowHint(GLFW_SAMPLES, 4);
   glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
   glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
@@ -89,9 +176,137 @@ void Viewer::updateSize(int width, int height) {
 
   glBindRenderbuffer(GL_RENDERBUFFER, depthRenderBuffer);
   glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, width, height);
+
+  setRenderScale(renderScale);
+  if (convergenceFBO != 0) {
+    createAccumulationTargets();
+  }
+}
+
+void Viewer::setRenderScale(float scale) {
+  renderScale = std::min(std::max(scale, RESOLUTION_MIN_SCALE), 1.0f);
+  renderWidth = std::max(1, (int)ceil(width * renderScale));
+  renderHeight = std::max(1, (int)ceil(height * renderScale));
 }
 
-bool Viewer::initialize() {
+void Viewer::updateRenderScale() {
+  // Read back the oldest query, issued RESOLUTION_TIMER_QUERIES frames ago.
+  // If even that isn't done, the GPU is far behind and the last estimate stands.
+  if (timerQueryPixels[timerQueryIdx] > 0) {
+    GLint available = GL_FALSE;
+    glGetQueryObjectiv(timerQueries[timerQueryIdx], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (available == GL_TRUE) {
+      GLuint64 elapsed = 0;
+      glGetQueryObjectui64v(timerQueries[timerQueryIdx], GL_QUERY_RESULT, &elapsed);
+      gpuTimePerPixel = elapsed * 1e-9 / timerQueryPixels[timerQueryIdx];
+    }
+  }
+
+  // Time per pixel hardly depends on the scale, so it predicts the pixel
+  // count that fits the budget even from frames traced at another scale.
+  if (gpuTimePerPixel > 0) {
+    double budgetPixels = TARGET_FRAME_DELTA * RESOLUTION_GPU_SHARE / gpuTimePerPixel;
+    float wantedScale = sqrt(budgetPixels / ((double)width * height));
+    setRenderScale(renderScale + (wantedScale - renderScale) * RESOLUTION_ADAPT_RATE);
+  }
+}
+
+void Viewer::createAccumulationTargets() {
+  if (convergenceFBO == 0) {
+    glGenFramebuffers(2, accumulationFBOs);
+    glGenTextures(2, accumulationTextures);
+    glGenTextures(2, hitTextures);
+    glGenFramebuffers(1, &convergenceFBO);
+    glGenTextures(1, &convergenceTexture);
+  }
+
+  for (int i = 0; i < 2; i++) {
+    GLuint textures[] = {accumulationTextures[i], hitTextures[i]};
+    glBindFramebuffer(GL_FRAMEBUFFER, accumulationFBOs[i]);
+    for (int j = 0; j < 2; j++) {
+      glBindTexture(GL_TEXTURE_2D, textures[j]);
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + j, GL_TEXTURE_2D, textures[j], 0);
+    }
+    checkGLFramebuffer();
+  }
+
+  // Mipmapped, so averaging it down to 1x1 counts the pixels still converging.
+  glBindTexture(GL_TEXTURE_2D, convergenceTexture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, width, height, 0, GL_RED, GL_FLOAT, NULL);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glGenerateMipmap(GL_TEXTURE_2D);
+  glBindFramebuffer(GL_FRAMEBUFFER, convergenceFBO);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, convergenceTexture, 0);
+  checkGLFramebuffer();
+
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  resetAccumulation();
+  historyValid = false;
+
+  if (wavefrontSupported) {
+    createWavefrontBuffers();
+  }
+}
+
+bool Viewer::initializeWavefront() {
+  wavefrontSupported = false;
+  if (!GLEW_VERSION_4_3) {
+    std::cerr << "No OpenGL 4.3, so rays are traced in a fragment shader" << std::endl;
+    return false;
+  }
+
+  GLuint* programIds[] = {
+    &wavefrontGenerateProgramId,
+    &wavefrontExtendProgramId,
+    &wavefrontShadeProgramId,
+    &wavefrontShadowProgramId,
+    &wavefrontDispatchProgramId,
+    &wavefrontAccumulateProgramId,
+  };
+  for (int i = 0; i < WAVEFRONT_STAGES; i++) {
+    *programIds[i] = loadComputeShader(wavefrontShaderPaths[i]);
+    if (*programIds[i] == 0) {
+      std::cerr << "Wavefront shaders failed to build, so rays are traced in a fragment shader" << std::endl;
+      return false;
+    }
+    setSamplerUnits(*programIds[i]);
+  }
+
+  glGenBuffers(1, &wavefrontCounterBuffer);
+  glGenBuffers(2, wavefrontPathBuffers);
+  glGenBuffers(1, &wavefrontHitBuffer);
+  glGenBuffers(1, &wavefrontShadowRayBuffer);
+  glGenBuffers(1, &wavefrontRadianceBuffer);
+  wavefrontSupported = true;
+  createWavefrontBuffers();
+  return checkGLErrors("initializeWavefront");
+}
+
+void Viewer::createWavefrontBuffers() {
+  // Room for a path from every pixel of the window, whatever the render scale.
+  GLsizeiptr numPixels = (GLsizeiptr)width * height;
+  GLsizeiptr numShadowRays = numPixels * std::max(lightGrid->getMaxLightsNear(), LIGHT_TREE_SAMPLES);
+
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, wavefrontCounterBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, WAVEFRONT_COUNTER_WORDS * sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+  for (int i = 0; i < 2; i++) {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, wavefrontPathBuffers[i]);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, numPixels * WAVEFRONT_PATH_BYTES, NULL, GL_DYNAMIC_COPY);
+  }
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, wavefrontHitBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, numPixels * WAVEFRONT_HIT_BYTES, NULL, GL_DYNAMIC_COPY);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, wavefrontShadowRayBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, numShadowRays * WAVEFRONT_SHADOW_RAY_BYTES, NULL, GL_DYNAMIC_COPY);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, wavefrontRadianceBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, numPixels * 3 * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+bool Viewer::initialize(std::string modelFile, bool animate) {
   // Initialize OpenAL.
   if (!Sound::initialize()) {
     std::cerr << "Couldn't initialize OpenAL" << std::endl;
@@ -100,6 +315,8 @@ bool Viewer::initialize() {
 
   settings = new Settings();
   controller = new Controller(this, settings);
+  controller->setAnimating(animate);
+  threadPool = new ThreadPool(ThreadPool::getDefaultNumThreads());
 
   // Initial settings (all start on).
   settings->set(Settings::SSAO, false);
@@ -124,10 +341,6 @@ bool Viewer::initialize() {
     std::cerr << "Only " << maxAttachments << " supported FBO Colour Attachments, but this program requires " << MIN_REQUIRED_COLOUR_ATTACHMENTS << std::endl;
   }
 
-  GLint maxUniformBlockSize;
-  glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &maxUniformBlockSize);
-  std::cerr << "Max uniform block size: " << maxUniformBlockSize << std::endl;
-
 
   // Initialize textures.
   Texture::initialize();
@@ -140,7 +353,7 @@ bool Viewer::initialize() {
     , "textures/NiagaraFalls2/posz.jpg"
     , "textures/NiagaraFalls2/negz.jpg"
     };
-  skybox = TextureCube::loadOrGet(texture_paths);
+  skybox = TextureCube::loadOrGet(texture_paths, threadPool);
   checkGLErrors("dksljfd");
 
   glGenVertexArrays(1, &vertexArrayId);
@@ -161,52 +374,70 @@ bool Viewer::initialize() {
   glBufferData(GL_ARRAY_BUFFER, sizeof(quadVBuffer), quadVBuffer, GL_STATIC_DRAW);
 
 
-  // Compile GLSL programs.
+  // Compile GLSL programs. The ray tracing ones are replaced by versions
+  // specialized for the settings and scene once those have compiled.
+  shaderCache = new ShaderCache(window);
   raytraceProgramId = loadShaders("shaders/raytrace.vert", "shaders/raytrace.frag");
 
   if (raytraceProgramId == 0) {
     return false;
   }
 
+  // Both only read a texture under the quad, which raytrace.vert passes through.
+  presentProgramId = loadShaders("shaders/raytrace.vert", "shaders/present.frag");
+  varianceProgramId = loadShaders("shaders/raytrace.vert", "shaders/variance.frag");
+  if (presentProgramId == 0 || varianceProgramId == 0) {
+    return false;
+  }
+
+  glGenQueries(RESOLUTION_TIMER_QUERIES, timerQueries);
+  for (int i = 0; i < RESOLUTION_TIMER_QUERIES; i++) {
+    timerQueryPixels[i] = 0;
+  }
+  setRenderScale(renderScale);
+  createAccumulationTargets();
+
   // Scene-specific setup:
   glm::vec3 startPosition(0, 0, 0);
   controller->setHorizontalAngle(0);
   controller->setPosition(startPosition);
 
   // Create scene.
-  // Uniform buffer Objects.
-  glGenBuffers(1, &sphereUBO);
-  glGenBuffers(1, &materialUBO);
-  glGenBuffers(1, &lightUBO);
-
-  GLfloat spheres[8*NUM_SPHERES] = {
-    0, 0, 3,
-    1,
-    glm::intBitsToFloat(0),
-    0, 0, 0,
-
-    2, 0.2, 15,
-    5,
-    glm::intBitsToFloat(1),
-    0, 0, 0,
-
-    -3, 5, 10,
-    3,
-    glm::intBitsToFloat(2),
-    0, 0, 0
-
-    /*
-    0, -10000 - 8, 0,
-    10000,
-    glm::intBitsToFloat(0),
-    0, 0, 0
-    */
+  // Scene data lives in texture buffers, so its size is only limited by GL_MAX_TEXTURE_BUFFER_SIZE.
+  glm::vec4 initialSpheres[] = {
+    glm::vec4(0, 0, 3, 1),
+    glm::vec4(2, 0.2, 15, 5),
+    glm::vec4(-3, 5, 10, 3),
+    //glm::vec4(0, -10000 - 8, 0, 10000),
   };
-  sphereBlockId = glGetUniformBlockIndex(raytraceProgramId, "SphereBlock");
-  glUniformBlockBinding(raytraceProgramId, sphereBlockId, 0);
-  glBindBuffer(GL_UNIFORM_BUFFER, sphereUBO);
-  glBufferData(GL_UNIFORM_BUFFER, 819*sizeof(GLfloat), NULL, GL_DYNAMIC_DRAW);
-  glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(spheres), spheres);
+  GLint initialSphereMaterials[] = {0, 1, 2};
+  int numSceneSpheres = sizeof(initialSpheres)/sizeof(glm::vec4);
+  sceneSpheres.assign(initialSpheres, initialSpheres + numSceneSpheres);
+  sceneSphereMaterials.assign(initialSphereMaterials, initialSphereMaterials + numSceneSpheres);
+
+  // Build the sphere BVH and reorder spheres so each leaf references a contiguous range.
+  sphereBounds.clear();
+  for (unsigned int i = 0; i < sceneSpheres.size(); i++) {
+    glm::vec3 center(sceneSpheres[i]);
+    glm::vec3 r(sceneSpheres[i].w);
+    sphereBounds.push_back(AABB(center - r, center + r));
+  }
+  sphereBVH.build(sphereBounds, threadPool);
+
+  const std::vector<int>& sphereOrder = sphereBVH.getPrimitiveIndices();
+  spheres.clear();
+  sphereMaterials.clear();
+  for (unsigned int i = 0; i < sphereOrder.size(); i++) {
+    spheres.push_back(sceneSpheres[sphereOrder[i]]);
+    sphereMaterials.push_back(sceneSphereMaterials[sphereOrder[i]]);
+  }
+
+  sphereBVHBuffer = new SceneBuffer(GL_RGBA32F);
+  sphereBVHBuffer->setData(&sphereBVH.getNodes()[0], sphereBVH.getNumNodes() * sizeof(BVHNode));
+  sphereBuffer = new SceneBuffer(GL_RGBA32F);
+  sphereBuffer->setData(spheres.empty() ? NULL : &spheres[0], spheres.size() * sizeof(glm::vec4));
+  sphereMaterialBuffer = new SceneBuffer(GL_R32I);
+  sphereMaterialBuffer->setData(sphereMaterials.empty() ? NULL : &sphereMaterials[0], sphereMaterials.size() * sizeof(GLint));
 
   GLfloat materials[] = {
     0, 0, 0, // ke.
@@ -236,28 +467,76 @@ bool Viewer::initialize() {
     0.3, 0.3, 0.3,
     75,
   };
-  materialBlockId = glGetUniformBlockIndex(raytraceProgramId, "MaterialBlock");
-  glUniformBlockBinding(raytraceProgramId, materialBlockId, 1);
-  glBindBuffer(GL_UNIFORM_BUFFER, materialUBO);
-  glBufferData(GL_UNIFORM_BUFFER, sizeof(materials), materials, GL_DYNAMIC_DRAW);
+  std::vector<GLfloat> materialData(materials, materials + sizeof(materials)/sizeof(GLfloat));
 
-  GLfloat lights[] = {
-    2, 0, -5, 0,
-    0.8, 0.8, 0.8, 0,
+  // Triangle meshes. Each distinct Material is appended to the material buffer.
+  triangleScene = new TriangleScene();
+  if (modelFile != "") {
+    meshes = loadScene(modelFile, false, LOAD_MORTON_ORDER | LOAD_OPTIMIZE_VERTEX_CACHE, threadPool);
+  }
+  std::map<Material*, int> meshMaterialIds;
+  for (unsigned int i = 0; i < meshes.size(); i++) {
+    Material* material = meshes[i]->getMaterial();
+    int materialId = 0;
+    if (material != NULL) {
+      if (meshMaterialIds.find(material) == meshMaterialIds.end()) {
+        meshMaterialIds[material] = materialData.size() / MATERIAL_FLOATS;
+        const glm::vec3& ke = material->getEmissive();
+        const glm::vec3& ka = material->getAmbience();
+        const glm::vec3& kd = material->getDiffuse();
+        const glm::vec3& ks = material->getSpecular();
+        GLfloat m[MATERIAL_FLOATS] = {
+          ke.x, ke.y, ke.z,
+          0, // No refraction.
+          ka.x, ka.y, ka.z,
+          1,
+          kd.x, kd.y, kd.z,
+          0, // No mirror.
+          ks.x, ks.y, ks.z,
+          material->getShininess()
+        };
+        materialData.insert(materialData.end(), m, m + MATERIAL_FLOATS);
+      }
+      materialId = meshMaterialIds[material];
+    }
+    meshInstances.push_back(triangleScene->addInstance(meshes[i], meshes[i]->getModelMatrix(), materialId));
+  }
+  triangleScene->build(threadPool);
+
+  materialBuffer = new SceneBuffer(GL_RGBA32F);
+  materialBuffer->setData(&materialData[0], materialData.size() * sizeof(GLfloat));
+
+  lights.push_back(Light::pointLight(glm::vec3(0.8, 0.8, 0.8), glm::vec3(2, 0, -5)));
+  lights.push_back(Light::pointLight(glm::vec3(0.8, 0.0, 0.1), glm::vec3(-4, 2, 1)));
+  lightGrid = new LightGrid();
+  lightGrid->build(lights);
+
+  sceneBuffers.push_back(sphereBVHBuffer);
+  sceneBuffers.push_back(sphereBuffer);
+  sceneBuffers.push_back(sphereMaterialBuffer);
+  sceneBuffers.push_back(materialBuffer);
+  sceneBuffers.push_back(triangleScene->getInstanceBVHBuffer());
+  sceneBuffers.push_back(triangleScene->getInstanceBuffer());
+  for (unsigned int i = 0; i < sceneBuffers.size(); i++) {
+    sceneBuffers[i]->flush();
+  }
 
-    -4, 2, 1, 0,
-    0.8, 0.0, 0.1, 0
-  };
-  lightBlockId = glGetUniformBlockIndex(raytraceProgramId, "LightBlock");
-  glUniformBlockBinding(raytraceProgramId, lightBlockId, 2);
-  glBindBuffer(GL_UNIFORM_BUFFER, lightUBO);
-  glBufferData(GL_UNIFORM_BUFFER, sizeof(lights), lights, GL_DYNAMIC_DRAW);
+  // Each sampler has a fixed texture unit, so these only need setting once.
+  setSamplerUnits(raytraceProgramId);
+  glUseProgram(presentProgramId);
+  glUniform1i(glGetUniformLocation(presentProgramId, "image"), 0);
+  glUseProgram(varianceProgramId);
+  glUniform1i(glGetUniformLocation(varianceProgramId, "accumulation"), 0);
+
+  initializeWavefront();
 
   return true;
 }
 
 
 void Viewer::drawQuad() {
+  // Meshes draw with their own VAOs and unbind them afterwards.
+  glBindVertexArray(vertexArrayId);
   glEnableVertexAttribArray(0);
   glBindBuffer(GL_ARRAY_BUFFER, quadVertexBuffer);
   glVertexAttribPointer(
@@ -273,8 +552,23 @@ void Viewer::drawQuad() {
   glDisableVertexAttribArray(0);
 }
 
+void Viewer::drawTextureWithQuadProgram(GLuint tex, int texWidth, int texHeight) {
+  static GLuint pImageSizeId = glGetUniformLocation(presentProgramId, "imageSize");
+  static GLuint pScreenResolutionId = glGetUniformLocation(presentProgramId, "screenResolution");
+
+  glUseProgram(presentProgramId);
+  glViewport(0, 0, width, height);
+  bindRenderTarget(0);
 
-void Viewer::bindRenderTarget(GLuint renderTargetFBO) {
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, tex);
+  glUniform2f(pImageSizeId, texWidth, texHeight);
+  glUniform2f(pScreenResolutionId, width, height);
+  drawQuad();
+}
+
+
+void Viewer::bindRenderTarget(GLuint renderTargetFBO, int numColourAttachments) {
 
   checkGLErrors("bindRenderTarget start");
   // Render to target.
@@ -284,49 +578,414 @@ void Viewer::bindRenderTarget(GLuint renderTargetFBO) {
     glDrawBuffer(GL_FRONT_LEFT);
   } else {
     glBindFramebuffer(GL_FRAMEBUFFER, renderTargetFBO);
-    glDrawBuffer(GL_COLOR_ATTACHMENT0);
+    GLenum drawBuffers[MIN_REQUIRED_COLOUR_ATTACHMENTS];
+    for (int i = 0; i < numColourAttachments; i++) {
+      drawBuffers[i] = GL_COLOR_ATTACHMENT0 + i;
+    }
+    glDrawBuffers(numColourAttachments, drawBuffers);
   }
   checkGLErrors("bindRenderTarget end");
 }
 
 void Viewer::renderScene(GLuint renderTargetFBO, const glm::vec3& cameraPosition, const glm::vec3& cameraDirection, double currentTime, double deltaTime, bool doPicking) {
-
-  static GLuint rtCameraPositionId = glGetUniformLocation(raytraceProgramId, "cameraPosition");
-  static GLuint rtCameraDirectionId = glGetUniformLocation(raytraceProgramId, "cameraDirection");
-  static GLuint rtScreenResolutionId = glGetUniformLocation(raytraceProgramId, "screenResolution");
-
-  static GLuint rtNumSpheresId = glGetUniformLocation(raytraceProgramId, "numSpheres");
-  static GLuint rtNumLightsId = glGetUniformLocation(raytraceProgramId, "numLights");
-
-  static GLuint rtSkyboxId = glGetUniformLocation(raytraceProgramId, "skyboxTexture");
-
   glUseProgram(raytraceProgramId);
-  glViewport(0, 0, width, height);
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  glViewport(0, 0, renderWidth, renderHeight);
 
-  bindRenderTarget(renderTargetFBO);
+  // Colour, and the primary hits later frames reproject.
+  bindRenderTarget(renderTargetFBO, renderTargetFBO == 0 ? 1 : 2);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_NONE);
   glDisable(GL_DEPTH_TEST);
+
+  bindSceneTextures();
+  setSceneUniforms(raytraceProgramId, cameraPosition, cameraDirection);
+
+  drawQuad();
+}
+
+void Viewer::bindSceneTextures() {
   glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
 
   glActiveTexture(GL_TEXTURE0 + 0);
   glBindTexture(GL_TEXTURE_CUBE_MAP, skybox->getTextureId());
-  glUniform1i(rtSkyboxId, 0);
 
-  glUniform3fv(rtCameraPositionId, 1, &cameraPosition[0]);
-  glUniform3fv(rtCameraDirectionId, 1, &cameraDirection[0]);
+  glActiveTexture(GL_TEXTURE0 + 1);
+  glBindTexture(GL_TEXTURE_BUFFER, sphereBVHBuffer->getTextureId());
+
+  glActiveTexture(GL_TEXTURE0 + 2);
+  glBindTexture(GL_TEXTURE_BUFFER, triangleScene->getBVHBuffer()->getTextureId());
+
+  glActiveTexture(GL_TEXTURE0 + 3);
+  glBindTexture(GL_TEXTURE_BUFFER, triangleScene->getVertexBuffer()->getTextureId());
+
+  glActiveTexture(GL_TEXTURE0 + 4);
+  glBindTexture(GL_TEXTURE_BUFFER, triangleScene->getNormalBuffer()->getTextureId());
+
+  glActiveTexture(GL_TEXTURE0 + 5);
+  glBindTexture(GL_TEXTURE_BUFFER, triangleScene->getTriangleBuffer()->getTextureId());
+
+  glActiveTexture(GL_TEXTURE0 + 6);
+  glBindTexture(GL_TEXTURE_BUFFER, sphereBuffer->getTextureId());
+
+  glActiveTexture(GL_TEXTURE0 + 7);
+  glBindTexture(GL_TEXTURE_BUFFER, sphereMaterialBuffer->getTextureId());
+
+  glActiveTexture(GL_TEXTURE0 + 8);
+  glBindTexture(GL_TEXTURE_BUFFER, materialBuffer->getTextureId());
+
+  glActiveTexture(GL_TEXTURE0 + 9);
+  glBindTexture(GL_TEXTURE_BUFFER, lightGrid->getLightBuffer()->getTextureId());
 
-  float screenResolution[] = {width*1.0f, height*1.0f};
-  glUniform2fv(rtScreenResolutionId, 1, &screenResolution[0]);
+  glActiveTexture(GL_TEXTURE0 + 10);
+  glBindTexture(GL_TEXTURE_BUFFER, triangleScene->getInstanceBVHBuffer()->getTextureId());
 
-  glBindBufferBase(GL_UNIFORM_BUFFER, 0, sphereUBO);
-  glBindBufferBase(GL_UNIFORM_BUFFER, 1, materialUBO);
-  glBindBufferBase(GL_UNIFORM_BUFFER, 2, lightUBO);
+  glActiveTexture(GL_TEXTURE0 + 11);
+  glBindTexture(GL_TEXTURE_BUFFER, triangleScene->getInstanceBuffer()->getTextureId());
 
-  glUniform1i(rtNumLightsId, 2);
-  glUniform1i(rtNumSpheresId, NUM_SPHERES);
+  glActiveTexture(GL_TEXTURE0 + 12);
+  glBindTexture(GL_TEXTURE_CUBE_MAP, skybox->getIrradianceTextureId());
 
+  // The first sample of a new view starts in the other accumulation target,
+  // copying what it can from the last frame in this one.
+  int history = 1 - currentAccumulation;
+  glActiveTexture(GL_TEXTURE0 + 13);
+  glBindTexture(GL_TEXTURE_2D, accumulationTextures[history]);
+  glActiveTexture(GL_TEXTURE0 + 14);
+  glBindTexture(GL_TEXTURE_2D, hitTextures[history]);
+
+  glActiveTexture(GL_TEXTURE0 + 15);
+  glBindTexture(GL_TEXTURE_BUFFER, lightGrid->getGridBuffer()->getTextureId());
+}
+
+void Viewer::setSceneUniforms(GLuint programId, const glm::vec3& cameraPosition, const glm::vec3& cameraDirection) {
+  // Looked up each time, as several programs share these. Uniforms a program
+  // doesn't use are at -1, which glUniform ignores.
+  glUniform1f(glGetUniformLocation(programId, "skyboxMaxLod"), skybox->getMaxLod());
+
+  glUniform1i(glGetUniformLocation(programId, "reuseHistory"), historyValid && accumulatedSamples == 0);
+  glUniform3fv(glGetUniformLocation(programId, "previousCameraPosition"), 1, &previousCameraPosition[0]);
+  glUniform3fv(glGetUniformLocation(programId, "previousCameraDirection"), 1, &previousCameraDirection[0]);
+  glUniform2f(glGetUniformLocation(programId, "previousResolution"), previousRenderWidth, previousRenderHeight);
+  glUniform1i(glGetUniformLocation(programId, "frameIndex"), temporalFrame);
+
+  glUniform3fv(glGetUniformLocation(programId, "cameraPosition"), 1, &cameraPosition[0]);
+  glUniform3fv(glGetUniformLocation(programId, "cameraDirection"), 1, &cameraDirection[0]);
+
+  float screenResolution[] = {renderWidth*1.0f, renderHeight*1.0f};
+  glUniform2fv(glGetUniformLocation(programId, "screenResolution"), 1, &screenResolution[0]);
+
+  // The first sample goes through pixel centres, as interactive frames always
+  // did. Later ones spread over the pixel in a Halton sequence.
+  float pixelJitter[] = {0, 0};
+  if (accumulatedSamples > 0) {
+    pixelJitter[0] = halton(accumulatedSamples, 2) - 0.5f;
+    pixelJitter[1] = halton(accumulatedSamples, 3) - 0.5f;
+  }
+  glUniform2fv(glGetUniformLocation(programId, "pixelJitter"), 1, &pixelJitter[0]);
+
+  glUniform1i(glGetUniformLocation(programId, "numLights"), lightGrid->getNumLights());
+  glUniform1i(glGetUniformLocation(programId, "numGlobalLights"), lightGrid->getNumGlobalLights());
+  glUniform3fv(glGetUniformLocation(programId, "lightGridMin"), 1, &lightGrid->getBounds().min[0]);
+  glm::vec3 lightGridCellSize = lightGrid->getCellSize();
+  glUniform3fv(glGetUniformLocation(programId, "lightGridCellSize"), 1, &lightGridCellSize[0]);
+  glm::ivec3 lightGridDims = lightGrid->getDims();
+  glUniform3iv(glGetUniformLocation(programId, "lightGridDims"), 1, &lightGridDims[0]);
+  glUniform1i(glGetUniformLocation(programId, "sampleLights"), samplingLights);
+  // Different for every sample of every view, so light picks never repeat.
+  glUniform1i(glGetUniformLocation(programId, "sampleIndex"), temporalFrame * ACCUMULATION_MAX_SAMPLES + accumulatedSamples);
+  glUniform1i(glGetUniformLocation(programId, "numSpheres"), spheres.size());
+  glUniform1i(glGetUniformLocation(programId, "numInstances"), triangleScene->getNumInstances());
+}
+
+void Viewer::renderWavefront(const glm::vec3& cameraPosition, const glm::vec3& cameraDirection) {
+  // Looked up each time, as the programs change with selectPrograms().
+  GLint wShadeBounceId = glGetUniformLocation(wavefrontShadeProgramId, "bounce");
+  GLint wShadeWritePrimaryHitsId = glGetUniformLocation(wavefrontShadeProgramId, "writePrimaryHits");
+  GLint wAccumulateSampleWeightId = glGetUniformLocation(wavefrontAccumulateProgramId, "sampleWeight");
+
+  // Each stage must see the queues and counters the last one wrote, and
+  // indirect dispatches the counts dispatch.comp derived from them.
+  const GLbitfield stageBarrier = GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT;
+
+  bindSceneTextures();
+  GLuint programIds[] = {
+    wavefrontGenerateProgramId,
+    wavefrontExtendProgramId,
+    wavefrontShadeProgramId,
+    wavefrontShadowProgramId,
+    wavefrontAccumulateProgramId,
+  };
+  for (unsigned int i = 0; i < sizeof(programIds)/sizeof(GLuint); i++) {
+    glUseProgram(programIds[i]);
+    setSceneUniforms(programIds[i], cameraPosition, cameraDirection);
+  }
+  glUseProgram(wavefrontShadeProgramId);
+  glUniform1i(wShadeWritePrimaryHitsId, accumulatedSamples == 0);
+  glUseProgram(wavefrontAccumulateProgramId);
+  glUniform1f(wAccumulateSampleWeightId, 1.0f / (accumulatedSamples + 1));
+
+  // Zeroed in order with the GPU's other work, without waiting on it.
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, wavefrontCounterBuffer);
+  glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, wavefrontCounterBuffer);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, wavefrontHitBuffer);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, wavefrontShadowRayBuffer);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, wavefrontRadianceBuffer);
+  glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, wavefrontCounterBuffer);
+  glBindImageTexture(0, accumulationTextures[currentAccumulation], 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+  glBindImageTexture(1, hitTextures[currentAccumulation], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+
+  int tilesX = (renderWidth + WAVEFRONT_TILE_SIZE - 1) / WAVEFRONT_TILE_SIZE;
+  int tilesY = (renderHeight + WAVEFRONT_TILE_SIZE - 1) / WAVEFRONT_TILE_SIZE;
+
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, wavefrontPathBuffers[0]);
+  glUseProgram(wavefrontGenerateProgramId);
+  glDispatchCompute(tilesX, tilesY, 1);
+  glMemoryBarrier(stageBarrier);
+  glUseProgram(wavefrontDispatchProgramId);
+  glDispatchCompute(1, 1, 1);
+  glMemoryBarrier(stageBarrier);
+
+  // Every bounce is issued, as the GPU alone knows when the queue runs dry.
+  // By then the indirect dispatches are empty and cost next to nothing.
+  for (int bounce = 0; bounce < WAVEFRONT_MAX_BOUNCES; bounce++) {
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, wavefrontPathBuffers[bounce % 2]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, wavefrontPathBuffers[1 - bounce % 2]);
+
+    glUseProgram(wavefrontExtendProgramId);
+    glDispatchComputeIndirect(WAVEFRONT_PATH_GROUPS_OFFSET);
+    glMemoryBarrier(stageBarrier);
+
+    glUseProgram(wavefrontShadeProgramId);
+    glUniform1i(wShadeBounceId, bounce);
+    glDispatchComputeIndirect(WAVEFRONT_PATH_GROUPS_OFFSET);
+    glMemoryBarrier(stageBarrier);
+
+    glUseProgram(wavefrontDispatchProgramId);
+    glDispatchCompute(1, 1, 1);
+    glMemoryBarrier(stageBarrier);
+
+    glUseProgram(wavefrontShadowProgramId);
+    glDispatchComputeIndirect(WAVEFRONT_SHADOW_GROUPS_OFFSET);
+    glMemoryBarrier(stageBarrier);
+  }
+
+  glUseProgram(wavefrontAccumulateProgramId);
+  glDispatchCompute(tilesX, tilesY, 1);
+  // Later passes sample or blend into what the images were written with, and
+  // the next frame overwrites the counters.
+  glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+}
+
+std::string Viewer::shaderDefines() {
+  std::ostringstream defines;
+  defines << "#define LIGHT_DIFFUSE " << settings->isSet(Settings::LIGHT_DIFFUSE) << "\n";
+  defines << "#define LIGHT_SPECULAR " << settings->isSet(Settings::LIGHT_SPECULAR) << "\n";
+  defines << "#define SHADOWS " << settings->isSet(Settings::SHADOW_MAP) << "\n";
+  defines << "#define MIRRORS " << settings->isSet(Settings::MIRRORS) << "\n";
+  defines << "#define NUM_SPHERES " << spheres.size() << "\n";
+  defines << "#define NUM_INSTANCES " << triangleScene->getNumInstances() << "\n";
+  defines << "#define NUM_LIGHTS " << lightGrid->getNumLights() << "\n";
+  defines << "#define NUM_GLOBAL_LIGHTS " << lightGrid->getNumGlobalLights() << "\n";
+  return defines.str();
+}
+
+bool Viewer::selectPrograms() {
+  shaderCache->update();
+  std::string defines = shaderDefines();
+  if (defines == programDefines) {
+    return false;
+  }
+
+  GLuint raytraceId = shaderCache->getProgram("shaders/raytrace.vert", "shaders/raytrace.frag", defines);
+  bool ready = raytraceId != 0;
+  GLuint wavefrontIds[WAVEFRONT_STAGES];
+  for (int i = 0; i < WAVEFRONT_STAGES && wavefrontSupported; i++) {
+    wavefrontIds[i] = shaderCache->getComputeProgram(wavefrontShaderPaths[i], defines);
+    ready = ready && wavefrontIds[i] != 0;
+  }
+  if (!ready) {
+    return false;
+  }
+
+  if (programDefines.empty()) {
+    deleteStartupPrograms();
+  }
+  raytraceProgramId = raytraceId;
+  setSamplerUnits(raytraceProgramId);
+  if (wavefrontSupported) {
+    GLuint* programIds[] = {
+      &wavefrontGenerateProgramId,
+      &wavefrontExtendProgramId,
+      &wavefrontShadeProgramId,
+      &wavefrontShadowProgramId,
+      &wavefrontDispatchProgramId,
+      &wavefrontAccumulateProgramId,
+    };
+    for (int i = 0; i < WAVEFRONT_STAGES; i++) {
+      *programIds[i] = wavefrontIds[i];
+      setSamplerUnits(*programIds[i]);
+    }
+  }
+  programDefines = defines;
+  return true;
+}
+
+void Viewer::deleteStartupPrograms() {
+  glDeleteProgram(raytraceProgramId);
+  if (wavefrontSupported) {
+    glDeleteProgram(wavefrontGenerateProgramId);
+    glDeleteProgram(wavefrontExtendProgramId);
+    glDeleteProgram(wavefrontShadeProgramId);
+    glDeleteProgram(wavefrontShadowProgramId);
+    glDeleteProgram(wavefrontDispatchProgramId);
+    glDeleteProgram(wavefrontAccumulateProgramId);
+  }
+}
+
+bool Viewer::updateScene(double currentTime) {
+  // Bob the first sphere up and down, if asked to.
+  std::vector<int> changedSpheres;
+  if (controller->isAnimating() && !sceneSpheres.empty() && sceneSpheres[0].y != (float)sin(currentTime)) {
+    glm::vec4& sphere = sceneSpheres[0];
+    sphere.y = sin(currentTime);
+    glm::vec3 center(sphere);
+    glm::vec3 r(sphere.w);
+    sphereBounds[0] = AABB(center - r, center + r);
+    changedSpheres.push_back(0);
+  }
+
+  int oldNumNodes = sphereBVH.getNumNodes();
+  sphereBVH.refit(sphereBounds, changedSpheres, threadPool);
+
+  const std::vector<int>& sphereOrder = sphereBVH.getPrimitiveIndices();
+  const std::vector<IndexRange>& sphereRanges = sphereBVH.getDirtyPrimitiveRanges();
+  for (unsigned int r = 0; r < sphereRanges.size(); r++) {
+    const IndexRange& range = sphereRanges[r];
+    for (int i = range.begin; i < range.end; i++) {
+      spheres[i] = sceneSpheres[sphereOrder[i]];
+      sphereMaterials[i] = sceneSphereMaterials[sphereOrder[i]];
+    }
+    sphereBuffer->update(range.begin * sizeof(glm::vec4), range.size() * sizeof(glm::vec4), &spheres[range.begin]);
+    sphereMaterialBuffer->update(range.begin * sizeof(GLint), range.size() * sizeof(GLint), &sphereMaterials[range.begin]);
+  }
+
+  const std::vector<BVHNode>& nodes = sphereBVH.getNodes();
+  if (sphereBVH.getNumNodes() != oldNumNodes) {
+    sphereBVHBuffer->setData(&nodes[0], nodes.size() * sizeof(BVHNode));
+  } else {
+    const std::vector<IndexRange>& nodeRanges = sphereBVH.getDirtyNodeRanges();
+    for (unsigned int r = 0; r < nodeRanges.size(); r++) {
+      sphereBVHBuffer->update(nodeRanges[r].begin * sizeof(BVHNode), nodeRanges[r].size() * sizeof(BVHNode), &nodes[nodeRanges[r].begin]);
+    }
+  }
+
+  // Moving a mesh only refits the top level of the triangle scene.
+  for (unsigned int i = 0; i < meshes.size(); i++) {
+    triangleScene->setInstanceTransform(meshInstances[i], meshes[i]->getModelMatrix());
+  }
+  bool instancesMoved = triangleScene->update(threadPool);
+
+  for (unsigned int i = 0; i < sceneBuffers.size(); i++) {
+    sceneBuffers[i]->flush();
+  }
+  return !changedSpheres.empty() || instancesMoved;
+}
+
+void Viewer::resetAccumulation() {
+  accumulatedSamples = 0;
+  accumulationConverged = false;
+}
+
+void Viewer::accumulateSample(const glm::vec3& cameraPosition, const glm::vec3& cameraDirection, double currentTime, double deltaTime) {
+  if (accumulatedSamples == 0) {
+    currentAccumulation = 1 - currentAccumulation;
+    temporalFrame++;
+  }
+
+  glBeginQuery(GL_TIME_ELAPSED, timerQueries[timerQueryIdx]);
+  if (usingWavefront) {
+    renderWavefront(cameraPosition, cameraDirection);
+  } else {
+    // Running mean: sample n is weighted 1/n against the n-1 already there, so
+    // the first simply replaces whatever the target held. Only the first
+    // sample's hits, through pixel centres, are kept.
+    glEnablei(GL_BLEND, 0);
+    glBlendColor(0, 0, 0, 1.0f / (accumulatedSamples + 1));
+    glBlendFunc(GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA);
+    if (accumulatedSamples > 0) {
+      glColorMaski(1, GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    }
+    renderScene(accumulationFBOs[currentAccumulation], cameraPosition, cameraDirection, currentTime, deltaTime, true);
+    glColorMaski(1, GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDisablei(GL_BLEND, 0);
+  }
+  glEndQuery(GL_TIME_ELAPSED);
+  timerQueryPixels[timerQueryIdx] = renderWidth * renderHeight;
+  timerQueryIdx = (timerQueryIdx + 1) % RESOLUTION_TIMER_QUERIES;
+
+  historyValid = true;
+  previousCameraPosition = cameraPosition;
+  previousCameraDirection = cameraDirection;
+  previousRenderWidth = renderWidth;
+  previousRenderHeight = renderHeight;
+  for (unsigned int i = 0; i < sceneBuffers.size(); i++) {
+    sceneBuffers[i]->fence();
+  }
+  accumulatedSamples++;
+
+  if (accumulatedSamples >= ACCUMULATION_MAX_SAMPLES) {
+    accumulationConverged = true;
+  } else if (accumulatedSamples >= ACCUMULATION_MIN_SAMPLES && accumulatedSamples % ACCUMULATION_CHECK_INTERVAL == 0) {
+    accumulationConverged = getUnconvergedFraction() <= ACCUMULATION_UNCONVERGED_FRACTION;
+  }
+}
+
+float Viewer::getUnconvergedFraction() {
+  static GLuint vNumSamplesId = glGetUniformLocation(varianceProgramId, "numSamples");
+  static GLuint vErrorTargetId = glGetUniformLocation(varianceProgramId, "errorTarget");
+
+  glUseProgram(varianceProgramId);
+  bindRenderTarget(convergenceFBO);
+  // Only the corner being traced into is marked, the rest left at 0.
+  glViewport(0, 0, width, height);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glViewport(0, 0, renderWidth, renderHeight);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, accumulationTextures[currentAccumulation]);
+  glUniform1f(vNumSamplesId, accumulatedSamples);
+  glUniform1f(vErrorTargetId, ACCUMULATION_ERROR_TARGET);
   drawQuad();
+
+  // Average down to a single texel and read just that back.
+  int topLevel = 0;
+  while ((std::max(width, height) >> topLevel) > 1) {
+    topLevel++;
+  }
+  float unconverged = 0;
+  glBindTexture(GL_TEXTURE_2D, convergenceTexture);
+  glGenerateMipmap(GL_TEXTURE_2D);
+  glGetTexImage(GL_TEXTURE_2D, topLevel, GL_RED, GL_FLOAT, &unconverged);
+  return unconverged * ((double)width * height) / ((double)renderWidth * renderHeight);
+}
+
+void Viewer::touchTextures(const glm::vec3& cameraPosition) {
+  for (unsigned int i = 0; i < meshes.size(); i++) {
+    Material* material = meshes[i]->getMaterial();
+    const std::vector<BVHNode>& nodes = meshes[i]->getBVH().getNodes();
+    if (material == NULL || nodes.empty()) {
+      continue;
+    }
+    // Distance to the mesh's bounding sphere, in world space.
+    glm::mat4& model = meshes[i]->getModelMatrix();
+    glm::vec3 center = glm::vec3(model * glm::vec4((nodes[0].min + nodes[0].max) * 0.5f, 1.0f));
+    glm::vec3 corner = glm::vec3(model * glm::vec4(nodes[0].max, 1.0f));
+    float distance = glm::length(center - cameraPosition) - glm::length(corner - center);
+    int level = 0;
+    for (float detailDistance = TEXTURE_DETAIL_DISTANCE; distance > detailDistance; detailDistance *= 2) {
+      level++;
+    }
+    material->touch(level);
+  }
 }
 
 void Viewer::run() {
@@ -337,6 +996,10 @@ void Viewer::run() {
   double lastTime = glfwGetTime();
   long fpsDisplayCounter = 0;
   double lastFPSTime = lastTime;
+  // Only advances while animating, so the scene holds still by default.
+  double sceneTime = lastTime;
+  glm::vec3 lastCameraPosition;
+  glm::vec3 lastCameraDirection;
 
   do {
     double currentTime = glfwGetTime();
@@ -348,17 +1011,60 @@ void Viewer::run() {
     const glm::vec3& cameraPosition = controller->getPosition();
     const glm::vec3& cameraDirection = controller->getDirection();
 
-    // Main render of scene.
-    renderScene(0, cameraPosition, cameraDirection, currentTime, deltaTime, true);
+    if (controller->isAnimating()) {
+      sceneTime += deltaTime;
+    }
+    bool sceneChanged = updateScene(sceneTime);
+    Texture::streamTextures(TEXTURE_STREAM_BUDGET);
+    touchTextures(cameraPosition);
+    Texture::updateResidency(TEXTURE_RESIDENCY_BUDGET);
+
+    // Any change starts the accumulated image over from a single sample. The
+    // resolution only adapts then too, as changing it would do the same.
+    // Shading of surfaces that stayed put may have changed along with the
+    // scene, so only camera motion reuses the last frame.
+    bool wavefront = wavefrontSupported && controller->isWavefrontEnabled();
+    bool pipelineChanged = wavefront != usingWavefront;
+    usingWavefront = wavefront;
+    if (controller->isLightSamplingEnabled() != samplingLights) {
+      samplingLights = controller->isLightSamplingEnabled();
+      sceneChanged = true;
+    }
+    // Settings only take effect once programs built for them are ready.
+    if (selectPrograms()) {
+      sceneChanged = true;
+    }
+    if (sceneChanged || pipelineChanged || cameraPosition != lastCameraPosition || cameraDirection != lastCameraDirection) {
+      resetAccumulation();
+      updateRenderScale();
+      if (sceneChanged) {
+        historyValid = false;
+      }
+    }
+    lastCameraPosition = cameraPosition;
+    lastCameraDirection = cameraDirection;
+
+    // Main render of scene, unless a still view has already converged.
+    if (!accumulationConverged) {
+      accumulateSample(cameraPosition, cameraDirection, sceneTime, deltaTime);
+    }
+    drawTextureWithQuadProgram(accumulationTextures[currentAccumulation], renderWidth, renderHeight);
 
     // Swap buffers
     glfwSwapBuffers(window);
 
+    // Don't run ahead of TARGET_FPS, whether drawing a cheap frame or, once
+    // converged, nothing new at all.
+    double frameTime = glfwGetTime() - currentTime;
+    if (frameTime < TARGET_FRAME_DELTA) {
+      std::this_thread::sleep_for(std::chrono::duration<double>(TARGET_FRAME_DELTA - frameTime));
+    }
+
     fpsDisplayCounter++;
     if (fpsDisplayCounter % FPS_SAMPLE_RATE == 0) {
       double fpsDeltaTime = float(currentTime - lastFPSTime);
       lastFPSTime = currentTime;
-      std::cout << FPS_SAMPLE_RATE / fpsDeltaTime << "FPS" << std::endl;
+      std::cout << FPS_SAMPLE_RATE / fpsDeltaTime << "FPS at " << renderWidth << "x" << renderHeight << std::endl;
     }
 
     checkGLErrors("loop");
@@ -376,14 +1082,59 @@ Viewer::~Viewer() {
   delete settings;
   settings = NULL;
 
+  delete sphereBVHBuffer;
+  sphereBVHBuffer = NULL;
+  delete sphereBuffer;
+  sphereBuffer = NULL;
+  delete sphereMaterialBuffer;
+  sphereMaterialBuffer = NULL;
+  delete materialBuffer;
+  materialBuffer = NULL;
+  delete lightGrid;
+  lightGrid = NULL;
+  delete shaderCache;
+  shaderCache = NULL;
+  for (unsigned int i = 0; i < lights.size(); i++) {
+    delete lights[i];
+  }
+  lights.clear();
+  sceneBuffers.clear();
+
+  delete triangleScene;
+  triangleScene = NULL;
+
+  freeScene(meshes);
+
+  // After the materials, which hold references to textures.
+  const TextureStats& textureStats = Texture::getStats();
+  std::cout << "Textures: " << textureStats.residentBytes / 1024 << " KB resident, " << textureStats.hits << " hits, "
+    << textureStats.misses << " misses, " << textureStats.evictions << " evictions, "
+    << textureStats.droppedMips << " mips dropped, " << textureStats.restores << " restores" << std::endl;
   Texture::freeLoadedTextures();
 
-  glDeleteProgram(raytraceProgramId);
-  glDeleteVertexArrays(1, &vertexArrayId);
+  delete threadPool;
+  threadPool = NULL;
 
-  glDeleteBuffers(1, &sphereUBO);
-  glDeleteBuffers(1, &materialUBO);
-  glDeleteBuffers(1, &lightUBO);
+  // Specialized programs went with shaderCache.
+  if (programDefines.empty()) {
+    deleteStartupPrograms();
+  }
+  glDeleteProgram(presentProgramId);
+  glDeleteProgram(varianceProgramId);
+  glDeleteFramebuffers(2, accumulationFBOs);
+  glDeleteTextures(2, accumulationTextures);
+  glDeleteTextures(2, hitTextures);
+  glDeleteFramebuffers(1, &convergenceFBO);
+  glDeleteTextures(1, &convergenceTexture);
+  glDeleteQueries(RESOLUTION_TIMER_QUERIES, timerQueries);
+  if (wavefrontSupported) {
+    glDeleteBuffers(1, &wavefrontCounterBuffer);
+    glDeleteBuffers(2, wavefrontPathBuffers);
+    glDeleteBuffers(1, &wavefrontHitBuffer);
+    glDeleteBuffers(1, &wavefrontShadowRayBuffer);
+    glDeleteBuffers(1, &wavefrontRadianceBuffer);
+  }
+  glDeleteVertexArrays(1, &vertexArrayId);
 
   // Cleans up and closes window.
   glfwTerminate();
@@ -7,18 +7,33 @@
 #include <vector>
 #include "controller.hpp"
 #include "texture.hpp"
+#include "scenebuffer.hpp"
+#include "bvh.hpp"
+#include "threadpool.hpp"
 
 #define DEFAULT_WIDTH 1024
 #define DEFAULT_HEIGHT 768
+// Timer queries in flight, so each result is read frames after it was issued, without stalling.
+#define RESOLUTION_TIMER_QUERIES 4
 
 class Controller;
+class Mesh;
+class TriangleScene;
+class Light;
+class LightGrid;
+class ShaderCache;
 
 class Viewer {
 public:
   Viewer();
   ~Viewer();
 
-  bool initialize();
+  /**
+   * Set up GL state and the scene.
+   * modelFile is an optional model, loaded through loadScene() and ray traced alongside the spheres.
+   * With animate, the first sphere bobs up and down, which keeps the BVH refitting.
+   */
+  bool initialize(std::string modelFile = "", bool animate = false);
   void run();
 
   /**
@@ -27,7 +42,10 @@ public:
    */
   void renderScene(GLuint renderTargetFBO, const glm::vec3& cameraPosition, const glm::vec3& cameraDirection, double currentTime, double deltaTime, bool doPicking);
 
-  void bindRenderTarget(GLuint renderTargetFBO);
+  /**
+   * Draw to the first numColourAttachments attachments of an FBO.
+   */
+  void bindRenderTarget(GLuint renderTargetFBO, int numColourAttachments = 1);
 
   GLFWwindow* getWindow() {
     return window;
@@ -43,7 +61,11 @@ public:
   }
 
   void updateSize(int width, int height);
-  void drawTextureWithQuadProgram(GLuint tex);
+  /**
+   * Stretch the bottom left texWidth x texHeight of tex over the whole
+   * screen. Upscaling interpolates, but not across edges.
+   */
+  void drawTextureWithQuadProgram(GLuint tex, int texWidth, int texHeight);
   void drawQuad();
 
 private:
@@ -55,19 +77,161 @@ private:
 
   TextureCube* skybox;
 
+  ThreadPool* threadPool;
+
   GLuint raytraceProgramId;
+  GLuint presentProgramId;
+  GLuint varianceProgramId;
   GLuint depthRenderBuffer;
 
+  // Running mean of every sample of the current view, colour in rgb and
+  // squared luminance in a, so each pixel's variance can be estimated.
+  // Alongside, the first sample's primary hits: world position and distance,
+  // 0 for a miss. Each new view swaps to the other pair and reprojects the
+  // previous one into it.
+  GLuint accumulationFBOs[2];
+  GLuint accumulationTextures[2];
+  GLuint hitTextures[2];
+  int currentAccumulation;
+  // The other pair holds a frame of this scene, seen from previousCamera*.
+  bool historyValid;
+  // Counts new views, rotating which tiles are traced again despite a valid history.
+  int temporalFrame;
+  glm::vec3 previousCameraPosition;
+  glm::vec3 previousCameraDirection;
+  int previousRenderWidth;
+  int previousRenderHeight;
+  // 1 for each pixel that still needs samples, else 0.
+  GLuint convergenceFBO;
+  GLuint convergenceTexture;
+  int accumulatedSamples;
+  // Set once a still view needs no more samples, until something changes.
+  bool accumulationConverged;
+
+  // Fraction of the window's width and height ray traced, into the bottom
+  // left renderWidth x renderHeight of the accumulation target.
+  float renderScale;
+  int renderWidth;
+  int renderHeight;
+  // 0 until the first timer query returns.
+  double gpuTimePerPixel;
+  // GL_TIME_ELAPSED around each ray traced pass, and the pixels it traced.
+  GLuint timerQueries[RESOLUTION_TIMER_QUERIES];
+  int timerQueryPixels[RESOLUTION_TIMER_QUERIES];
+  int timerQueryIdx;
+
+  // Compute shader pipeline in shaders/wavefront, which needs GL 4.3: each
+  // bounce runs as separate stages over a compacted queue of live paths,
+  // instead of every pixel looping through all of them in raytrace.frag.
+  bool wavefrontSupported;
+  // Whether this view is being traced with it; see Controller::isWavefrontEnabled().
+  bool usingWavefront;
+  // Whether hits are shaded with lights sampled from the light tree; see
+  // Controller::isLightSamplingEnabled().
+  bool samplingLights;
+  GLuint wavefrontGenerateProgramId;
+  GLuint wavefrontExtendProgramId;
+  GLuint wavefrontShadeProgramId;
+  GLuint wavefrontShadowProgramId;
+  GLuint wavefrontDispatchProgramId;
+  GLuint wavefrontAccumulateProgramId;
+  // Shader storage for the Counters, PathsIn and PathsOut (swapping each
+  // bounce), Hits, ShadowRays and Radiance blocks of common.glsl.
+  GLuint wavefrontCounterBuffer;
+  GLuint wavefrontPathBuffers[2];
+  GLuint wavefrontHitBuffer;
+  GLuint wavefrontShadowRayBuffer;
+  GLuint wavefrontRadianceBuffer;
+
   GLuint vertexArrayId;
   GLuint quadVertexBuffer;
 
-  GLuint sphereUBO;
-  GLuint materialUBO;
-  GLuint lightUBO;
+  // Returns whether anything moved.
+  bool updateScene(double currentTime);
+  // Tell each mesh's textures which mips its distance from the camera needs.
+  void touchTextures(const glm::vec3& cameraPosition);
+
+  // (Re)allocate the accumulation and convergence targets at the window size.
+  void createAccumulationTargets();
+  void resetAccumulation();
+  // Clamped to [RESOLUTION_MIN_SCALE, 1].
+  void setRenderScale(float scale);
+  /**
+   * Pick up the GPU time of an earlier frame and move the scale towards
+   * holding the ray traced pass within its share of TARGET_FRAME_DELTA.
+   */
+  void updateRenderScale();
+  /**
+   * Blend one more jittered sample into the accumulation target, and decide
+   * whether the view has converged, after ACCUMULATION_MAX_SAMPLES or once
+   * few enough pixels have a standard error above ACCUMULATION_ERROR_TARGET.
+   */
+  void accumulateSample(const glm::vec3& cameraPosition, const glm::vec3& cameraDirection, double currentTime, double deltaTime);
+  // Fraction of pixels whose mean is still too uncertain. Stalls on a readback.
+  float getUnconvergedFraction();
+
+  // Bind every scene texture to its fixed unit, and set the uniforms the ray
+  // tracing programs share on programId, which must be in use.
+  void bindSceneTextures();
+  void setSceneUniforms(GLuint programId, const glm::vec3& cameraPosition, const glm::vec3& cameraDirection);
 
-  GLuint sphereBlockId;
-  GLuint materialBlockId;
-  GLuint lightBlockId;
+  /**
+   * #defines that specialize the ray tracing programs for the current
+   * Settings and scene: features switched off are compiled out, and scene
+   * counts become constants.
+   */
+  std::string shaderDefines();
+  /**
+   * Request programs built with shaderDefines() from shaderCache, and switch
+   * to them once every one is ready. Until then the last ones stay in use, so
+   * toggling a setting never waits on the compiler. Returns whether they changed.
+   */
+  bool selectPrograms();
+  // Delete the generic ray tracing programs built at startup. The viewer owns
+  // them only until selectPrograms() swaps in ones owned by shaderCache.
+  void deleteStartupPrograms();
+
+  // Build the wavefront programs and buffers if GL 4.3 is there. Returns wavefrontSupported.
+  bool initializeWavefront();
+  // (Re)allocate the queues for the window size.
+  void createWavefrontBuffers();
+  /**
+   * Trace one sample with the wavefront stages and blend it into the
+   * accumulation target: generate primary paths, then per bounce extend them
+   * to their hits, shade those, queueing shadow rays and continuing paths,
+   * and trace the shadow rays; finally accumulate each pixel's radiance.
+   */
+  void renderWavefront(const glm::vec3& cameraPosition, const glm::vec3& cameraDirection);
+
+  // Spheres as (center, radius) plus a material index, in scene order and
+  // in BVH leaf order as uploaded.
+  std::vector<glm::vec4> sceneSpheres;
+  std::vector<GLint> sceneSphereMaterials;
+  std::vector<glm::vec4> spheres;
+  std::vector<GLint> sphereMaterials;
+  std::vector<AABB> sphereBounds;
+  BVH sphereBVH;
+  SceneBuffer* sphereBVHBuffer;
+  SceneBuffer* sphereBuffer;
+  SceneBuffer* sphereMaterialBuffer;
+
+  std::vector<Mesh*> meshes;
+  // Instance in triangleScene for each of meshes.
+  std::vector<int> meshInstances;
+  TriangleScene* triangleScene;
+
+  SceneBuffer* materialBuffer;
+  std::vector<Light*> lights;
+  LightGrid* lightGrid;
+
+  // Specialized ray tracing programs, and the defines of those in use, which
+  // are empty for the generic ones built at startup. Programs from shaderCache
+  // are its own to delete; the viewer deletes only the startup ones.
+  ShaderCache* shaderCache;
+  std::string programDefines;
+
+  // Every SceneBuffer above, flushed before and fenced after each frame.
+  std::vector<SceneBuffer*> sceneBuffers;
 };
 
 bool checkGLFramebuffer();